@@ -33,9 +33,17 @@
  */
 #include <aboot.h>
 #include <bootimg.h>
+#include <bootimg_cache.h>
+#include <bootimg_load.h>
+#include <boot_prefetch.h>
 #include <bootreason.h>
+#include <boottrace.h>
+#include <bootslot.h>
 #include <board.h>
 #include <fastboot.h>
+#include <flash_stream.h>
+#include <flash_sparse.h>
+#include <flash_upload.h>
 #include <recovery.h>
 #include <version.h>
 #include <app.h>
@@ -44,6 +52,7 @@
 #include <compiler.h>
 #include <debug.h>
 #include <err.h>
+#include <lz4.h>
 #include <platform.h>
 #include <target.h>
 #include <reg.h>
@@ -62,6 +71,7 @@
 #include <lib/ptable.h>
 #include <lib/devinfo.h>
 #include <lib/fs.h>
+#include <lib/heap.h>
 #include <sys/types.h>
 #include <target/acpuclock.h>
 #include <target/hsusb.h>
@@ -374,6 +384,25 @@ void rem_menu_item(struct menu *xmenu,const int index)
 	return;
 }
 
+/*
+ * Multiboot menu setting: 0 hidden, 1 shown with a countdown,
+ * 2 only shown if a key is pressed while booting (the screen stays off).
+ * Each entry is the settings item offered in that state.
+ */
+/* how the kernel was reached, for the boot time log and trace */
+#define BOOT_PATH_FAST	0	/* menu hidden, straight to the kernel */
+#define BOOT_PATH_QUIET	1	/* after the quiet multiboot window */
+#define BOOT_PATH_UI	2	/* with the display up */
+static const char *boot_path_names[3] = { "fast", "quiet", "ui" };
+/* 'oem boottrace' point of the previous boot, its arg is the handoff time in ms */
+static const char *last_boot_traces[3] = { "last_boot_fast", "last_boot_quiet", "last_boot_ui" };
+
+static const char *multiboot_items[3][2] = {
+	{ "   SHOW MULTIBOOT MENU"		, "multiboot_1" },
+	{ "   MULTIBOOT MENU ON KEYPRESS"	, "multiboot_2" },
+	{ "   HIDE MULTIBOOT MENU"		, "multiboot_0" },
+};
+
 /*
  * koko : Change menu item's name and command
  */
@@ -615,6 +644,9 @@ char *get_partition_donor()
 	return (standard_ptn_present == 5 ? "boot" : "userdata");
 }
 
+// the user picked selected_boot, boot it even if it failed before
+static int bootslot_forced;
+
 // MAIN MENU
 void eval_main_menu(char *command)
 {
@@ -635,6 +667,7 @@ void eval_main_menu(char *command)
 		{
 			boot_into_recovery = 0;
 			selected_boot = (unsigned)atoi( subCommand );
+			bootslot_forced = 1;
 		}
 		//htcleo_ts_deinit();
 		boot_linux_from_flash();
@@ -1114,13 +1147,14 @@ void eval_sett_menu(char *command)
 	else if (!memcmp(command, "multiboot_", 10 ))
 	{
 		if ( device_boot_ptn_num() ){
-			int j = atoi( command + 10 );
+			int j = atoi( command + 10 ) % 3;
+			int old = device_info.multi_boot_screen % 3;
 			device_info.multi_boot_screen = j;
 			device_commit();
 			change_menu_item(&sett_menu,
-							(j ? "   SHOW MULTIBOOT MENU" : "   HIDE MULTIBOOT MENU"),
-							(j ? "   HIDE MULTIBOOT MENU" : "   SHOW MULTIBOOT MENU"),
-							(j ? "multiboot_0" : "multiboot_1"));
+							multiboot_items[old][0],
+							multiboot_items[j][0],
+							multiboot_items[j][1]);
 			redraw_menu();
 			selector_enable();
 		}
@@ -2275,60 +2309,13 @@ static int key_listener(void *arg)
 
 /*
  * koko : Get rom name from kernel's cmdline arg
- *		  as long as it is passed through 'rel_path'
- *		  as 1st or 2nd arg
+ *		  (parsed once per partition by the boot image cache)
  */
-char *get_rom_name_from_cmdline(struct ptentry *ptn)
+const char *get_rom_name_from_cmdline(struct ptentry *ptn)
 {
-	struct boot_img_hdr *hdr = (void*) buf;
-	char *cmdline;
-	char *tmp_buff;
-	
-	if(flash_read(ptn, 0, buf, page_size)) {
-		return "ERROR";
-	}
- 	if(memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
-		return "INVALID";
-	}
-	if (hdr->cmdline[0]) {
-		cmdline = (char*) hdr->cmdline;
-	} else {
-		return "NAND";
-	}
-	
- 	//In case the cmdline contains '\r' ,wtf?
-	if (strpbrk(cmdline, "\r") != NULL){
-		//cmdline = sreplace(cmdline, '\r', strlen(cmdline));
-		return "CrInCMDLINE";
-	}
+	const struct bootimg_info *info = bootimg_cache_get(ptn);
 
-	//Check if the cmdline has more then one args
-	if (strpbrk(cmdline, " ") != NULL) {
-		//check rel_path=$RomName as 1st arg
-		tmp_buff = strtok( cmdline, " " );
-		if (!memcmp(tmp_buff, "rel_path=", 9 )) {
-			tmp_buff = strchr( tmp_buff, '=' );
-			//final check for the lenght
-			return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
-		} else {
-			//check rel_path=$RomName as 2nd arg
-			tmp_buff = strtok( NULL, " " );
-			if (!memcmp(tmp_buff, "rel_path=", 9 )) {
-				tmp_buff = strchr( tmp_buff, '=' );
-				//final check for the lenght
-				return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
-			}
-		}
-	} else {
-		//only check rel_path=$RomName as 1st arg
-		if (!memcmp(cmdline, "rel_path=", 9 )) {
-			tmp_buff = strchr( cmdline, '=' );
-			//final check for the lenght
-			return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
-		}
-	}
-		
-	return "UNDEFINED";
+	return info ? info->rom_name : "ERROR";
 }
 
 void init_multiboot_menu()
@@ -2544,11 +2531,8 @@ void init_menu()
     }else{
       	add_menu_item(&sett_menu, "   SHOW STARTUP INFO"	, "info_1", k++);
     }
-	if (device_info.multi_boot_screen == 1){
-		add_menu_item(&sett_menu, "   HIDE MULTIBOOT MENU"	, "multiboot_0", k++);
-	}else{
-		add_menu_item(&sett_menu, "   SHOW MULTIBOOT MENU"	, "multiboot_1", k++);
-	}
+	add_menu_item(&sett_menu, multiboot_items[device_info.multi_boot_screen % 3][0],
+				  multiboot_items[device_info.multi_boot_screen % 3][1], k++);
 	add_menu_item(&sett_menu, "   SET DEFAULT KERNEL"   , "kernel_set",k++);
     if (msm_microp_i2c_status){
 		add_menu_item(&sett_menu, "   SET DEFAULT SCREEN BRIGHTNESS"   	, "screenb_set", k++);
@@ -2726,20 +2710,129 @@ void boot_linux(void *kernel, unsigned *tags,
 	entry(0, machtype, tags);
 }
 
+/*
+ * Boot slots: with more than one boot partition, a slot whose image does
+ * not load, or that was booted BOOTSLOT_MAX_TRIES times without coming
+ * back through a reboot, is skipped for the next one. A system that is
+ * powered off rather than rebooted confirms its boot by writing the
+ * BOOTSLOT_CONFIRM command to misc (like "boot-recovery"). The state is
+ * kept in page MISC_BOOTSLOT_PAGE of misc.
+ */
+static struct bootslot_state bootslot, bootslot_stored;
+static int bootslot_loaded;
+
+/* the booted system left BOOTSLOT_CONFIRM in misc; it is taken back so it counts once */
+static int bootslot_confirmed(void)
+{
+	struct recovery_message msg;
+
+	if (get_recovery_message(&msg)
+	    || strncmp(msg.command, BOOTSLOT_CONFIRM, sizeof(msg.command)))
+		return 0;
+	memset(msg.command, 0, sizeof(msg.command));
+	boot_prefetch_cancel();
+	set_recovery_message(&msg);
+	return 1;
+}
+
+static int bootslot_load(void)
+{
+	if (bootslot_loaded)
+		return 0;
+	if (misc_read(MISC_BOOTSLOT_PAGE, &bootslot, sizeof(bootslot)))
+		return -1;
+	memcpy(&bootslot_stored, &bootslot, sizeof(bootslot));
+	bootslot_init(&bootslot);
+	bootslot_start(&bootslot, htcleo_reboot_mode != 0, bootslot_confirmed());
+	bootslot_loaded = 1;
+	return 0;
+}
+
+static void bootslot_store(void)
+{
+	// Don't erase misc on every boot when nothing changed
+	if (!memcmp(&bootslot, &bootslot_stored, sizeof(bootslot)))
+		return;
+	// The write bumps the flash generation, which would void a prefetch
+	// still running anyway
+	boot_prefetch_cancel();
+	if (!misc_write(MISC_BOOTSLOT_PAGE, &bootslot, sizeof(bootslot)))
+		memcpy(&bootslot_stored, &bootslot, sizeof(bootslot));
+}
+
+static unsigned bootslot_present(struct ptable *ptable)
+{
+	unsigned present = 0;
+
+	for (unsigned i = 0; i < BOOTSLOT_COUNT; i++) {
+		if (ptable_find(ptable, supported_boot_partitions[i].name))
+			present |= (1 << i);
+	}
+	return present;
+}
+
+/*
+ * the slot to boot instead of 'selected_boot', -1 if none is usable;
+ * the caller stores the attempt once the image is loaded
+ */
+static int bootslot_select(struct ptable *ptable)
+{
+	int slot;
+
+	if (device_boot_ptn_num() < 2 || bootslot_load())
+		return selected_boot;
+
+	if (bootslot_forced)
+		bootslot_reset(&bootslot, selected_boot);
+	bootslot_forced = 0;
+
+	slot = bootslot_pick(&bootslot, selected_boot, bootslot_present(ptable));
+	if (slot >= 0) {
+		if (slot != (int) selected_boot)
+			printf("\n\n%s is not usable, falling back to %s\n",
+			       supported_boot_partitions[selected_boot].name,
+			       supported_boot_partitions[slot].name);
+		bootslot_attempt(&bootslot, slot);
+	}
+	return slot;
+}
+
+/* the image in the selected slot did not load, 1 if another slot can be tried */
+static int bootslot_fallback(struct ptable *ptable)
+{
+	bootslot_failed(&bootslot, selected_boot);
+	bootslot_store();
+	return bootslot_pick(&bootslot, selected_boot, bootslot_present(ptable)) >= 0;
+}
+
+/* a boot partition was just flashed, give it a fresh start */
+static void bootslot_flashed(const char *name)
+{
+	for (unsigned i = 0; i < BOOTSLOT_COUNT; i++) {
+		if (!strcmp(name, supported_boot_partitions[i].name)) {
+			if (!bootslot_load()) {
+				bootslot_reset(&bootslot, i);
+				bootslot_store();
+			}
+			return;
+		}
+	}
+}
+
 int boot_linux_from_flash(void)
 {	
 	struct boot_img_hdr *hdr = (void*) buf;
-	unsigned n;
 	struct ptentry *ptn;
 	struct ptable *ptable;
-	unsigned offset = 0;
 	char *cmdline;
-	char *err = "\n\nERROR: ";
+	char err[128];
+	int from_slot = 0;
 	run_usbcheck = 0;
-	
+
+	strcpy(err, "\n\nERROR: ");
 	ptable = flash_get_ptable();
 	if (ptable == NULL) {
-		strcat( err, "Partition table not found\n" );
+		strlcat( err, "Partition table not found\n", sizeof(err) );
 		goto failed;
 	}
 
@@ -2749,31 +2842,48 @@ int boot_linux_from_flash(void)
 		
         ptn = ptable_find(ptable, "recovery");
         if (ptn == NULL) {
-	        strcat( err, "No recovery partition found\n" );
+	        strlcat( err, "No recovery partition found\n", sizeof(err) );
 			boot_into_recovery=0;
 	        goto failed;
         }
 	} else {
+		int slot = bootslot_select(ptable);
+		if (slot < 0) {
+			// Every slot failed, recovery can still flash a good one
+			if (ptable_find(ptable, "recovery") != NULL) {
+				printf("\n\nNo usable boot partition, booting to recovery ...\n");
+				bootslot_store();
+				boot_into_recovery = 1;
+				return boot_linux_from_flash();
+			}
+			strlcat( err, "No usable boot partition found\n", sizeof(err) );
+			goto failed;
+		}
+		selected_boot = slot;
+		from_slot = bootslot_loaded;
+
 		printf("\n\nBooting from %s partition ...\n\n",
 				supported_boot_partitions[selected_boot].name);
 		
         ptn = ptable_find(ptable, supported_boot_partitions[selected_boot].name);
         if (ptn == NULL) {
-	        strcat( err, "No selected boot partition found\n" );
+	        strlcat( err, "No selected boot partition found\n", sizeof(err) );
 			goto failed;
         }
 	}
 	
-	if (flash_read(ptn, offset, buf, page_size)) { 
-		strcat( err, "Cannot read boot image header\n" );
+	// The header was most likely read already to build the menu
+	const struct bootimg_info *info = bootimg_cache_get(ptn);
+	if (info->status == BOOTIMG_ERROR) { 
+		strlcat( err, "Cannot read boot image header\n", sizeof(err) );
 		goto failed;
 	}
-	offset += page_size;
 
-	if (memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
-		strcat( err, "Invalid boot image header\n" );
+	if (info->status == BOOTIMG_INVALID) {
+		strlcat( err, "Invalid boot image header\n", sizeof(err) );
 		goto failed;
 	}
+	memcpy(hdr, &info->hdr, sizeof(*hdr));
 	
 #ifdef FORCE_BOOT_ADDR //currently undefined
 	hdr->kernel_addr = target_get_kernel_address();
@@ -2781,23 +2891,35 @@ int boot_linux_from_flash(void)
 #endif
 
 	if (hdr->page_size != page_size) {
-		strcat( err, "Invalid boot image pagesize\n" );
+		strlcat( err, "Invalid boot image pagesize\n", sizeof(err) );
 		goto failed;
 	}
 
-	n = ROUND_TO_PAGE(hdr->kernel_size, page_mask);
-	if (flash_read(ptn, offset, (void *)hdr->kernel_addr, n)) {
-		strcat( err, "Cannot read kernel image\n" );
-		goto failed;
-	}
-	offset += n;
-
-	n = ROUND_TO_PAGE(hdr->ramdisk_size, page_mask);
-	if (flash_read(ptn, offset, (void *)hdr->ramdisk_addr, n)) {
-		strcat( err, "Cannot read ramdisk image\n" );
-		goto failed;
+	// Most likely loaded already while the multiboot menu was counting down
+	// Otherwise read them (and expand LZ4 compressed ones) now
+	if (boot_prefetch_claim(ptn, hdr)) {
+		switch (bootimg_load(ptn, hdr, NULL)) {
+		case BOOTIMG_LOAD_KERNEL:
+			strlcat( err, "Cannot read kernel image\n", sizeof(err) );
+			goto failed;
+		case BOOTIMG_LOAD_RAMDISK:
+			strlcat( err, "Cannot read ramdisk image\n", sizeof(err) );
+			goto failed;
+		case BOOTIMG_LOAD_DIGEST:
+			// Don't boot a damaged kernel, recovery can still flash a good one
+			if (from_slot && bootslot_fallback(ptable))
+				return boot_linux_from_flash();
+			if (!boot_into_recovery && ptable_find(ptable, "recovery") != NULL) {
+				printf("\n\nBoot image is damaged, booting to recovery ...\n");
+				boot_into_recovery = 1;
+				return boot_linux_from_flash();
+			}
+			strlcat( err, "Boot image is damaged (SHA-1 mismatch)\n", sizeof(err) );
+			goto failed;
+		}
 	}
-	offset += n;
+	// Now that the image is in memory, the misc write can't spoil a prefetch
+	bootslot_store();
 
 	if (hdr->cmdline[0])
 		cmdline = (char*) hdr->cmdline;
@@ -2807,6 +2929,15 @@ int boot_linux_from_flash(void)
 	strcat(cmdline," clk=");
 	strcat(cmdline,PSUEDO_VERSION);
 
+	// How long we took, and whether the ui was up. Kept for 'oem boottrace'
+	// after the next warm reboot
+	unsigned boot_path = fbcon_display() ? BOOT_PATH_UI
+				: (device_info.multi_boot_screen == 2 ? BOOT_PATH_QUIET : BOOT_PATH_FAST);
+	dprintf(INFO, "boot: kernel loaded after %u ms (%s path)\n",
+			(unsigned) current_time(), boot_path_names[boot_path]);
+	TRACE_POINT("boot_linux");
+	target_save_boot_time((unsigned) current_time(), boot_path);
+
 #if TIMER_HANDLES_AUTOBOOT_EVENT
 	timer_cancel(&autoboot);
 #endif
@@ -2824,6 +2955,11 @@ int boot_linux_from_flash(void)
 
 failed:
 	{
+		// Try the next slot right away, there is nothing to read on screen
+		if (from_slot && bootslot_fallback(ptable)) {
+			printf("%s", err);
+			return boot_linux_from_flash();
+		}
 		if(fbcon_display() == NULL){
 			htcleo_display_init();//in case of (re)booting not from cLK's menu
 			fbcon_setfg(inverted ? 0x0000 : 0xffff);
@@ -2836,12 +2972,49 @@ failed:
 	}
 }
 
+/*
+ * Boot image downloads have their kernel and ramdisk received straight
+ * at the addresses 'fastboot boot' starts them from, saving a copy of
+ * both. Compressed ones are expanded from the download as before.
+ */
+static unsigned boot_image_splitter(const void *head, unsigned len,
+				    struct fastboot_split *split, unsigned max)
+{
+	const struct boot_img_hdr *hdr = head;
+	unsigned kernel = (unsigned) target_get_kernel_address();
+	unsigned ramdisk = (unsigned) target_get_ramdisk_address();
+	unsigned base = (unsigned) target_get_scratch_address();
+	unsigned kernel_actual, ramdisk_actual;
+
+	if (memcmp(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) || hdr->page_size != page_size
+		|| (BOOT_FLAGS(hdr) & (BOOT_FLAG_KERNEL_LZ4 | BOOT_FLAG_RAMDISK_LZ4)) || max < 2)
+		return 0;
+
+	kernel_actual = ROUND_TO_PAGE(hdr->kernel_size, page_mask);
+	ramdisk_actual = ROUND_TO_PAGE(hdr->ramdisk_size, page_mask);
+	if (page_size + kernel_actual + ramdisk_actual > len
+		|| kernel + kernel_actual > ramdisk || ramdisk + ramdisk_actual > base)
+		return 0;
+
+	split[0].offset = page_size;
+	split[0].len = kernel_actual;
+	split[0].dest = (void*) kernel;
+	split[1].offset = page_size + kernel_actual;
+	split[1].len = ramdisk_actual;
+	split[1].dest = (void*) ramdisk;
+	return 2;
+}
+
 void cmd_boot(const char *arg, void *data, unsigned sz)
 {
+	const struct fastboot_split *split;
 	unsigned kernel_actual;
 	unsigned ramdisk_actual __UNUSED;
 	static struct boot_img_hdr hdr;
 	char *ptr = ((char*) data);
+	unsigned kernel = (unsigned) target_get_kernel_address();
+	unsigned ramdisk = (unsigned) target_get_ramdisk_address();
+	int n;
 
 	if (sz < sizeof(hdr)) {
 		fastboot_fail("invalid bootimage header");
@@ -2856,8 +3029,30 @@ void cmd_boot(const char *arg, void *data, unsigned sz)
 	kernel_actual = ROUND_TO_PAGE(hdr.kernel_size, page_mask);
 	ramdisk_actual = ROUND_TO_PAGE(hdr.ramdisk_size, page_mask);
 
-	memmove(target_get_kernel_address(), ptr + page_size, hdr.kernel_size);
-	memmove(target_get_ramdisk_address(), ptr + page_size + kernel_actual, hdr.ramdisk_size);
+	if (fastboot_download_pieces(&split)) {
+		// Received in place already
+	} else if (BOOT_FLAGS(&hdr) & BOOT_FLAG_KERNEL_LZ4) {
+		n = lz4_legacy_decode(ptr + page_size, hdr.kernel_size, (void*) kernel, ramdisk - kernel);
+		if (n < 0) {
+			fastboot_fail("kernel lz4 data is corrupt");
+			return;
+		}
+	} else {
+		memmove((void*) kernel, ptr + page_size, hdr.kernel_size);
+	}
+	if (fastboot_download_pieces(&split)) {
+		// Received in place already
+	} else if (BOOT_FLAGS(&hdr) & BOOT_FLAG_RAMDISK_LZ4) {
+		n = lz4_legacy_decode(ptr + page_size + kernel_actual, hdr.ramdisk_size, (void*) ramdisk,
+				      (unsigned) data - ramdisk);
+		if (n < 0) {
+			fastboot_fail("ramdisk lz4 data is corrupt");
+			return;
+		}
+		hdr.ramdisk_size = n;
+	} else {
+		memmove((void*) ramdisk, ptr + page_size + kernel_actual, hdr.ramdisk_size);
+	}
 
 	fastboot_okay("");
 	target_battery_charging_enable(0, 1);
@@ -2891,10 +3086,141 @@ void cmd_erase(const char *arg, void *data, unsigned sz)
 	fastboot_okay("");
 }
 
+static int flash_ptn_is_boot(struct ptentry *ptn)
+{
+	return (!strcmp(ptn->name, "recovery")
+	|| !strcmp(ptn->name, "boot")
+	|| !strcmp(ptn->name, "sboot")
+	|| !strcmp(ptn->name, "tboot")
+	|| !strcmp(ptn->name, "vboot")
+	|| !strcmp(ptn->name, "wboot")
+	|| !strcmp(ptn->name, "xboot")
+	|| !strcmp(ptn->name, "yboot")
+	|| !strcmp(ptn->name, "zboot"));
+}
+
+static unsigned flash_ptn_extra(struct ptentry *ptn)
+{
+	if (!strcmp(ptn->name, "system") || !strcmp(ptn->name, "userdata"))
+		return ((page_size >> 9) * 16);
+	return 0;
+}
+
+/* 0: off, 1: verify the next flash only, 2: verify every flash */
+static int flash_verify_mode = 0;
+static int flash_verify_streamed = 0;
+
+static int flash_verify_take(void)
+{
+	int verify = (flash_verify_mode != 0);
+
+	if (flash_verify_mode == 1)
+		flash_verify_mode = 0;
+	return verify;
+}
+
+/* read back what was written and compare the checksums */
+static int flash_verify(struct ptentry *ptn, unsigned extra, unsigned bytes,
+			unsigned long crc, void *work)
+{
+	unsigned long got;
+	unsigned end = (unsigned) target_get_scratch_address() + target_get_scratch_size();
+	struct flash_stats before, after;
+
+	work = (void*) (((unsigned) work + 31) & ~31);
+	if ((unsigned) work + 2 * flash_write_chunk_size(extra) > end) {
+		printf("\n   no room to verify '%s'", ptn->name);
+		return -1;
+	}
+
+	printf("\n   verifying '%s'...", ptn->name);
+	flash_get_stats(&before);
+	if (flash_read_crc(ptn, extra, bytes, work, &got))
+		return -1;
+	flash_get_stats(&after);
+	if (got != crc) {
+		printf("\n   verify failed: crc %08lx, expected %08lx", got, crc);
+		return -1;
+	}
+	// blank pages were left erased, they only count as read if all 0xff
+	printf("\n   verified, crc %08lx (%u erased pages)", crc,
+	       after.pages_erased - before.pages_erased);
+	return 0;
+}
+
+/*
+ * Write a boot image download whose kernel and ramdisk were received in
+ * place, taking every page from wherever it ended up instead of joining
+ * the download first.
+ */
+static int flash_write_split(struct ptentry *ptn, const void *data, unsigned sz,
+			     const struct fastboot_split *split, unsigned n, unsigned long *crc)
+{
+	static const void *pages[64];
+	unsigned per_block = flash_write_chunk_size(0) / page_size;
+	unsigned total = sz / page_size;
+	unsigned p, i, k, count;
+
+	if (per_block > ARRAY_SIZE(pages) || flash_write_begin(ptn, 0))
+		return -1;
+
+	for (p = 0; p < total; p += count) {
+		count = MIN(per_block, total - p);
+		for (i = 0; i < count; i++) {
+			unsigned off = (p + i) * page_size;
+			const char *src = (const char*) data + off;
+
+			for (k = 0; k < n; k++)
+				if (off >= split[k].offset && off < split[k].offset + split[k].len)
+					src = (const char*) split[k].dest + (off - split[k].offset);
+			pages[i] = src;
+			if (crc)
+				*crc = flash_image_crc(*crc, src, page_size, 0);
+		}
+		if (flash_write_page_list(pages, count, total - p - count)) {
+			flash_write_abort();
+			return -1;
+		}
+	}
+	return flash_write_end();
+}
+
 void cmd_flash(const char *arg, void *data, unsigned sz)
 {
+	const struct fastboot_split *split;
+	unsigned pieces;
+
+	unsigned long crc = 0;
+	unsigned bytes;
+	int verify;
+
 	redraw_menu();
 
+	// The image was already written while it was downloaded
+	struct ptentry *streamed = flash_stream_pending();
+	if (streamed != NULL) {
+		int r = flash_stream_finish(&crc, &bytes);
+		if (strcmp(streamed->name, arg)) {
+			fastboot_fail("download was streamed to another partition");
+			return;
+		}
+		if (r) {
+			fastboot_fail("flash write failure");
+			return;
+		}
+		if (flash_verify_streamed
+			&& flash_verify(streamed, flash_ptn_extra(streamed), bytes, crc,
+					target_get_scratch_address())) {
+			fastboot_fail("flash verify failure");
+			return;
+		}
+		printf( "\n   partition '%s' updated", streamed->name);
+		bootslot_flashed(streamed->name);
+		selector_enable();
+		fastboot_okay("");
+		return;
+	}
+
 	struct ptable *ptable = flash_get_ptable();
 	if (ptable == NULL) {
 		fastboot_fail("partition table doesn't exist");
@@ -2907,34 +3233,56 @@ void cmd_flash(const char *arg, void *data, unsigned sz)
 		return;
 	}
 	
-	if(!strcmp(ptn->name, "recovery")
-	|| !strcmp(ptn->name, "boot")
-	|| !strcmp(ptn->name, "sboot")
-	|| !strcmp(ptn->name, "tboot")
-	|| !strcmp(ptn->name, "vboot")
-	|| !strcmp(ptn->name, "wboot")
-	|| !strcmp(ptn->name, "xboot")
-	|| !strcmp(ptn->name, "yboot")
-	|| !strcmp(ptn->name, "zboot")) {
+	if (flash_ptn_is_boot(ptn)) {
 		if (memcmp((void *)data, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
 			fastboot_fail("image is not a boot image");
 			return;
 		}
 	}
 	
-	unsigned extra = 0;
-	if (!strcmp(ptn->name, "system") || !strcmp(ptn->name, "userdata")) {
-		extra = ((page_size >> 9) * 16);
-	} else {
+	verify = flash_verify_take();
+	unsigned extra = flash_ptn_extra(ptn);
+	pieces = fastboot_download_pieces(&split);
+	if (pieces && extra) {
+		// spare bytes interleave the pages, join the image first
+		fastboot_download_join();
+		pieces = 0;
+	}
+	if (pieces) {
 		sz = ROUND_TO_PAGE(sz, page_mask);
+		printf( "   writing %d bytes to '%s'...\n", sz, ptn->name);
+		if (flash_write_split(ptn, data, sz, split, pieces, verify ? &crc : NULL)) {
+			fastboot_fail("flash write failure");
+			return;
+		}
+		bytes = sz;
+	} else if (flash_is_sparse(data, sz)) {
+		printf( "   writing sparse image (%d bytes) to '%s'...\n", sz, ptn->name);
+		if (flash_write_sparse(ptn, extra, data, sz, verify ? &crc : NULL, &bytes)) {
+			fastboot_fail("flash write failure");
+			return;
+		}
+	} else {
+		if (!extra) {
+			sz = ROUND_TO_PAGE(sz, page_mask);
+		}
+
+		printf( "   writing %d bytes to '%s'...\n", sz, ptn->name);
+		if (flash_write(ptn, extra, data, sz)) {
+			fastboot_fail("flash write failure");
+			return;
+		}
+		bytes = sz;
+		if (verify)
+			crc = flash_image_crc(0, data, sz, extra);
 	}
 
-	printf( "   writing %d bytes to '%s'...\n", sz, ptn->name);
-	if (flash_write(ptn, extra, data, sz)) {
-		fastboot_fail("flash write failure");
+	if (verify && flash_verify(ptn, extra, bytes, crc, (char*) data + sz)) {
+		fastboot_fail("flash verify failure");
 		return;
 	}
 	printf( "\n   partition '%s' updated", ptn->name);
+	bootslot_flashed(ptn->name);
 
 	selector_enable();
 	fastboot_okay("");
@@ -2992,26 +3340,48 @@ void cmd_powerdown(const char *arg, void *data, unsigned sz)
 	thread_exit(0);
 }
 
+/*
+ * Memory dumps are not sent as hex in INFO lines any more: the range is
+ * staged and read in binary by the next 'upload' (fastboot get_staged,
+ * or oem_dump on the host which does both steps).
+ */
+static char *mem_start;
+static unsigned mem_len;
+
+static unsigned mem_upload_start(void)
+{
+	return mem_len;
+}
+
+static int mem_upload_send(unsigned len)
+{
+	char *p = mem_start;
+
+	while (len > 0) {
+		unsigned n = len > UDC_MAX_REQUEST ? UDC_MAX_REQUEST : len;
+		if (fastboot_write(p, n) < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static struct fastboot_source mem_upload = {
+	.start		= mem_upload_start,
+	.send		= mem_upload_send,
+};
+
 void send_mem(char* start, int len)
 {
-	char response[64];
-	while(len>0)
-	{
-		int slen = len > 29 ? 29 : len;
-		memcpy(response, "INFO", 4);
-		response[4]=slen;
+	char msg[64];
 
-		for(int i=0; i<slen; i++)
-		{
-			response[5+i*2] = charVal(start[i]>>4);
-			response[5+i*2+1]= charVal(start[i]);
-		}
-		response[5+slen*2+1]=0;
-		fastboot_write(response, 5+slen*2);
+	mem_start = start;
+	mem_len = (len > 0) ? (unsigned)len : 0;
+	fastboot_set_upload_source(&mem_upload);
 
-		start+=slen;
-		len-=slen;
-	}
+	snprintf(msg, sizeof(msg), "%u bytes staged, fetch with get_staged", mem_len);
+	fastboot_info(msg);
 }
 
 void cmd_oem_smesg()
@@ -3072,18 +3442,19 @@ void cmd_oem_set(const char *arg)
 	{
 		case 's':
 			memcpy((void*)str2u(sAddr), sVal, strlen(sVal));
-			send_mem((char*)str2u(sAddr), strlen(sVal));
+			snprintf(buff, sizeof(buff), "%.*s", (int)strlen(sVal), (char*)str2u(sAddr));
+			fastboot_info(buff);
 			break;
 		case 'c':
 			*((char*)str2u(sAddr)) = (char)str2u(sVal);
 			sprintf(buff, "%x", *((char*)str2u(sAddr)));
-			send_mem(buff, strlen(buff));
+			fastboot_info(buff);
 			break;
 		case 'w':
 		default:
 			*((int*)str2u(sAddr)) = str2u(sVal);
 			sprintf(buff, "%x", *((int*)str2u(sAddr)));
-			send_mem(buff, strlen(buff));
+			fastboot_info(buff);
 	}
 
 	selector_enable();
@@ -3250,6 +3621,228 @@ void cmd_oem_nand_status(void)
 	fastboot_okay("");
 }
 
+void cmd_oem_flash_stat(void)
+{
+	char msg[60];
+	struct flash_stats st;
+
+	redraw_menu();
+
+	flash_get_stats(&st);
+	printf("   pages read: %d (erased %d), programmed: %d, blank skipped: %d\n",
+		st.pages_read, st.pages_erased, st.pages_written, st.pages_blank);
+	printf("   blocks erased: %d, dmov requests: %d\n", st.blocks_erased, st.dmov_submits);
+	printf("   block lookups: %d, bad block probes: %d\n", st.l2p_lookups, st.l2p_probes);
+	snprintf(msg, sizeof(msg), "programmed %u, blank skipped %u", st.pages_written, st.pages_blank);
+	fastboot_info(msg);
+	snprintf(msg, sizeof(msg), "read %u, erased %u blocks, dmov %u",
+		st.pages_read, st.blocks_erased, st.dmov_submits);
+	fastboot_info(msg);
+
+	selector_enable();
+	fastboot_okay("");
+}
+
+/* 'oem perf': usb counters, the time the last commands took and the heap slabs */
+void cmd_oem_perf(void)
+{
+	char msg[60];
+	struct udc_stats st;
+	struct fastboot_perf perf;
+	struct heap_slab_stats slab;
+
+	redraw_menu();
+
+	udc_get_stats(&st);
+	printf("   usb in: %u KB, out: %u KB, requests: %u, dTDs: %u\n",
+		st.bytes_in >> 10, st.bytes_out >> 10, st.requests, st.dtds);
+	printf("   naks: %u, reprimes: %u, errors: %u, resets: %u, retries: %u\n",
+		st.naks, st.reprimes, st.errors, st.resets, st.retries);
+	snprintf(msg, sizeof(msg), "usb in %uK out %uK, %u requests, %u dtds",
+		 st.bytes_in >> 10, st.bytes_out >> 10, st.requests, st.dtds);
+	fastboot_info(msg);
+	snprintf(msg, sizeof(msg), "naks %u, reprimes %u, errors %u, resets %u, retries %u",
+		 st.naks, st.reprimes, st.errors, st.resets, st.retries);
+	fastboot_info(msg);
+
+	// oldest first, like a log
+	for (int n = FASTBOOT_PERF_CMDS - 1; n >= 0; n--) {
+		if (fastboot_get_perf(n, &perf))
+			continue;
+		snprintf(msg, sizeof(msg), "%s: %u ms, %u KB, %u KB/s", perf.name,
+			 perf.usec / 1000, perf.bytes >> 10, fastboot_perf_rate(&perf));
+		fastboot_info(msg);
+	}
+
+	for (unsigned n = 0; !heap_get_slab_stats(n, &slab); n++) {
+		snprintf(msg, sizeof(msg), "slab %u: %u used (peak %u), %u pages, %u allocs",
+			 slab.size, slab.inuse, slab.peak, slab.slabs, slab.allocs);
+		fastboot_info(msg);
+	}
+
+	selector_enable();
+	fastboot_okay("");
+}
+
+static void nandbench_report(const char *what, unsigned bytes, unsigned ms,
+			     struct flash_stats *before, struct flash_stats *after)
+{
+	char msg[60];
+	unsigned pages = bytes / page_size;
+	unsigned kb = bytes / 1024;
+
+	if (ms == 0)
+		ms = 1;
+	snprintf(msg, sizeof(msg), "%s: %u pages in %u ms, %u pages/s, %u KB/s",
+		 what, pages, ms, pages * 1000 / ms, kb * 1000 / ms);
+	printf("   %s\n", msg);
+	fastboot_info(msg);
+	snprintf(msg, sizeof(msg), "%s: %u dmov requests per MB",
+		 what, (after->dmov_submits - before->dmov_submits) * 1024 / (kb ? kb : 1));
+	printf("   %s\n", msg);
+	fastboot_info(msg);
+}
+
+/* 'oem nandbench name [wipe]': time reads of (up to 8MB of) a partition,
+ * the verify checksum over what was read, the bad block translation and,
+ * for cache only, writing a test pattern.
+ * The write destroys what cache holds, it is erased afterwards and has to
+ * be asked for with 'wipe'.
+ */
+void cmd_oem_nandbench(const char *arg)
+{
+	char name[32];
+	char msg[60];
+	struct flash_stats before, after;
+	unsigned bytes, ms;
+	int write = 0;
+	const char *fail = NULL;
+
+	redraw_menu();
+
+	while(*arg==' ') arg++;
+	strncpy(name, arg, sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	char *opt = strchr(name, ' ');
+	if (opt) {
+		*opt++ = 0;
+		write = !strcmp(opt, "wipe");
+		if (!write) {
+			fail = "the write benchmark wipes cache, ask for it with 'wipe'";
+			goto out;
+		}
+	}
+
+	struct ptentry *ptn = ptable_find(flash_get_ptable(), name[0] ? name : "cache");
+	if (ptn == NULL) {
+		fail = "unknown partition name";
+		goto out;
+	}
+	if (write && strcmp(ptn->name, "cache")) {
+		fail = "write benchmark only runs on cache";
+		goto out;
+	}
+
+	bytes = MIN(ptn->length * flash_info->block_size, 8 * 1024 * 1024);
+	bytes = MIN(bytes, target_get_scratch_size());
+
+	flash_get_stats(&before);
+	ms = current_time();
+	if (flash_read(ptn, 0, target_get_scratch_address(), bytes)) {
+		fail = "flash read failure";
+		goto out;
+	}
+	ms = current_time() - ms;
+	flash_get_stats(&after);
+	nandbench_report("read", bytes, ms, &before, &after);
+
+	/* the checksum 'oem flash-verify' runs over what it reads back */
+	bigtime_t us = current_time_hires();
+	flash_image_crc(0, target_get_scratch_address(), bytes, 0);
+	us = current_time_hires() - us;
+	snprintf(msg, sizeof(msg), "verify crc32: %u KB/s", (unsigned) ((bytes / 1024) * 1000000ULL / (us ? us : 1)));
+	printf("   %s\n", msg);
+	fastboot_info(msg);
+
+	snprintf(msg, sizeof(msg), "block lookup: %u ns over %d blocks",
+		 flash_bench_translate(ptn, 100000), ptn->length);
+	printf("   %s\n", msg);
+	fastboot_info(msg);
+
+	if (write) {
+		// a pattern without blank pages, every page gets programmed
+		unsigned *pattern = (unsigned*) target_get_scratch_address();
+		for (unsigned n = 0; n < bytes / 4; n++)
+			pattern[n] = n;
+
+		flash_get_stats(&before);
+		ms = current_time();
+		int r = flash_write(ptn, 0, pattern, bytes);
+		ms = current_time() - ms;
+		flash_get_stats(&after);
+		if (flash_erase(ptn) || r) {
+			fail = r ? "flash write failure" : "flash erase failure";
+			goto out;
+		}
+		nandbench_report("write", bytes, ms, &before, &after);
+		snprintf(msg, sizeof(msg), "write: %u blocks erased",
+			 after.blocks_erased - before.blocks_erased);
+		printf("   %s\n", msg);
+		fastboot_info(msg);
+		fastboot_info("cache was erased");
+	}
+
+out:
+	selector_enable();
+	if (fail)
+		fastboot_fail(fail);
+	else
+		fastboot_okay("");
+}
+
+/* 'oem boottrace': one "bt <usec> <B|E|P> <name> <arg>" line per trace point */
+void cmd_oem_boottrace(void)
+{
+	static struct boottrace_entry entries[BOOTTRACE_ENTRIES];
+	char msg[64];
+	unsigned count, lost;
+
+	count = boottrace_read(entries, BOOTTRACE_ENTRIES, &lost);
+	snprintf(msg, sizeof(msg), "boottrace %u entries, %u lost", count, lost);
+	fastboot_info(msg);
+	for (unsigned n = 0; n < count; n++) {
+		snprintf(msg, sizeof(msg), "bt %u %c %s %u", entries[n].usec,
+			 entries[n].type, entries[n].name, entries[n].arg);
+		fastboot_info(msg);
+	}
+	fastboot_okay("");
+}
+
+/* 'oem bootslot [reset]': the boot slot state, or trust every slot again */
+void cmd_oem_bootslot(const char *arg)
+{
+	char msg[64];
+
+	while (*arg == ' ') arg++;
+	if (bootslot_load()) {
+		fastboot_fail("cannot read misc");
+		return;
+	}
+	if (!memcmp(arg, "reset", 5)) {
+		for (unsigned i = 0; i < BOOTSLOT_COUNT; i++)
+			bootslot_reset(&bootslot, i);
+		bootslot_store();
+	}
+
+	for (unsigned i = 0; i < BOOTSLOT_COUNT; i++) {
+		snprintf(msg, sizeof(msg), "%s tries %u%s%s", supported_boot_partitions[i].name,
+			 bootslot.tries[i], bootslot.bad[i] ? " bad" : "",
+			 bootslot.last == i ? " (last)" : "");
+		fastboot_info(msg);
+	}
+	fastboot_okay("");
+}
+
 void cmd_oem_part_format_all()
 {
 	redraw_menu();
@@ -3332,12 +3925,17 @@ void oem_help()
 	printf("\n");
 	printf("=> fastboot oem key x (where x=8,2,5,0)\n   Simulate keys using fastboot(8:UP,2:DOWN,5:YES,0:BACK)\n");
 	printf("=> fastboot oem set[c,w,s] addr value\n   Set char(1byte), word(4 bytes), or string\n");
-	printf("=> fastboot oem pwf addr len\n   Dump memory\n");
+	printf("=> fastboot oem pwf addr len\n   Dump memory (get_staged, or oem_dump on the host)\n");
 	printf("=> fastboot oem boot-recovery\n   Boot from recovery\n");
-	printf("=> fastboot oem dmesg\n   Kernel debug messages\n");
-	printf("=> fastboot oem smesg\n   Spl messages\n");
+	printf("=> fastboot oem dmesg\n   Kernel debug messages (get_staged, or oem_dump)\n");
+	printf("=> fastboot oem smesg\n   Spl messages (get_staged, or oem_dump)\n");
 	printf("=> fastboot oem poweroff\n   Powerdown\n");
 	printf("=> fastboot oem nandstat\n   Print nand info\n");
+	printf("=> fastboot oem flashstat\n   Flash layer counters (pages, erases, dmov requests)\n");
+	printf("=> fastboot oem perf\n   Usb counters, time of the last commands (getvar perf-usb, perf-cmd), heap slabs\n");
+	printf("=> fastboot oem nandbench [name] [wipe]\n   Time reads of a partition (wipe: writes on cache, erasing it)\n");
+	printf("=> fastboot oem boottrace\n   Dump the boot phase trace points (parse with boottrace_parse)\n");
+	printf("=> fastboot oem bootslot [reset]\n   Boot slot tries and failures (or clear them)\n");
 	printf("=> fastboot oem part-list\n   Display current partition layout\n");
 	printf("=> fastboot oem part-add name:size\n   Create new partition with given name and size in MB\n");
 	printf("=> fastboot oem part-add name:size:b\n   Create new partition with given name and size in blocks\n");
@@ -3349,6 +3947,9 @@ void oem_help()
 	printf("=> fastboot oem part-resize name:size:b\n   Resize partition with given name to new size in blocks\n");
 	printf("=> fastboot oem part-create-default\n   Delete current partition table and create default one\n");
 	printf("=> fastboot oem format-all\n   Wipe complete nand (except clk)\n");
+	printf("=> fastboot oem stream-flash name\n   Write the next download to partition while receiving it\n");
+	printf("=> fastboot oem flash-verify [on|off]\n   Read back and check the next (or every) flash\n");
+	printf("=> fastboot oem stage-ptn name [spare]\n   Read partition back with 'fastboot get_staged file'\n");
 	printf("=> fastboot oem reset\n   Reset settings (wipe DEVINFO)\n");
 	printf("=> fastboot flash lk lk.img\n   Update clk through fastboot using proper image file");
 }
@@ -3476,6 +4077,92 @@ void cmd_oem_mark_block(const char *arg)
 	fastboot_okay("");
 }
 
+void cmd_oem_stream_flash(const char *arg)
+{
+	redraw_menu();
+
+	struct ptable *ptable = flash_get_ptable();
+	if (ptable == NULL) {
+		fastboot_fail("partition table doesn't exist");
+		return;
+	}
+
+	struct ptentry *ptn = ptable_find(ptable, arg);
+	if (ptn == NULL) {
+		fastboot_fail("unknown partition name");
+		return;
+	}
+
+	flash_verify_streamed = flash_verify_take();
+	if (flash_stream_arm(ptn, flash_ptn_extra(ptn), flash_ptn_is_boot(ptn),
+			     flash_verify_streamed)) {
+		fastboot_fail("streaming not possible");
+		return;
+	}
+	printf("   next download goes straight to '%s'\n", ptn->name);
+
+	selector_enable();
+	fastboot_okay("");
+}
+
+/* 'oem stage-ptn name [spare]': the next 'fastboot get_staged' reads name back */
+void cmd_oem_stage_ptn(const char *arg)
+{
+	char name[MAX_PTENTRY_NAME];
+	unsigned extra = 0;
+	unsigned n;
+
+	redraw_menu();
+
+	while (*arg == ' ') arg++;
+	for (n = 0; arg[n] && arg[n] != ' ' && n < sizeof(name) - 1; n++)
+		name[n] = arg[n];
+	name[n] = 0;
+	if (strstr(arg + n, "spare"))
+		extra = (page_size >> 9) * 16;
+
+	struct ptable *ptable = flash_get_ptable();
+	if (ptable == NULL) {
+		fastboot_fail("partition table doesn't exist");
+		return;
+	}
+
+	struct ptentry *ptn = ptable_find(ptable, name);
+	if (ptn == NULL) {
+		fastboot_fail("unknown partition name");
+		return;
+	}
+
+	if (flash_upload_arm(ptn, extra)) {
+		fastboot_fail("upload not possible");
+		return;
+	}
+	printf("   next upload reads '%s'%s\n", ptn->name, extra ? " with spare" : "");
+
+	selector_enable();
+	fastboot_okay("");
+}
+
+void cmd_oem_flash_verify(const char *arg)
+{
+	redraw_menu();
+
+	while(*arg==' ') arg++;
+	if (!strcmp(arg, "on")) {
+		flash_verify_mode = 2;
+		printf("   every flash is verified\n");
+	} else if (!strcmp(arg, "off")) {
+		flash_verify_mode = 0;
+		printf("   flash verification off\n");
+	} else {
+		flash_verify_mode = 1;
+		printf("   the next flash is verified\n");
+	}
+
+	selector_enable();
+	fastboot_okay("");
+}
+
 void cmd_oem(const char *arg, void *data, unsigned sz)
 {
 	while(*arg==' ') arg++;
@@ -3488,6 +4175,11 @@ void cmd_oem(const char *arg, void *data, unsigned sz)
 	if(memcmp(arg, "dmesg", 5)==0)                         cmd_oem_dmesg();
 	if(memcmp(arg, "smesg", 5)==0)                         cmd_oem_smesg();
 	if(memcmp(arg, "nandstat", 8)==0)                      cmd_oem_nand_status();
+	if(memcmp(arg, "flashstat", 9)==0)                     cmd_oem_flash_stat();
+	if(memcmp(arg, "perf", 4)==0)                          cmd_oem_perf();
+	if(memcmp(arg, "nandbench", 9)==0)                     cmd_oem_nandbench(arg+9);
+	if(memcmp(arg, "boottrace", 9)==0)                     cmd_oem_boottrace();
+	if(memcmp(arg, "bootslot", 8)==0)                      cmd_oem_bootslot(arg+8);
 	if(memcmp(arg, "poweroff", 8)==0)                      cmd_powerdown(arg+8, data, sz);
 	if(memcmp(arg, "part-add ", 9)==0)                     cmd_oem_part_add(arg+9);
 	if(memcmp(arg, "part-del ", 9)==0)                     cmd_oem_part_del(arg+9);
@@ -3498,6 +4190,9 @@ void cmd_oem(const char *arg, void *data, unsigned sz)
 	if(memcmp(arg, "format-all", 10)==0)                   cmd_oem_part_format_all();
 	if(memcmp(arg, "part-commit", 11)==0)                  cmd_oem_part_commit();
 	if(memcmp(arg, "part-resize ", 12)==0)                 cmd_oem_part_resize(arg+12);
+	if(memcmp(arg, "stream-flash ", 13)==0)                cmd_oem_stream_flash(arg+13);
+	if(memcmp(arg, "flash-verify", 12)==0)                 cmd_oem_flash_verify(arg+12);
+	if(memcmp(arg, "stage-ptn ", 10)==0)                   cmd_oem_stage_ptn(arg+10);
 	if(memcmp(arg, "reset", 5)==0)               		   cmd_oem_part_format_devinfo();
 	if(memcmp(arg, "part-create-default", 19)==0)          cmd_oem_part_create_default();
 	if((memcmp(arg,"help",4)==0)||(memcmp(arg,"?",1)==0))  cmd_oem_help();
@@ -3509,8 +4204,9 @@ void htcleo_fastboot_init(void)
 {
 	// Initiate Fastboot.
 	fastboot_register("oem", cmd_oem);
-	fastboot_register("boot", cmd_boot);
-	fastboot_register("flash:", cmd_flash);
+	fastboot_register_split("boot", cmd_boot);
+	fastboot_set_download_splitter(page_size, boot_image_splitter);
+	fastboot_register_split("flash:", cmd_flash);
 	fastboot_register("erase:", cmd_erase);
 	fastboot_register("continue", cmd_continue);
 	fastboot_register("reboot", cmd_reboot);
@@ -3739,8 +4435,47 @@ err:
 	}
 }
 
+/*
+ * Quiet multiboot: keep the screen off and boot the default kernel
+ * unless a key is pressed, or a usb cable plugged in, in the first
+ * QUIET_BOOT_WINDOW ms. Returns 1 for a key, 2 for usb, 0 otherwise.
+ *
+ * Only faster than showing the multiboot menu: with the menu hidden the
+ * kernel boots at once. The window is set at build time
+ * (make QUIET_BOOT_WINDOW=<ms>), the kernel prefetch runs during it.
+ */
+#ifndef QUIET_BOOT_WINDOW
+#define QUIET_BOOT_WINDOW	2000
+#endif
+static int quiet_boot_window(void)
+{
+	bool usb_at_start = htcleo_usb_cable_present();
+	time_t end = current_time() + QUIET_BOOT_WINDOW;
+	int ret = 0;
+
+	TRACE_BEGIN("quiet_window", QUIET_BOOT_WINDOW);
+	while (!ret && current_time() < end) {
+		for (int i = 0; i < total_keys; i++) {
+			if (keys_get_state(keys[i]) != 0)
+				ret = 1;
+		}
+		if (!ret && !usb_at_start && htcleo_usb_cable_present())
+			ret = 2;
+		if (!ret)
+			mdelay(50);
+	}
+	TRACE_END("quiet_window", ret);
+	return ret;
+}
+
 void aboot_init(const struct app_descriptor *app)
 {
+	unsigned last_ms, last_path;
+
+	TRACE_POINT("aboot_init");
+	// What the previous boot took, if we came back with a warm reboot
+	if (target_last_boot_time(&last_ms, &last_path) == 0 && last_path <= BOOT_PATH_UI)
+		boottrace(BOOTTRACE_POINT, last_boot_traces[last_path], last_ms);
 	flash_info = flash_get_info();
 	page_size = flash_page_size();
 	page_mask = page_size - 1;
@@ -3794,6 +4529,7 @@ void aboot_init(const struct app_descriptor *app)
 		if (selected_boot != 8) {
 			show_multi_boot_screen = 0;
 			boot_into_recovery = 0;		
+			bootslot_forced = 1;
 		} else {
 			if(device_info.fill_bbt_at_start && flash_bad_blocks < 0 ){
 				thread_resume(thread_create("fill_bad_block_table",
@@ -3847,10 +4583,31 @@ void aboot_init(const struct app_descriptor *app)
 // show_multi_boot_screen will still be negative if none of the above checks changed it.
 // This may happen if we just (re)booted with no interaction.
 	if (show_multi_boot_screen < 0) {
+		// Load the default kernel while the user decides. The slot state
+		// comes first, taking a confirmation writes misc
+		if (device_info.multi_boot_screen && device_boot_ptn_num() > 1)
+			bootslot_load();
+		if (device_info.multi_boot_screen && device_boot_ptn_num() > 0 && !boot_into_recovery)
+			boot_prefetch_start(ptable_find(flash_get_ptable(),
+							supported_boot_partitions[selected_boot].name));
+
 		if (device_info.multi_boot_screen == 1){
 			show_multi_boot_screen = (device_boot_ptn_num() > 0 ? 1 : 0);
 			goto bmenu;
 		}
+		// Display, menus and version strings only if somebody asks for them
+		if (device_info.multi_boot_screen == 2 && device_boot_ptn_num() > 0) {
+			switch (quiet_boot_window()) {
+			case 1:
+				htcleo_vibrate_once();
+				show_multi_boot_screen = 1;
+				goto bmenu;
+			case 2:
+				boot_prefetch_cancel();
+				show_multi_boot_screen = 0;
+				goto bmenu;
+			}
+		}
 	}
 // DONE CHECKING!
 	
@@ -3908,6 +4665,7 @@ bmenu:
 			
 			htcleo_display_init();
 			init_menu();
+			TRACE_POINT("menu_ready");
 			
 			if(device_info.show_startup_info){
 				device_list();
@@ -3948,6 +4706,7 @@ bmenu:
 		} else { // Show multiboot menu
 			htcleo_display_init();
 			init_multiboot_menu();
+			TRACE_POINT("multiboot_menu_ready");
 		}		
 	}
 }
@@ -0,0 +1,100 @@
+/*
+ Boot image prefetch
+
+ The multiboot menu gives the user seconds to pick a kernel, during
+ which the NAND sits idle. The default kernel and ramdisk are read to
+ their load addresses in the background meanwhile by bootimg_load(),
+ which checks for a cancel between chunks. The boot
+ path then only has to claim them; if anything was written to the
+ flash since, or another image is booted, it reads as before.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <boottrace.h>
+#include <dev/flash.h>
+#include <kernel/thread.h>
+
+#include <bootimg_cache.h>
+#include <bootimg_load.h>
+#include <boot_prefetch.h>
+
+static struct {
+	thread_t *thread;
+	struct ptentry *ptn;
+	struct boot_img_hdr hdr;	/* the image being loaded */
+	struct boot_img_hdr loaded;	/* and its loaded sizes */
+	unsigned gen;			/* flash_generation() at the start */
+	volatile int cancel;
+} prefetch;
+
+static int boot_prefetch_thread(void *arg)
+{
+	int ret;
+
+	TRACE_BEGIN("boot_prefetch", 0);
+	ret = bootimg_load(prefetch.ptn, &prefetch.loaded, &prefetch.cancel);
+	TRACE_END("boot_prefetch", ret);
+
+	return ret;
+}
+
+void boot_prefetch_start(struct ptentry *ptn)
+{
+	const struct bootimg_info *info;
+
+	boot_prefetch_cancel();
+
+	/* the header comes from the cache here, the thread only reads */
+	info = bootimg_cache_get(ptn);
+	if (info == NULL || info->status || info->hdr.page_size != flash_page_size())
+		return;
+
+	prefetch.ptn = ptn;
+	prefetch.gen = info->gen;
+	prefetch.cancel = 0;
+	memcpy(&prefetch.hdr, &info->hdr, sizeof(prefetch.hdr));
+	memcpy(&prefetch.loaded, &info->hdr, sizeof(prefetch.loaded));
+
+	/* same priority as the countdown and key threads, they never sleep */
+	prefetch.thread = thread_create("boot_prefetch", &boot_prefetch_thread, NULL,
+					DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+	if (prefetch.thread)
+		thread_resume(prefetch.thread);
+}
+
+static int boot_prefetch_stop(void)
+{
+	int ret = -1;
+
+	if (prefetch.thread == NULL)
+		return -1;
+
+	thread_join(prefetch.thread, &ret, INFINITE_TIME);
+	prefetch.thread = NULL;
+	return ret;
+}
+
+void boot_prefetch_cancel(void)
+{
+	prefetch.cancel = 1;
+	boot_prefetch_stop();
+}
+
+int boot_prefetch_claim(struct ptentry *ptn, struct boot_img_hdr *hdr)
+{
+	if (prefetch.thread == NULL)
+		return -1;
+
+	if (ptn != prefetch.ptn || memcmp(hdr, &prefetch.hdr, sizeof(*hdr))) {
+		boot_prefetch_cancel();
+		return -1;
+	}
+
+	if (boot_prefetch_stop() || prefetch.gen != flash_generation()) {
+		dprintf(INFO, "boot: prefetched image not usable, reading it again\n");
+		return -1;
+	}
+	memcpy(hdr, &prefetch.loaded, sizeof(*hdr));
+	return 0;
+}
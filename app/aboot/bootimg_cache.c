@@ -0,0 +1,122 @@
+/*
+ Boot image header cache
+
+ Building the menus needs the header of every boot partition for the
+ rom name in its cmdline, and booting needs it again. The headers are
+ read once, parsed, and reused until flash_generation() says something
+ was written or erased, or the partition moved.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <dev/flash.h>
+#include <lib/ptable.h>
+
+#include <bootimg.h>
+#include <bootimg_cache.h>
+
+#define BOOTIMG_CACHE_SLOTS	10
+
+static struct bootimg_info bootimg_cache[BOOTIMG_CACHE_SLOTS];
+static unsigned bootimg_cache_next;
+static unsigned char bootimg_page[4096] __attribute__((aligned(32)));
+
+/*
+ * koko : Get rom name from kernel's cmdline arg
+ *		  as long as it is passed through 'rel_path'
+ *		  as 1st or 2nd arg
+ */
+static const char *bootimg_rom_name(char *cmdline)
+{
+	char *tmp_buff;
+
+	if (!cmdline[0])
+		return "NAND";
+
+ 	//In case the cmdline contains '\r' ,wtf?
+	if (strpbrk(cmdline, "\r") != NULL)
+		return "CrInCMDLINE";
+
+	//Check if the cmdline has more then one args
+	if (strpbrk(cmdline, " ") != NULL) {
+		//check rel_path=$RomName as 1st arg
+		tmp_buff = strtok( cmdline, " " );
+		if (!memcmp(tmp_buff, "rel_path=", 9 )) {
+			tmp_buff = strchr( tmp_buff, '=' );
+			//final check for the lenght
+			return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
+		} else {
+			//check rel_path=$RomName as 2nd arg
+			tmp_buff = strtok( NULL, " " );
+			if (tmp_buff && !memcmp(tmp_buff, "rel_path=", 9 )) {
+				tmp_buff = strchr( tmp_buff, '=' );
+				//final check for the lenght
+				return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
+			}
+		}
+	} else {
+		//only check rel_path=$RomName as 1st arg
+		if (!memcmp(cmdline, "rel_path=", 9 )) {
+			tmp_buff = strchr( cmdline, '=' );
+			//final check for the lenght
+			return (strlen(tmp_buff) > 43 ? "LONGNAME" : (tmp_buff+1));
+		}
+	}
+
+	return "UNDEFINED";
+}
+
+static void bootimg_cache_fill(struct bootimg_info *info, struct ptentry *ptn)
+{
+	char cmdline[BOOT_ARGS_SIZE + 1];
+	const char *name;
+
+	strncpy(info->ptn_name, ptn->name, MAX_PTENTRY_NAME);
+	info->start = ptn->start;
+	info->length = ptn->length;
+	info->gen = flash_generation();
+
+	if (flash_read(ptn, 0, bootimg_page, flash_page_size())) {
+		info->status = BOOTIMG_ERROR;
+		name = "ERROR";
+	} else {
+		memcpy(&info->hdr, bootimg_page, sizeof(info->hdr));
+		if (memcmp(info->hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+			info->status = BOOTIMG_INVALID;
+			name = "INVALID";
+		} else {
+			info->status = 0;
+			memcpy(cmdline, info->hdr.cmdline, BOOT_ARGS_SIZE);
+			cmdline[BOOT_ARGS_SIZE] = 0;
+			name = bootimg_rom_name(cmdline);
+		}
+	}
+
+	strncpy(info->rom_name, name, BOOTIMG_ROM_NAME_SIZE - 1);
+	info->rom_name[BOOTIMG_ROM_NAME_SIZE - 1] = 0;
+}
+
+const struct bootimg_info *bootimg_cache_get(struct ptentry *ptn)
+{
+	struct bootimg_info *info = NULL;
+	unsigned n;
+
+	if (ptn == NULL)
+		return NULL;
+
+	for (n = 0; n < BOOTIMG_CACHE_SLOTS; n++) {
+		if (!strncmp(bootimg_cache[n].ptn_name, ptn->name, MAX_PTENTRY_NAME)) {
+			info = &bootimg_cache[n];
+			break;
+		}
+	}
+
+	if (info == NULL)
+		info = &bootimg_cache[bootimg_cache_next++ % BOOTIMG_CACHE_SLOTS];
+	else if (info->gen == flash_generation() && info->start == ptn->start
+		 && info->length == ptn->length)
+		return info;
+
+	bootimg_cache_fill(info, ptn);
+	return info;
+}
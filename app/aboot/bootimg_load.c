@@ -0,0 +1,129 @@
+/*
+ Boot image loading
+
+ Sections are read a chunk at a time, so that a prefetch can be called
+ off quickly. LZ4 sections are read to the scratch area and expanded
+ to their load address chunk by chunk as they come in; NAND reads are
+ the slow part, fewer pages to read means a faster boot.
+
+ Images flagged BOOT_FLAG_VERIFY are hashed the way mkbootimg builds
+ the id (each section as stored, followed by its size), a chunk at a
+ time right after it was read.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <target.h>
+#include <lz4.h>
+#include <sha1.h>
+#include <boottrace.h>
+#include <dev/flash.h>
+
+#include <bootimg_load.h>
+
+#define BOOTIMG_LOAD_CHUNK	(256 * 1024)
+
+/* bytes from addr to whatever else lives above it */
+static unsigned bootimg_room(const struct boot_img_hdr *hdr, unsigned addr)
+{
+	unsigned scratch = (unsigned) target_get_scratch_address();
+	unsigned limits[] = { hdr->kernel_addr, hdr->ramdisk_addr, hdr->tags_addr,
+			      scratch, scratch + target_get_scratch_size() };
+	unsigned room = 0;
+
+	for (unsigned i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+		if (limits[i] > addr && (!room || limits[i] - addr < room))
+			room = limits[i] - addr;
+	}
+	return room;
+}
+
+/* size bytes stored at offset, taking bytes (whole pages) of flash */
+static int bootimg_load_section(struct ptentry *ptn, const struct boot_img_hdr *hdr,
+				unsigned offset, unsigned addr, unsigned size, unsigned bytes,
+				int lz4, struct sha1_ctx *sha, volatile int *cancel)
+{
+	unsigned char *stage = target_get_scratch_address();
+	struct lz4_legacy s;
+	unsigned done, n;
+
+	if (lz4) {
+		if (bytes > target_get_scratch_size())
+			return -1;
+		lz4_legacy_init(&s, (void*) addr, bootimg_room(hdr, addr));
+	} else {
+		stage = (unsigned char*) addr;
+	}
+
+	for (done = 0; done < bytes; done += n) {
+		if (cancel && *cancel)
+			return -1;
+		n = bytes - done;
+		if (n > BOOTIMG_LOAD_CHUNK)
+			n = BOOTIMG_LOAD_CHUNK;
+		if (flash_read(ptn, offset + done, stage + done, n))
+			return -1;
+		if (sha && done < size)
+			sha1_update(sha, stage + done, (done + n < size) ? n : size - done);
+		if (lz4 && lz4_legacy_run(&s, stage, (done + n < size) ? done + n : size)) {
+			dprintf(CRITICAL, "boot: lz4 data at 0x%x is corrupt\n", offset);
+			return -1;
+		}
+	}
+
+	if (sha)
+		sha1_update(sha, &size, sizeof(size));
+	return lz4 ? lz4_legacy_done(&s, size) : (int) size;
+}
+
+int bootimg_load(struct ptentry *ptn, struct boot_img_hdr *hdr, volatile int *cancel)
+{
+	unsigned mask = hdr->page_size - 1;
+	unsigned flags = BOOT_FLAGS(hdr);
+	unsigned offset = hdr->page_size;
+	unsigned kernel = (hdr->kernel_size + mask) & ~mask;
+	unsigned ramdisk = (hdr->ramdisk_size + mask) & ~mask;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	struct sha1_ctx ctx, *sha = NULL;
+	int k, r;
+
+	if (flags & BOOT_FLAG_VERIFY) {
+		sha1_init(&ctx);
+		sha = &ctx;
+	}
+
+	TRACE_BEGIN("kernel_load", hdr->kernel_size);
+	k = bootimg_load_section(ptn, hdr, offset, hdr->kernel_addr, hdr->kernel_size, kernel,
+				 flags & BOOT_FLAG_KERNEL_LZ4, sha, cancel);
+	TRACE_END("kernel_load", k);
+	if (k < 0)
+		return BOOTIMG_LOAD_KERNEL;
+	offset += kernel;
+
+	TRACE_BEGIN("ramdisk_load", hdr->ramdisk_size);
+	r = bootimg_load_section(ptn, hdr, offset, hdr->ramdisk_addr, hdr->ramdisk_size, ramdisk,
+				 flags & BOOT_FLAG_RAMDISK_LZ4, sha, cancel);
+	TRACE_END("ramdisk_load", r);
+	if (r < 0)
+		return BOOTIMG_LOAD_RAMDISK;
+	offset += ramdisk;
+
+	if (sha) {
+		/* the second stage is not booted, it only counts for the id */
+		if (bootimg_load_section(ptn, hdr, offset, (unsigned) target_get_scratch_address(),
+					 hdr->second_size, (hdr->second_size + mask) & ~mask,
+					 0, sha, cancel) < 0)
+			return BOOTIMG_LOAD_RAMDISK;
+		sha1_final(sha, digest);
+		if (memcmp(digest, hdr->id, SHA1_DIGEST_SIZE)) {
+			dprintf(CRITICAL, "boot: image on '%s' does not match its SHA-1\n", ptn->name);
+			return BOOTIMG_LOAD_DIGEST;
+		}
+	}
+
+	/* what is in memory now is plain */
+	hdr->kernel_size = k;
+	hdr->ramdisk_size = r;
+	hdr->unused[0] = 0;
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ Boot slot state machine
+
+ Only state transitions live here, reading and writing the state (it
+ is kept in the misc partition) is up to the caller. A slot is usable
+ while its image loads and it has not been booted BOOTSLOT_MAX_TRIES
+ times in a row without the system confirming it came up: by rebooting
+ into the bootloader, or with the BOOTSLOT_CONFIRM misc command.
+*/
+
+#include <string.h>
+#include <bootslot.h>
+
+void bootslot_init(struct bootslot_state *s)
+{
+	if (!memcmp(s->magic, BOOTSLOT_MAGIC, sizeof(BOOTSLOT_MAGIC)) && s->last < BOOTSLOT_COUNT)
+		return;
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->magic, BOOTSLOT_MAGIC, sizeof(BOOTSLOT_MAGIC));
+}
+
+void bootslot_boot_ok(struct bootslot_state *s)
+{
+	s->tries[s->last] = 0;
+}
+
+void bootslot_start(struct bootslot_state *s, int rebooted, int confirmed)
+{
+	// A power button start may follow a hang and a battery pull, it proves nothing
+	if (rebooted || confirmed)
+		bootslot_boot_ok(s);
+}
+
+void bootslot_reset(struct bootslot_state *s, unsigned slot)
+{
+	if (slot >= BOOTSLOT_COUNT)
+		return;
+	s->tries[slot] = 0;
+	s->bad[slot] = 0;
+}
+
+static int bootslot_usable(const struct bootslot_state *s, unsigned slot, unsigned present)
+{
+	return (present & (1 << slot)) && !s->bad[slot] && s->tries[slot] < BOOTSLOT_MAX_TRIES;
+}
+
+int bootslot_pick(const struct bootslot_state *s, unsigned preferred, unsigned present)
+{
+	unsigned slot, n;
+
+	if (preferred >= BOOTSLOT_COUNT)
+		preferred = 0;
+
+	for (n = 0; n < BOOTSLOT_COUNT; n++) {
+		slot = (preferred + n) % BOOTSLOT_COUNT;
+		if (bootslot_usable(s, slot, present))
+			return slot;
+	}
+	return -1;
+}
+
+void bootslot_attempt(struct bootslot_state *s, unsigned slot)
+{
+	if (s->tries[slot] < 255)
+		s->tries[slot]++;
+	s->last = slot;
+}
+
+void bootslot_failed(struct bootslot_state *s, unsigned slot)
+{
+	s->bad[slot] = 1;
+}
@@ -31,7 +31,10 @@
 #include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <platform/timer.h>
 #include <dev/udc.h>
+#include <fastboot.h>
+#include <boottrace.h>
 
 
 void boot_linux(void *bootimg, unsigned sz);
@@ -78,6 +81,7 @@ struct fastboot_cmd {
 	struct fastboot_cmd *next;
 	const char *prefix;
 	unsigned prefix_len;
+	int split_ok;		/* takes a split download as it is */
 	void (*handle)(const char *arg, void *data, unsigned sz);
 };
 
@@ -85,11 +89,12 @@ struct fastboot_var {
 	struct fastboot_var *next;
 	const char *name;
 	const char *value;
+	const char *(*get)(void);	/* value worked out on every getvar */
 };
 	
 struct fastboot_cmd *cmdlist;
 
-void fastboot_register(const char *prefix,
+static void fastboot_register_cmd(const char *prefix, int split_ok,
 					void (*handle)(const char *arg, void *data, unsigned sz))
 {
 	struct fastboot_cmd *cmd;
@@ -97,12 +102,25 @@ void fastboot_register(const char *prefix,
 	if (cmd) {
 		cmd->prefix = prefix;
 		cmd->prefix_len = strlen(prefix);
+		cmd->split_ok = split_ok;
 		cmd->handle = handle;
 		cmd->next = cmdlist;
 		cmdlist = cmd;
 	}
 }
 
+void fastboot_register(const char *prefix,
+					void (*handle)(const char *arg, void *data, unsigned sz))
+{
+	fastboot_register_cmd(prefix, 0, handle);
+}
+
+void fastboot_register_split(const char *prefix,
+					void (*handle)(const char *arg, void *data, unsigned sz))
+{
+	fastboot_register_cmd(prefix, 1, handle);
+}
+
 struct fastboot_var *varlist;
 
 void fastboot_publish(const char *name, const char *value)
@@ -112,6 +130,20 @@ void fastboot_publish(const char *name, const char *value)
 	if (var) {
 		var->name = name;
 		var->value = value;
+		var->get = NULL;
+		var->next = varlist;
+		varlist = var;
+	}
+}
+
+void fastboot_publish_func(const char *name, const char *(*get)(void))
+{
+	struct fastboot_var *var;
+	var = malloc(sizeof(*var));
+	if (var) {
+		var->name = name;
+		var->value = NULL;
+		var->get = get;
 		var->next = varlist;
 		varlist = var;
 	}
@@ -120,7 +152,7 @@ void fastboot_publish(const char *name, const char *value)
 
 event_t usb_online;
 event_t txn_done;
-unsigned char buffer[4096];
+unsigned char *buffer;
 struct udc_endpoint *in, *out;
 struct udc_request *req;
 int txn_status;
@@ -129,6 +161,18 @@ void *download_base;
 unsigned download_max;
 unsigned download_size;
 
+/* when set, the next download is handed to the sink as it arrives */
+static struct fastboot_sink *download_sink;
+
+/* what the next 'upload' sends */
+static struct fastboot_source *upload_source;
+
+/* pieces of the last download that were received outside download_base */
+static fastboot_splitter download_splitter;
+static unsigned download_split_head;
+static struct fastboot_split download_split[FASTBOOT_SPLIT_MAX];
+static unsigned download_pieces;
+
 #define STATE_OFFLINE	0
 #define STATE_COMMAND	1
 #define STATE_COMPLETE	2
@@ -143,42 +187,112 @@ void req_complete(struct udc_request *req, unsigned actual, int status)
 	event_signal(&txn_done, 0);
 }
 
+/*
+ * Reads keep up to USB_READ_REQS requests queued on the OUT endpoint,
+ * each one queued again for the next piece from its completion. The
+ * controller always has somewhere to put the next packet and does not
+ * NAK the host while the fastboot thread gets around to it.
+ */
+#define USB_READ_REQS	2
+#define USB_READ_PIECE	(1024 * 1024)
+
+static struct udc_request *read_req[USB_READ_REQS];
+static unsigned char *read_next;
+static unsigned read_left;		/* bytes not queued yet */
+static unsigned read_pending;		/* requests on the endpoint */
+static unsigned read_count;		/* bytes received */
+static int read_status;
+static int read_done;
+
+static void read_complete(struct udc_request *r, unsigned actual, int status);
+
+static int read_queue(struct udc_request *r)
+{
+	unsigned xfer = (read_left > USB_READ_PIECE) ? USB_READ_PIECE : read_left;
+
+	r->buf = read_next;
+	r->length = xfer;
+	r->complete = read_complete;
+	if (udc_request_queue(out, r) < 0)
+		return -1;
+	read_next += xfer;
+	read_left -= xfer;
+	read_pending++;
+	return 0;
+}
+
+static void read_complete(struct udc_request *r, unsigned actual, int status)
+{
+	int stop = 0;
+
+	read_pending--;
+	if (status < 0) {
+		read_status = -1;
+		stop = 1;
+	} else {
+		read_count += actual;
+		/* short transfer? */
+		if (actual != r->length)
+			stop = 1;
+	}
+
+	if (!stop && !read_done && read_left && read_queue(r)) {
+		read_status = -1;
+		stop = 1;
+	}
+
+	if (!read_done && (stop || read_pending == 0)) {
+		read_done = 1;
+		event_signal(&txn_done, 0);
+	}
+}
+
 int usb_read(void *_buf, unsigned len)
 {
-	int r;
-	unsigned xfer;
-	unsigned char *buf = _buf;
-	int count = 0;
+	unsigned n;
 
 	if (fastboot_state == STATE_ERROR)
 		goto oops;
-
-	while (len > 0) {
-		xfer = (len > 4096) ? 4096 : len;
-		req->buf = buf;
-		req->length = xfer;
-		req->complete = req_complete;
-		r = udc_request_queue(out, req);
-		if (r < 0) {
+	if (len == 0)
+		return 0;
+
+	read_next = _buf;
+	read_left = len;
+	read_pending = 0;
+	read_count = 0;
+	read_status = 0;
+	read_done = 0;
+
+	/* none may complete before all are queued, or the pieces get mixed up */
+	enter_critical_section();
+	for (n = 0; n < USB_READ_REQS && read_left; n++) {
+		if (read_queue(read_req[n])) {
 			//dprintf(INFO, "   usb_read() queue failed\n");
-			goto oops;
-		}
-		event_wait(&txn_done);
-
-		if (txn_status < 0) {
-			//dprintf(INFO, "   usb_read() transaction failed\n");
-			goto oops;
+			read_status = -1;
+			break;
 		}
+	}
+	if (read_pending == 0)
+		read_done = 1;
+	exit_critical_section();
 
-		count += req->length;
-		buf += req->length;
-		len -= req->length;
+	if (read_pending)
+		event_wait(&txn_done);
 
-		/* short transfer? */
-		if (req->length != xfer) break;
+	/* stopped early, take back what is still queued */
+	if (read_pending) {
+		enter_critical_section();
+		for (n = 0; n < USB_READ_REQS; n++)
+			udc_request_cancel(out, read_req[n]);
+		read_pending = 0;
+		exit_critical_section();
 	}
 
-	return count;
+	if (read_status < 0) {
+		//dprintf(INFO, "   usb_read() transaction failed\n");
+		goto oops;
+	}
+	return read_count;
 
 oops:
 	//fastboot_sstat(0);
@@ -186,32 +300,42 @@ oops:
 	return -1;
 }
 
-int usb_write(void *buf, unsigned len)
+/* queue a write, usb_write_wait() collects it */
+static int usb_write_start(void *buf, unsigned len)
 {
-	int r;
-
 	if (fastboot_state == STATE_ERROR)
 		goto oops;
 
 	req->buf = buf;
 	req->length = len;
 	req->complete = req_complete;
-	r = udc_request_queue(in, req);
-	if (r < 0) {
+	if (udc_request_queue(in, req) < 0) {
 		//dprintf(INFO, "   usb_write() queue failed\n");
 		goto oops;
 	}
+	return 0;
+
+oops:
+	fastboot_state = STATE_ERROR;
+	return -1;
+}
+
+static int usb_write_wait(void)
+{
 	event_wait(&txn_done);
 	if (txn_status < 0) {
 		//dprintf(INFO, "   usb_write() transaction failed\n");
-		goto oops;
+		fastboot_state = STATE_ERROR;
+		return -1;
 	}
 	return req->length;
+}
 
-oops:
-	//fastboot_sstat(0);
-	fastboot_state = STATE_ERROR;
-	return -1;
+int usb_write(void *buf, unsigned len)
+{
+	if (usb_write_start(buf, len))
+		return -1;
+	return usb_write_wait();
 }
 
 void fastboot_ack(const char *code, const char *reason)
@@ -231,6 +355,17 @@ void fastboot_ack(const char *code, const char *reason)
 
 }
 
+void fastboot_info(const char *info)
+{
+	char response[64];
+
+	if (fastboot_state != STATE_COMMAND)
+		return;
+
+	snprintf(response, 64, "INFO%s", info);
+	usb_write(response, strlen(response));
+}
+
 void fastboot_fail(const char *reason)
 {
 	fastboot_ack("FAIL", reason);
@@ -246,19 +381,107 @@ int fastboot_write(void *buf, unsigned len)
 	return usb_write(buf, len);
 }
 
+int fastboot_read(void *buf, unsigned len)
+{
+	return usb_read(buf, len);
+}
+
+int fastboot_write_start(void *buf, unsigned len)
+{
+	return usb_write_start(buf, len);
+}
+
+int fastboot_write_wait(void)
+{
+	return usb_write_wait();
+}
+
+void fastboot_set_download_sink(struct fastboot_sink *sink)
+{
+	download_sink = sink;
+}
+
+void fastboot_set_upload_source(struct fastboot_source *source)
+{
+	upload_source = source;
+}
+
 void cmd_getvar(const char *arg, void *data, unsigned sz)
 {
 	struct fastboot_var *var;
 
 	for (var = varlist; var; var = var->next) {
 		if (!strcmp(var->name, arg)) {
-			fastboot_okay(var->value);
+			fastboot_okay(var->get ? var->get() : var->value);
 			return;
 		}
 	}
 	fastboot_okay("");
 }
 
+void fastboot_set_download_splitter(unsigned head, fastboot_splitter splitter)
+{
+	download_split_head = head;
+	download_splitter = splitter;
+}
+
+unsigned fastboot_download_pieces(const struct fastboot_split **split)
+{
+	*split = download_split;
+	return download_pieces;
+}
+
+/* put split off pieces back where a plain download would have them */
+void fastboot_download_join(void)
+{
+	unsigned char *base = download_base;
+
+	for (unsigned i = 0; i < download_pieces; i++)
+		memmove(base + download_split[i].offset, download_split[i].dest,
+			download_split[i].len);
+	download_pieces = 0;
+}
+
+static int download_read(unsigned char *dest, unsigned len)
+{
+	int r = usb_read(dest, len);
+
+	return ((r < 0) || ((unsigned)r != len)) ? -1 : 0;
+}
+
+/*
+ * Read the data phase to download_base, except for the pieces the
+ * splitter picks out of the first download_split_head bytes, which are
+ * read straight to their destination.
+ */
+static int download_receive(unsigned len)
+{
+	unsigned char *base = download_base;
+	unsigned pos, n;
+
+	if (download_splitter == NULL || len < download_split_head)
+		return usb_read(base, len);
+
+	if (download_read(base, download_split_head))
+		return -1;
+	pos = download_split_head;
+
+	n = download_splitter(base, len, download_split, FASTBOOT_SPLIT_MAX);
+	for (download_pieces = 0; download_pieces < n; download_pieces++) {
+		struct fastboot_split *s = &download_split[download_pieces];
+
+		if (s->offset < pos || s->offset + s->len > len)
+			break;
+		if (download_read(base + pos, s->offset - pos) || download_read(s->dest, s->len))
+			return -1;
+		pos = s->offset + s->len;
+	}
+
+	if (download_read(base + pos, len - pos))
+		return -1;
+	return len;
+}
+
 void cmd_download(const char *arg, void *data, unsigned sz)
 {
 	char response[64];
@@ -266,6 +489,31 @@ void cmd_download(const char *arg, void *data, unsigned sz)
 	int r;
 
 	download_size = 0;
+	download_pieces = 0;
+	if (download_sink) {
+		struct fastboot_sink *sink = download_sink;
+
+		download_sink = NULL;
+		if (sink->start(len)) {
+			fastboot_fail("download rejected");
+			return;
+		}
+
+		sprintf(response,"DATA%08x", len);
+		if (usb_write(response, strlen(response)) < 0)
+			return;
+
+		TRACE_BEGIN("usb_download", len);
+		r = sink->receive(len);
+		TRACE_END("usb_download", r);
+		if (r < 0) {
+			fastboot_state = STATE_ERROR;
+			return;
+		}
+		fastboot_okay("");
+		return;
+	}
+
 	if (len > download_max) {
 		fastboot_fail("data too large");
 		return;
@@ -275,18 +523,112 @@ void cmd_download(const char *arg, void *data, unsigned sz)
 	if (usb_write(response, strlen(response)) < 0)
 		return;
 
-	r = usb_read(download_base, len);
+	bigtime_t start = current_time_hires();
+	TRACE_BEGIN("usb_download", len);
+	r = download_receive(len);
+	TRACE_END("usb_download", r);
 	if ((r < 0) || ((unsigned)r != len)) {
 		fastboot_state = STATE_ERROR;
 		return;
 	}
 	download_size = len;
+	bigtime_t usec = current_time_hires() - start;
+	if (usec)
+		dprintf(INFO, "   download: %u KB in %u ms (%u KB/s)\n", len >> 10,
+			(unsigned)(usec / 1000), (unsigned)(((unsigned long long) len * 1000000 / usec) >> 10));
+	fastboot_okay("");
+}
+
+/* 'fastboot get_staged': send what an oem command staged */
+void cmd_upload(const char *arg, void *data, unsigned sz)
+{
+	struct fastboot_source *source = upload_source;
+	char response[64];
+	unsigned len;
+
+	upload_source = NULL;
+	if (source == NULL) {
+		fastboot_fail("nothing staged");
+		return;
+	}
+
+	len = source->start();
+	sprintf(response,"DATA%08x", len);
+	if (usb_write(response, strlen(response)) < 0)
+		return;
+
+	TRACE_BEGIN("usb_upload", len);
+	int r = source->send(len);
+	TRACE_END("usb_upload", r);
+	if (r < 0) {
+		fastboot_state = STATE_ERROR;
+		return;
+	}
 	fastboot_okay("");
 }
 
+/*
+ * Wall time and usb traffic of the last FASTBOOT_PERF_CMDS commands,
+ * for 'getvar:perf-cmd' and 'oem perf'
+ */
+static struct fastboot_perf perf_cmds[FASTBOOT_PERF_CMDS];
+static unsigned perf_count;
+
+int fastboot_get_perf(unsigned n, struct fastboot_perf *perf)
+{
+	if (n >= FASTBOOT_PERF_CMDS || n >= perf_count)
+		return -1;
+	*perf = perf_cmds[(perf_count - 1 - n) % FASTBOOT_PERF_CMDS];
+	return 0;
+}
+
+static void perf_record(const char *name, bigtime_t start, struct udc_stats *before)
+{
+	struct fastboot_perf *perf = &perf_cmds[perf_count++ % FASTBOOT_PERF_CMDS];
+	struct udc_stats after;
+
+	udc_get_stats(&after);
+	strncpy(perf->name, name, sizeof(perf->name) - 1);
+	perf->name[sizeof(perf->name) - 1] = 0;
+	perf->usec = current_time_hires() - start;
+	perf->bytes = (after.bytes_in - before->bytes_in) + (after.bytes_out - before->bytes_out);
+}
+
+unsigned fastboot_perf_rate(const struct fastboot_perf *perf)
+{
+	if (perf->usec == 0)
+		return 0;
+	return (unsigned)(((unsigned long long) perf->bytes * 1000000 / perf->usec) >> 10);
+}
+
+static char perf_value[64];
+
+static const char *perf_usb(void)
+{
+	struct udc_stats st;
+
+	udc_get_stats(&st);
+	snprintf(perf_value, sizeof(perf_value), "in %uK out %uK nak %u err %u rst %u",
+		 st.bytes_in >> 10, st.bytes_out >> 10, st.naks, st.errors, st.resets);
+	return perf_value;
+}
+
+static const char *perf_cmd(void)
+{
+	struct fastboot_perf perf;
+
+	if (fastboot_get_perf(0, &perf))
+		return "";
+	snprintf(perf_value, sizeof(perf_value), "%s %ums %uKB/s", perf.name,
+		 perf.usec / 1000, fastboot_perf_rate(&perf));
+	return perf_value;
+}
+
 void fastboot_command_loop(void)
 {
 	struct fastboot_cmd *cmd;
+	struct udc_stats before;
+	bigtime_t start;
 	int r;
 	//dprintf(INFO,"   fastboot: processing commands\n");
 	//fastboot_sstat(1);
@@ -301,8 +643,13 @@ again:
 			if (memcmp(buffer, cmd->prefix, cmd->prefix_len))
 				continue;
 			fastboot_state = STATE_COMMAND;
+			start = current_time_hires();
+			udc_get_stats(&before);
+			if (download_pieces && !cmd->split_ok)
+				fastboot_download_join();
 			cmd->handle((const char*) buffer + cmd->prefix_len,
 				    (void*) download_base, download_size);
+			perf_record((const char*) buffer, start, &before);
 			if (fastboot_state == STATE_COMMAND)
 				fastboot_fail("unknown reason");
 			goto again;
@@ -370,15 +717,28 @@ int fastboot_init(void *base, unsigned size)
 	fastboot_endpoints[0] = in;
 	fastboot_endpoints[1] = out;
 
+	buffer = udc_buffer_alloc();
+	if (!buffer)
+		goto fail_alloc_req;
+
 	req = udc_request_alloc();
 	if (!req)
 		goto fail_alloc_req;
+	for (unsigned n = 0; n < USB_READ_REQS; n++) {
+		read_req[n] = udc_request_alloc();
+		if (!read_req[n])
+			goto fail_alloc_req;
+	}
 
 	if (udc_register_gadget(&fastboot_gadget))
 		goto fail_udc_register;
 
-	fastboot_register("getvar:", cmd_getvar);
-	fastboot_register("download:", cmd_download);
+	/* neither reads the download, a new one drops the pieces */
+	fastboot_register_split("getvar:", cmd_getvar);
+	fastboot_register_split("download:", cmd_download);
+	fastboot_register("upload", cmd_upload);
+	fastboot_publish_func("perf-usb", perf_usb);
+	fastboot_publish_func("perf-cmd", perf_cmd);
 
 	thr = thread_create("fastboot", fastboot_handler, 0, DEFAULT_PRIORITY, 4096);
 	thread_resume(thr);
@@ -0,0 +1,281 @@
+/*
+ Sparse image flashing
+
+ The image is expanded one NAND block at a time into a list of page
+ sources for flash_write_page_list(). Whole pages of RAW chunks are
+ programmed straight from the download buffer, FILL chunks share one
+ generated page per block and DONT_CARE pages (or fills of 0xff) are
+ left erased without programming them. Pages that straddle a chunk
+ boundary are assembled in a staging area behind the download.
+
+ DONT_CARE means erased here, the partition is always rewritten as a
+ whole. An image the host split into several sparse pieces can not be
+ flashed this way, which is fine as long as we publish no
+ max-download-size.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <target.h>
+#include <dev/flash.h>
+#include <lib/ptable.h>
+
+#include <sparse_format.h>
+#include <flash_sparse.h>
+
+#define SPARSE_MAX_PAGES	64
+
+struct sparse_out {
+	const void *pages[SPARSE_MAX_PAGES];
+	unsigned count;			/* pages queued for the current block */
+	unsigned per_block;
+	unsigned wsize;
+	unsigned total;			/* pages in the expanded image */
+	unsigned done;			/* pages handed to the flash */
+	unsigned char *pool;		/* staging pages, reused for every block */
+	unsigned used;
+	unsigned char *partial;		/* page being assembled */
+	unsigned fill;			/* bytes already in it */
+	unsigned char *fill_page;	/* generated FILL page of this block */
+	unsigned fill_value;
+	unsigned char *blank;		/* an erased page, for the checksum */
+	unsigned extra;
+	unsigned long *crc;		/* checksum of the pages, if asked for */
+	int error;
+};
+
+static unsigned char *sparse_stage(struct sparse_out *o)
+{
+	return o->pool + (o->used++) * o->wsize;
+}
+
+static void sparse_emit(struct sparse_out *o, const void *page)
+{
+	if (o->crc)
+		*o->crc = flash_image_crc(*o->crc, page ? page : o->blank, o->wsize, o->extra);
+
+	o->pages[o->count++] = page;
+	if (o->count < o->per_block)
+		return;
+
+	if (!o->error && flash_write_page_list(o->pages, o->count, o->total - o->done - o->count))
+		o->error = -1;
+	o->done += o->count;
+	o->count = 0;
+	o->used = 0;
+	o->fill_page = NULL;
+}
+
+/* room left in the page being assembled, starting one if needed */
+static unsigned sparse_room(struct sparse_out *o, unsigned len)
+{
+	unsigned room;
+
+	if (!o->partial) {
+		o->partial = sparse_stage(o);
+		o->fill = 0;
+	}
+	room = o->wsize - o->fill;
+	return (len < room) ? len : room;
+}
+
+static void sparse_partial_done(struct sparse_out *o, unsigned n)
+{
+	unsigned char *page = o->partial;
+
+	o->fill += n;
+	if (o->fill == o->wsize) {
+		o->partial = NULL;
+		sparse_emit(o, page);
+	}
+}
+
+static void sparse_set(unsigned char *dst, unsigned value, unsigned len)
+{
+	unsigned *p = (unsigned*) dst;
+
+	for (len >>= 2; len; len--)
+		*p++ = value;
+}
+
+static void sparse_raw(struct sparse_out *o, const unsigned char *src, unsigned len)
+{
+	unsigned n;
+
+	while (len) {
+		/* the data mover wants 8 byte aligned sources */
+		if (o->partial || len < o->wsize || ((unsigned) src & 7)) {
+			n = sparse_room(o, len);
+			memcpy(o->partial + o->fill, src, n);
+			sparse_partial_done(o, n);
+		} else {
+			n = o->wsize;
+			sparse_emit(o, src);
+		}
+		src += n;
+		len -= n;
+	}
+}
+
+static void sparse_fill(struct sparse_out *o, unsigned value, unsigned len)
+{
+	unsigned n;
+
+	while (len) {
+		if (o->partial || len < o->wsize) {
+			n = sparse_room(o, len);
+			sparse_set(o->partial + o->fill, value, n);
+			sparse_partial_done(o, n);
+		} else if (value == 0xffffffff) {
+			n = o->wsize;
+			sparse_emit(o, NULL);
+		} else {
+			n = o->wsize;
+			if (!o->fill_page || o->fill_value != value) {
+				o->fill_page = sparse_stage(o);
+				o->fill_value = value;
+				sparse_set(o->fill_page, value, n);
+			}
+			sparse_emit(o, o->fill_page);
+		}
+		len -= n;
+	}
+}
+
+/* check every chunk, or expand them into 'o' */
+static int sparse_walk(const sparse_header_t *h, const unsigned char *p, unsigned sz,
+		       struct sparse_out *o)
+{
+	const unsigned char *end = p + sz;
+	unsigned blocks = 0;
+	unsigned i;
+
+	p += h->file_hdr_sz;
+	for (i = 0; i < h->total_chunks; i++) {
+		const chunk_header_t *c = (const chunk_header_t*) p;
+		const unsigned char *payload = p + h->chunk_hdr_sz;
+		unsigned data_sz, len;
+
+		if (o && o->error)
+			return -1;
+		if ((unsigned)(end - p) < h->chunk_hdr_sz
+			|| c->total_sz < h->chunk_hdr_sz || c->total_sz > (unsigned)(end - p)
+			|| c->chunk_sz > h->total_blks - blocks)
+			goto corrupt;
+
+		data_sz = c->total_sz - h->chunk_hdr_sz;
+		len = c->chunk_sz * h->blk_sz;
+		blocks += c->chunk_sz;
+
+		switch (c->chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (data_sz != len)
+				goto corrupt;
+			if (o)
+				sparse_raw(o, payload, len);
+			break;
+		case CHUNK_TYPE_FILL:
+			if (data_sz != 4)
+				goto corrupt;
+			if (o)
+				sparse_fill(o, *(const unsigned*) payload, len);
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			if (data_sz != 0)
+				goto corrupt;
+			if (o)
+				sparse_fill(o, 0xffffffff, len);
+			break;
+		case CHUNK_TYPE_CRC32:
+			if (data_sz != 4)
+				goto corrupt;
+			break;
+		default:
+			goto corrupt;
+		}
+		p += c->total_sz;
+	}
+
+	/* blocks no chunk mentions are don't care */
+	if (o)
+		sparse_fill(o, 0xffffffff, (h->total_blks - blocks) * h->blk_sz);
+	return (o && o->error) ? -1 : 0;
+
+corrupt:
+	printf("   sparse: chunk %d is corrupt\n", i);
+	return -1;
+}
+
+int flash_is_sparse(const void *data, unsigned sz)
+{
+	const sparse_header_t *h = data;
+
+	return (sz >= sizeof(sparse_header_t)) && (h->magic == SPARSE_HEADER_MAGIC);
+}
+
+int flash_write_sparse(struct ptentry *ptn, unsigned extra_per_page,
+		       const void *data, unsigned sz, unsigned long *crc, unsigned *bytes)
+{
+	const sparse_header_t *h = data;
+	static struct sparse_out o;
+	unsigned capacity = ptn->length * flash_write_chunk_size(extra_per_page);
+	unsigned scratch_end = (unsigned) target_get_scratch_address() + target_get_scratch_size();
+	unsigned pool = ((unsigned) data + sz + 31) & ~31;
+	int r;
+
+	if (h->major_version != SPARSE_HEADER_MAJOR_VER
+		|| h->file_hdr_sz < sizeof(sparse_header_t)
+		|| h->chunk_hdr_sz < sizeof(chunk_header_t)
+		|| h->blk_sz == 0 || (h->blk_sz & 3)) {
+		printf("   sparse: unsupported header\n");
+		return -1;
+	}
+	if (h->total_blks > capacity / h->blk_sz) {
+		printf("   sparse: %d blocks do not fit '%s'\n", h->total_blks, ptn->name);
+		return -1;
+	}
+
+	memset(&o, 0, sizeof(o));
+	o.wsize = flash_page_size() + extra_per_page;
+	o.per_block = flash_write_chunk_size(extra_per_page) / o.wsize;
+	o.total = (h->total_blks * h->blk_sz + o.wsize - 1) / o.wsize;
+	o.extra = extra_per_page;
+	o.blank = (unsigned char*) pool;
+	o.pool = o.blank + o.wsize;
+	if (o.per_block > SPARSE_MAX_PAGES || pool + (o.per_block + 1) * o.wsize > scratch_end) {
+		printf("   sparse: no room to stage pages\n");
+		return -1;
+	}
+
+	/* nothing is erased before the whole image checked out */
+	if (sparse_walk(h, data, sz, NULL))
+		return -1;
+
+	if (crc) {
+		memset(o.blank, 0xff, o.wsize);
+		*crc = 0;
+		o.crc = crc;
+	}
+
+	if (flash_write_begin(ptn, extra_per_page))
+		return -1;
+
+	r = sparse_walk(h, data, sz, &o);
+	if (!r && o.partial) {
+		if (extra_per_page) {
+			printf("   sparse: image undersized\n");
+			r = -1;
+		} else {
+			sparse_fill(&o, 0xffffffff, o.wsize - o.fill);
+		}
+	}
+	if (!r && o.count && flash_write_page_list(o.pages, o.count, 0))
+		r = -1;
+	if (!r && o.error)
+		r = -1;
+
+	if (flash_write_end())
+		r = -1;
+	*bytes = (o.done + o.count) * o.wsize;
+	return r;
+}
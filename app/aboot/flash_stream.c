@@ -0,0 +1,225 @@
+/*
+ Streaming fastboot flash
+
+ Armed with 'fastboot oem stream-flash <partition>', the next download
+ is not collected in the download buffer. It is received into a ring of
+ block sized slots instead and a writer thread programs each slot with
+ flash_write_pages() while usb keeps receiving the next ones. The image
+ size is only limited by the partition, and the 'flash:' command that
+ follows just reports how the write went.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <stdlib.h>
+#include <target.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/semaphore.h>
+#include <dev/flash.h>
+#include <lib/ptable.h>
+
+#include <fastboot.h>
+#include <bootimg.h>
+#include <flash_stream.h>
+
+#define STREAM_SLOTS	8
+
+struct stream_slot {
+	unsigned len;			/* 0 tells the writer to give up */
+	unsigned more;			/* bytes still to come after this slot */
+};
+
+static struct stream_slot slots[STREAM_SLOTS];
+static unsigned char *stream_base;
+static unsigned stream_chunk;
+
+static struct ptentry *stream_ptn;
+static unsigned stream_extra;
+static int stream_boot_image;
+static int stream_verify;
+static unsigned long stream_crc;
+static unsigned stream_written;
+static int stream_armed;
+static int stream_running;
+static int stream_status;
+
+static semaphore_t slot_full;
+static semaphore_t slot_empty;
+static event_t stream_done;
+
+static int stream_writer(void *arg)
+{
+	unsigned i = 0;
+	unsigned written = 0;
+	int begun = 0;
+
+	for (;;) {
+		struct stream_slot *slot = &slots[i];
+		unsigned char *data = stream_base + i * stream_chunk;
+		int last;
+
+		sem_wait(&slot_full);
+		if (slot->len == 0) {
+			stream_status = -1;
+			break;
+		}
+
+		/* nothing touches the flash before the first chunk checked out */
+		if (stream_status == 0 && !begun) {
+			if (stream_boot_image && memcmp(data, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+				printf("   image is not a boot image\n");
+				stream_status = -1;
+			} else if (flash_write_begin(stream_ptn, stream_extra)) {
+				stream_status = -1;
+			} else {
+				begun = 1;
+			}
+		}
+
+		if (stream_status == 0) {
+			if (flash_write_pages(data, slot->len, slot->more))
+				stream_status = -1;
+			if (stream_verify)
+				stream_crc = flash_image_crc(stream_crc, data, slot->len, stream_extra);
+			written += slot->len;
+		}
+
+		last = (slot->more == 0);
+		sem_post(&slot_empty);
+		if (last)
+			break;
+		i = (i + 1) % STREAM_SLOTS;
+	}
+
+	/* a failed stream leaves the rest of the partition alone */
+	if (stream_status == 0) {
+		if (flash_write_end())
+			stream_status = -1;
+	} else if (begun) {
+		flash_write_abort();
+	}
+
+	stream_written = written;
+	stream_running = 0;
+	event_signal(&stream_done, false);
+	return 0;
+}
+
+static int stream_start(unsigned len)
+{
+	unsigned wsize = flash_page_size() + stream_extra;
+	unsigned max = stream_ptn->length * flash_write_chunk_size(stream_extra);
+
+	stream_armed = 0;
+	if (len == 0 || len > max) {
+		printf("   stream: %d bytes do not fit '%s'\n", len, stream_ptn->name);
+		goto reject;
+	}
+	if (stream_extra && (len % wsize)) {
+		printf("   stream: image undersized (%d %% %d)\n", len, wsize);
+		goto reject;
+	}
+
+	sem_init(&slot_full, 0);
+	sem_init(&slot_empty, STREAM_SLOTS);
+	event_init(&stream_done, false, 0);
+	stream_status = 0;
+	stream_crc = 0;
+	stream_written = 0;
+	stream_running = 1;
+
+	thread_resume(thread_create("flash_stream", &stream_writer, NULL,
+				    DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+
+	printf("   streaming %d bytes to '%s'...\n", len, stream_ptn->name);
+	return 0;
+reject:
+	stream_ptn = NULL;
+	return -1;
+}
+
+static int stream_receive(unsigned len)
+{
+	unsigned page_mask = flash_page_size() - 1;
+	unsigned done = 0;
+	unsigned i = 0;
+	int r;
+
+	while (done < len) {
+		struct stream_slot *slot = &slots[i];
+		unsigned char *data = stream_base + i * stream_chunk;
+		unsigned n = len - done;
+
+		if (n > stream_chunk)
+			n = stream_chunk;
+
+		sem_wait(&slot_empty);
+		r = fastboot_read(data, n);
+		if ((r < 0) || ((unsigned)r != n)) {
+			slot->len = 0;
+			sem_post(&slot_full);
+			event_wait(&stream_done);
+			return -1;
+		}
+		done += n;
+
+		/* pad the tail to a full page, like ROUND_TO_PAGE does */
+		if (done == len && !stream_extra && (n & page_mask)) {
+			memset(data + n, 0xff, (page_mask + 1) - (n & page_mask));
+			n = (n + page_mask) & ~page_mask;
+		}
+
+		slot->len = n;
+		slot->more = len - done;
+		sem_post(&slot_full);
+		i = (i + 1) % STREAM_SLOTS;
+	}
+	return 0;
+}
+
+static struct fastboot_sink stream_sink = {
+	.start		= stream_start,
+	.receive	= stream_receive,
+};
+
+int flash_stream_arm(struct ptentry *ptn, unsigned extra_per_page, int boot_image,
+		     int verify)
+{
+	if (stream_running)
+		return -1;
+
+	stream_chunk = flash_write_chunk_size(extra_per_page);
+	if (stream_chunk == 0 || STREAM_SLOTS * stream_chunk > target_get_scratch_size())
+		return -1;
+
+	stream_base = target_get_scratch_address();
+	stream_ptn = ptn;
+	stream_extra = extra_per_page;
+	stream_boot_image = boot_image;
+	stream_verify = verify;
+	stream_armed = 1;
+	fastboot_set_download_sink(&stream_sink);
+	return 0;
+}
+
+struct ptentry *flash_stream_pending(void)
+{
+	if (stream_armed || !stream_ptn)
+		return NULL;
+	return stream_ptn;
+}
+
+int flash_stream_finish(unsigned long *crc, unsigned *bytes)
+{
+	int status;
+
+	if (stream_running)
+		event_wait(&stream_done);
+
+	*crc = stream_crc;
+	*bytes = stream_written;
+	status = stream_status;
+	stream_ptn = NULL;
+	return status;
+}
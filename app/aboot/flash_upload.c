@@ -0,0 +1,87 @@
+/*
+ Partition upload
+
+ Armed with 'fastboot oem stage-ptn <partition> [spare]', the next
+ 'upload' ('fastboot get_staged <file>') sends the partition in binary,
+ one block at a time through two buffers: the NAND read of the next
+ block runs while the previous one goes out over usb. Bad blocks are
+ skipped like flash_read() does, blocks that can not be read (and the
+ room the skipped ones leave at the end) are sent as 0xff.
+*/
+
+#include <debug.h>
+#include <string.h>
+#include <target.h>
+#include <dev/flash.h>
+#include <lib/ptable.h>
+
+#include <fastboot.h>
+#include <flash_upload.h>
+
+static struct ptentry *upload_ptn;
+static unsigned upload_extra;
+static unsigned upload_chunk;
+
+static unsigned upload_start(void)
+{
+	return upload_ptn->length * upload_chunk;
+}
+
+/* block 'n' of the partition, 0 if it read fine */
+static int upload_read(unsigned char *buf, unsigned n)
+{
+	unsigned pages = upload_chunk / (flash_page_size() + upload_extra);
+
+	if (flash_read_ext(upload_ptn, upload_extra, n * pages * flash_page_size(),
+			   buf, upload_chunk)) {
+		memset(buf, 0xff, upload_chunk);
+		return -1;
+	}
+	return 0;
+}
+
+static int upload_send(unsigned len)
+{
+	unsigned char *buf[2];
+	unsigned blocks = len / upload_chunk;
+	unsigned failed = 0;
+	unsigned n;
+	char msg[64];
+
+	buf[0] = target_get_scratch_address();
+	buf[1] = buf[0] + upload_chunk;
+
+	if (blocks && upload_read(buf[0], 0))
+		failed++;
+	for (n = 0; n < blocks; n++) {
+		if (fastboot_write_start(buf[n & 1], upload_chunk))
+			return -1;
+		if (n + 1 < blocks && upload_read(buf[(n + 1) & 1], n + 1))
+			failed++;
+		if (fastboot_write_wait() < 0)
+			return -1;
+	}
+
+	snprintf(msg, sizeof(msg), "%s: %u blocks, %u not readable", upload_ptn->name,
+		 blocks, failed);
+	fastboot_info(msg);
+	upload_ptn = NULL;
+	return 0;
+}
+
+static struct fastboot_source upload_source = {
+	.start		= upload_start,
+	.send		= upload_send,
+};
+
+int flash_upload_arm(struct ptentry *ptn, unsigned extra_per_page)
+{
+	upload_chunk = flash_write_chunk_size(extra_per_page);
+	if (upload_chunk == 0 || 2 * upload_chunk > target_get_scratch_size())
+		return -1;
+
+	upload_ptn = ptn;
+	upload_extra = extra_per_page;
+	fastboot_set_upload_source(&upload_source);
+	return 0;
+}
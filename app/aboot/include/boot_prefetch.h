@@ -0,0 +1,25 @@
+/*
+ Loading the default kernel and ramdisk in the background while the
+ multiboot menu counts down
+*/
+
+#ifndef _BOOT_PREFETCH_H_
+#define _BOOT_PREFETCH_H_
+
+#include <lib/ptable.h>
+#include <bootimg.h>
+
+/* start loading the kernel and ramdisk of ptn to their load addresses */
+void boot_prefetch_start(struct ptentry *ptn);
+
+/* stop loading and forget what was loaded */
+void boot_prefetch_cancel(void);
+
+/*
+ * 0 if the kernel and ramdisk described by hdr are in place, waiting for
+ * the prefetch to complete if it loads the same image, -1 if the caller
+ * has to load them itself. Updates hdr like bootimg_load() does.
+ */
+int boot_prefetch_claim(struct ptentry *ptn, struct boot_img_hdr *hdr);
+
+#endif
@@ -51,7 +51,7 @@ struct boot_img_hdr
 
     unsigned tags_addr;    /* physical addr for kernel tags */
     unsigned page_size;    /* flash page size we assume */
-    unsigned unused[2];    /* future expansion: should be 0 */
+    unsigned unused[2];    /* future expansion: should be 0, see BOOT_FLAGS_* */
 
     unsigned char name[BOOT_NAME_SIZE]; /* asciiz product name */
     
@@ -60,6 +60,22 @@ struct boot_img_hdr
     unsigned id[8]; /* timestamp / checksum / sha1 / etc */
 };
 
+/*
+** cLK extension: unused[0] may hold BOOT_FLAGS_MAGIC with flag bits for
+** sections stored LZ4 compressed (legacy frame format, 'lz4 -l').
+** Their *_size is then the compressed size, as stored in flash.
+** BOOT_FLAG_VERIFY asks for the mkbootimg SHA-1 in id[] to be checked
+** before booting.
+*/
+#define BOOT_FLAGS_MAGIC        0x4c5a3400
+#define BOOT_FLAGS_MAGIC_MASK   0xffffff00
+#define BOOT_FLAG_KERNEL_LZ4    0x01
+#define BOOT_FLAG_RAMDISK_LZ4   0x02
+#define BOOT_FLAG_VERIFY        0x04
+
+#define BOOT_FLAGS(hdr) \
+    ((((hdr)->unused[0] & BOOT_FLAGS_MAGIC_MASK) == BOOT_FLAGS_MAGIC) ? (hdr)->unused[0] & 0xff : 0)
+
 /*
 ** +-----------------+ 
 ** | boot header     | 1 page
@@ -0,0 +1,30 @@
+/*
+ Boot image headers of the boot partitions, read once and kept until
+ the flash contents or the partition change
+*/
+
+#ifndef _BOOTIMG_CACHE_H_
+#define _BOOTIMG_CACHE_H_
+
+#include <lib/ptable.h>
+#include <bootimg.h>
+
+#define BOOTIMG_ROM_NAME_SIZE	48
+
+struct bootimg_info {
+	char ptn_name[MAX_PTENTRY_NAME];
+	unsigned start;			/* the partition it was read from */
+	unsigned length;
+	unsigned gen;			/* flash_generation() when read */
+	int status;			/* 0, or BOOTIMG_ERROR / BOOTIMG_INVALID */
+	struct boot_img_hdr hdr;
+	char rom_name[BOOTIMG_ROM_NAME_SIZE];
+};
+
+#define BOOTIMG_ERROR	-1		/* the header page could not be read */
+#define BOOTIMG_INVALID	-2		/* no boot magic */
+
+/* the cached header of ptn, read from flash if needed, NULL if no ptn */
+const struct bootimg_info *bootimg_cache_get(struct ptentry *ptn);
+
+#endif
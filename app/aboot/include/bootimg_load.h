@@ -0,0 +1,23 @@
+/*
+ Loading the kernel and ramdisk of a boot image from flash
+*/
+
+#ifndef _BOOTIMG_LOAD_H_
+#define _BOOTIMG_LOAD_H_
+
+#include <lib/ptable.h>
+#include <bootimg.h>
+
+#define BOOTIMG_LOAD_KERNEL	-1	/* the kernel could not be loaded */
+#define BOOTIMG_LOAD_RAMDISK	-2	/* the ramdisk could not be loaded */
+#define BOOTIMG_LOAD_DIGEST	-3	/* loaded, but the image does not match its id */
+
+/*
+ * read the kernel and ramdisk of ptn to their load addresses, expanding
+ * LZ4 sections and checking the SHA-1 if the image asks for it on the
+ * way. hdr->kernel_size and ramdisk_size become the loaded sizes. Gives
+ * up early when *cancel becomes set.
+ */
+int bootimg_load(struct ptentry *ptn, struct boot_img_hdr *hdr, volatile int *cancel);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ Boot slot selection: the boot partitions (boot, sboot ... zboot) are
+ slots, each with a count of boot attempts that did not come back
+ through a clean reboot and a mark for images that failed to load.
+*/
+
+#ifndef _BOOTSLOT_H_
+#define _BOOTSLOT_H_
+
+#define BOOTSLOT_COUNT		8	/* supported_boot_partitions[0..7] */
+#define BOOTSLOT_MAX_TRIES	3
+#define BOOTSLOT_MAGIC		"CLKSLOT"
+#define BOOTSLOT_CONFIRM	"bootslot-ok"	/* misc command: the booted system is up */
+
+struct bootslot_state {
+	char magic[8];
+	unsigned char tries[BOOTSLOT_COUNT];	/* boots since the slot last came up */
+	unsigned char bad[BOOTSLOT_COUNT];	/* the image failed to load */
+	unsigned char last;			/* the slot booted last */
+	unsigned char pad[3];
+};
+
+/* start over if 's' holds no valid state */
+void bootslot_init(struct bootslot_state *s);
+
+/* the slot booted last came up and rebooted cleanly */
+void bootslot_boot_ok(struct bootslot_state *s);
+
+/*
+ * the bootloader starts: the slot booted last is good if the system
+ * rebooted into us or left BOOTSLOT_CONFIRM in misc
+ */
+void bootslot_start(struct bootslot_state *s, int rebooted, int confirmed);
+
+/* the user asked for 'slot', or it was just flashed: trust it again */
+void bootslot_reset(struct bootslot_state *s, unsigned slot);
+
+/*
+ * 'preferred' if it is usable, else the next usable slot after it in
+ * 'present' (a bit per slot), -1 if there is none
+ */
+int bootslot_pick(const struct bootslot_state *s, unsigned preferred, unsigned present);
+
+/* about to boot 'slot' */
+void bootslot_attempt(struct bootslot_state *s, unsigned slot);
+
+/* the image in 'slot' could not be loaded */
+void bootslot_failed(struct bootslot_state *s, unsigned slot);
+
+#endif
@@ -32,6 +32,55 @@
 int fastboot_init(void *xfer_buffer, unsigned max);
 unsigned int fastboot_cstat(void);
 int fastboot_write(void *buf, unsigned len);
+int fastboot_read(void *buf, unsigned len);
+
+/* A download sink takes over the data phase of the next download:
+ * start() may refuse the size (no download_max limit applies), then
+ * receive() pulls the data itself with fastboot_read(). receive()
+ * only fails on usb errors.
+ */
+struct fastboot_sink {
+	int (*start)(unsigned len);
+	int (*receive)(unsigned len);
+};
+
+/* only affects the next download */
+void fastboot_set_download_sink(struct fastboot_sink *sink);
+
+/* sent by the next 'upload': start() returns the size, send() writes it */
+struct fastboot_source {
+	unsigned (*start)(void);
+	int (*send)(unsigned len);
+};
+
+void fastboot_set_upload_source(struct fastboot_source *source);
+
+/* a write that runs while the caller prepares the next one */
+int fastboot_write_start(void *buf, unsigned len);
+int fastboot_write_wait(void);
+
+/* A download splitter looks at the first 'head' bytes of every download
+ * and may pick pieces of it (in increasing order) to be received
+ * straight to another address instead of download_base. Commands see
+ * the download joined up again, unless they were registered with
+ * fastboot_register_split() and deal with the pieces themselves.
+ */
+#define FASTBOOT_SPLIT_MAX	4
+
+struct fastboot_split {
+	unsigned offset;	/* in the download */
+	unsigned len;
+	void *dest;
+};
+
+typedef unsigned (*fastboot_splitter)(const void *head, unsigned len,
+				      struct fastboot_split *split, unsigned max);
+
+void fastboot_set_download_splitter(unsigned head, fastboot_splitter splitter);
+/* the pieces of the last download that are not at download_base */
+unsigned fastboot_download_pieces(const struct fastboot_split **split);
+/* move them back into download_base */
+void fastboot_download_join(void);
 /* register a command handler 
  * - command handlers will be called if their prefix matches
  * - they are expected to call fastboot_okay() or fastboot_fail()
@@ -39,12 +88,32 @@ int fastboot_write(void *buf, unsigned len);
  */
 void fastboot_register(const char *prefix,
 		       void (*handle)(const char *arg, void *data, unsigned size));
+void fastboot_register_split(const char *prefix,
+		       void (*handle)(const char *arg, void *data, unsigned size));
 
 /* publish a variable readable by the built-in getvar command */
 void fastboot_publish(const char *name, const char *value);
+/* a variable whose value is asked for on every getvar */
+void fastboot_publish_func(const char *name, const char *(*get)(void));
+
+/* wall time of a command, and what went over usb meanwhile */
+#define FASTBOOT_PERF_CMDS	8
+
+struct fastboot_perf {
+	char name[24];
+	unsigned usec;
+	unsigned bytes;
+};
+
+/* the n-th most recent command (0 is the last one), -1 if there is none */
+int fastboot_get_perf(unsigned n, struct fastboot_perf *perf);
+/* its KB/s */
+unsigned fastboot_perf_rate(const struct fastboot_perf *perf);
 
 /* only callable from within a command handler */
 void fastboot_okay(const char *result);
 void fastboot_fail(const char *reason);
+/* an INFO line the host prints before the final reply */
+void fastboot_info(const char *info);
 
 #endif
@@ -0,0 +1,19 @@
+/*
+ Writing Android sparse images to a NAND partition
+*/
+
+#ifndef _FLASH_SPARSE_H_
+#define _FLASH_SPARSE_H_
+
+#include <lib/ptable.h>
+
+/* true if the downloaded data starts with a sparse header */
+int flash_is_sparse(const void *data, unsigned sz);
+
+/* expand the sparse image in 'data' into 'ptn', *bytes tells how much
+ * was written and *crc gets its flash_image_crc() unless crc is NULL
+ */
+int flash_write_sparse(struct ptentry *ptn, unsigned extra_per_page,
+		       const void *data, unsigned sz, unsigned long *crc, unsigned *bytes);
+
+#endif
@@ -0,0 +1,23 @@
+/*
+ Streaming fastboot flash: the partition is programmed while the
+ image is still being downloaded
+*/
+
+#ifndef _FLASH_STREAM_H_
+#define _FLASH_STREAM_H_
+
+#include <lib/ptable.h>
+
+/* stream the next download into 'ptn', checksumming it if 'verify' */
+int flash_stream_arm(struct ptentry *ptn, unsigned extra_per_page, int boot_image,
+		     int verify);
+
+/* the partition a streamed download went to, NULL if none is pending */
+struct ptentry *flash_stream_pending(void);
+
+/* wait for the streamed write to finish, returns the result, the bytes
+ * written and their flash_image_crc() when verifying
+ */
+int flash_stream_finish(unsigned long *crc, unsigned *bytes);
+
+#endif
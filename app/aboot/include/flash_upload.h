@@ -0,0 +1,13 @@
+/*
+ Partition upload: 'fastboot get_staged' reads a partition back
+*/
+
+#ifndef _FLASH_UPLOAD_H_
+#define _FLASH_UPLOAD_H_
+
+#include <lib/ptable.h>
+
+/* the next 'upload' sends 'ptn', with extra_per_page spare bytes per page */
+int flash_upload_arm(struct ptentry *ptn, unsigned extra_per_page);
+
+#endif
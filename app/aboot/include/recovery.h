@@ -64,6 +64,12 @@ struct update_header {
 
 
 
+#define MISC_BOOTSLOT_PAGE	2	/* struct bootslot_state */
+
+/* one page of misc, the first MISC_PAGES are kept over a write */
+int misc_read(unsigned page, void *out, unsigned size);
+int misc_write(unsigned page, const void *in, unsigned size);
+
 int get_recovery_message(struct recovery_message *out);
 int set_recovery_message(const struct recovery_message *in);
 
@@ -0,0 +1,35 @@
+/*
+ Android sparse image format, as written by img2simg / make_ext4fs -s
+*/
+
+#ifndef _SPARSE_FORMAT_H_
+#define _SPARSE_FORMAT_H_
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_HEADER_MAJOR_VER	1
+
+typedef struct sparse_header {
+	unsigned	magic;
+	unsigned short	major_version;
+	unsigned short	minor_version;
+	unsigned short	file_hdr_sz;	/* 28 bytes for the first revision */
+	unsigned short	chunk_hdr_sz;	/* 12 bytes for the first revision */
+	unsigned	blk_sz;		/* output block size, a multiple of 4 */
+	unsigned	total_blks;	/* output blocks in the image */
+	unsigned	total_chunks;
+	unsigned	image_checksum;
+} sparse_header_t;
+
+#define CHUNK_TYPE_RAW		0xCAC1
+#define CHUNK_TYPE_FILL		0xCAC2
+#define CHUNK_TYPE_DONT_CARE	0xCAC3
+#define CHUNK_TYPE_CRC32	0xCAC4
+
+typedef struct chunk_header {
+	unsigned short	chunk_type;
+	unsigned short	reserved1;
+	unsigned	chunk_sz;	/* output blocks */
+	unsigned	total_sz;	/* input bytes, header and data */
+} chunk_header_t;
+
+#endif
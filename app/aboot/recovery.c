@@ -49,70 +49,87 @@ unsigned boot_into_recovery = 0;
 unsigned selected_boot;
 int show_multi_boot_screen;
 
-int get_recovery_message(struct recovery_message *out)
+static struct ptentry *misc_partition(void)
 {
 	struct ptentry *ptn;
 	struct ptable *ptable;
-	unsigned offset = 0;
-	unsigned pagesize = flash_page_size();
 
 	ptable = flash_get_ptable();
 	if (ptable == NULL) {
 		dprintf(CRITICAL, "   ERROR: Partition table not found\n");
-		return -1;
+		return NULL;
 	}
 	
 	ptn = ptable_find(ptable, "misc");
 	if (ptn == NULL) {
 		dprintf(CRITICAL, "   ERROR: No misc partition found\n");
-		return -1;
+		return NULL;
 	}
+	return ptn;
+}
 
-	offset += (pagesize * MISC_COMMAND_PAGE);
-	if (flash_read(ptn, offset, buf, pagesize)) {
-		dprintf(CRITICAL, "   ERROR: Cannot read recovery_header\n");
+int misc_read(unsigned page, void *out, unsigned size)
+{
+	struct ptentry *ptn = misc_partition();
+	unsigned pagesize = flash_page_size();
+
+	if (ptn == NULL)
+		return -1;
+
+	if (size > pagesize || flash_read(ptn, pagesize * page, buf, pagesize)) {
+		dprintf(CRITICAL, "   ERROR: Cannot read misc page %d\n", page);
 		return -1;
 	}
-	memcpy(out, buf, sizeof(*out));
+	memcpy(out, buf, size);
 	
 	return 0;
 }
 
-int set_recovery_message(const struct recovery_message *in)
+int misc_write(unsigned page, const void *in, unsigned size)
 {
-	struct ptentry *ptn;
-	struct ptable *ptable;
-	unsigned offset = 0;
+	struct ptentry *ptn = misc_partition();
 	unsigned pagesize = flash_page_size();
-	unsigned n = 0;
+	unsigned n = pagesize * MISC_PAGES;
+	char *misc;
+	int ret = -1;
 
-	ptable = flash_get_ptable();
-	if (ptable == NULL) {
-		dprintf(CRITICAL, "   ERROR: Partition table not found\n");
+	if (ptn == NULL)
 		return -1;
-	}
-	
-	ptn = ptable_find(ptable, "misc");
-	if (ptn == NULL) {
-		dprintf(CRITICAL, "   ERROR: No misc partition found\n");
+	if (size > pagesize || page >= MISC_PAGES)
 		return -1;
-	}
 
-	n = pagesize * (MISC_COMMAND_PAGE + 1);
-	if (flash_read(ptn, offset, target_get_scratch_address(), n)) {
-		dprintf(CRITICAL, "   ERROR: Cannot read recovery_header\n");
+	// Not the scratch area, a boot image may be loading into it
+	misc = memalign(32, n);
+	if (misc == NULL) {
+		dprintf(CRITICAL, "   ERROR: Out of memory for misc\n");
 		return -1;
 	}
 
-	offset += (pagesize * MISC_COMMAND_PAGE);
-	offset += (unsigned)target_get_scratch_address();
-	memcpy((void *)offset, in, sizeof(*in));
-	if (flash_write(ptn, 0, target_get_scratch_address(), n)) {
+	// The whole partition is erased, keep the other pages
+	if (flash_read(ptn, 0, misc, n)) {
+		dprintf(CRITICAL, "   ERROR: Cannot read misc\n");
+		goto out;
+	}
+
+	memcpy(misc + pagesize * page, in, size);
+	if (flash_write(ptn, 0, misc, n)) {
 		dprintf(CRITICAL, "   ERROR: flash write fail!\n");
-		return -1;
+		goto out;
 	}
-	
-	return 1;
+	ret = 0;
+out:
+	free(misc);
+	return ret;
+}
+
+int get_recovery_message(struct recovery_message *out)
+{
+	return misc_read(MISC_COMMAND_PAGE, out, sizeof(*out));
+}
+
+int set_recovery_message(const struct recovery_message *in)
+{
+	return misc_write(MISC_COMMAND_PAGE, in, sizeof(*in)) ? -1 : 1;
 }
 
 int read_update_header_for_bootloader(struct update_header *header)
@@ -5,6 +5,13 @@ INCLUDES += \
 
 OBJS += \
 	$(LOCAL_DIR)/aboot.o \
+	$(LOCAL_DIR)/boot_prefetch.o \
+	$(LOCAL_DIR)/bootimg_cache.o \
+	$(LOCAL_DIR)/bootimg_load.o \
+	$(LOCAL_DIR)/bootslot.o \
 	$(LOCAL_DIR)/fastboot.o \
+	$(LOCAL_DIR)/flash_sparse.o \
+	$(LOCAL_DIR)/flash_stream.o \
+	$(LOCAL_DIR)/flash_upload.o \
 	$(LOCAL_DIR)/recovery.o
 
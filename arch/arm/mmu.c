@@ -122,5 +122,27 @@ void arch_disable_mmu(void)
 	arm_write_cr1(arm_read_cr1() & ~(1<<0)); // access flag disabled, TEX remap disabled, mmu disabled
 }
 
+int arch_range_cached(addr_t start, size_t len)
+{
+	uint index;
+
+	if (len == 0 || !(arm_read_cr1() & 0x1))
+		return 0;
+
+	for (index = start / MB; index <= (start + len - 1) / MB; index++) {
+		// unmapped, or a section with C set
+		if (((tt[index] & 3) != 2) || (tt[index] & (1 << 3)))
+			return 1;
+	}
+	return 0;
+}
+
+#else
+
+int arch_range_cached(addr_t start, size_t len)
+{
+	return 1;
+}
+
 #endif // ARM_WITH_MMU
 
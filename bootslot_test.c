@@ -0,0 +1,111 @@
+/*
+ * bootslot_test.c
+ *
+ * Runs the boot slot state machine of app/aboot/bootslot.c through the
+ * boots a device goes through: hangs followed by a battery pull and a
+ * power button start, clean reboots, confirmed boots, images that do not
+ * load and freshly flashed slots.
+ *
+ *   gcc -O2 -Iapp/aboot/include bootslot_test.c -o bootslot_test
+ *   ./bootslot_test
+ *
+ * Prints the failed checks and "ok" or "FAILED", the exit status tells.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "app/aboot/bootslot.c"
+
+static int failed;
+
+#define CHECK(x) \
+	do { if (!(x)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #x); failed++; } } while (0)
+
+/*
+ * one power-on: what the last boot left behind, then pick and attempt a
+ * slot like boot_linux_from_flash(); returns the slot, -1 for none
+ */
+static int power_on(struct bootslot_state *s, unsigned preferred, unsigned present,
+		    int rebooted, int confirmed)
+{
+	int slot;
+
+	bootslot_init(s);
+	bootslot_start(s, rebooted, confirmed);
+	slot = bootslot_pick(s, preferred, present);
+	if (slot >= 0)
+		bootslot_attempt(s, slot);
+	return slot;
+}
+
+int main(void)
+{
+	struct bootslot_state s;
+	unsigned n;
+
+	/* an erased or foreign misc page starts over */
+	memset(&s, 0xff, sizeof(s));
+	bootslot_init(&s);
+	CHECK(!memcmp(s.magic, BOOTSLOT_MAGIC, sizeof(BOOTSLOT_MAGIC)));
+	for (n = 0; n < BOOTSLOT_COUNT; n++)
+		CHECK(s.tries[n] == 0 && s.bad[n] == 0);
+
+	/* a kernel that hangs: power button starts do not vouch for it */
+	for (n = 0; n < BOOTSLOT_MAX_TRIES; n++)
+		CHECK(power_on(&s, 0, 0x3, 0, 0) == 0);
+	CHECK(s.tries[0] == BOOTSLOT_MAX_TRIES);
+	CHECK(power_on(&s, 0, 0x3, 0, 0) == 1);
+	CHECK(s.last == 1);
+
+	/* the fallback comes up and reboots: it stays, slot 0 stays out */
+	CHECK(power_on(&s, 0, 0x3, 1, 0) == 1);
+	CHECK(s.tries[1] == 1 && s.tries[0] == BOOTSLOT_MAX_TRIES);
+
+	/* flashing slot 0 trusts it again */
+	bootslot_reset(&s, 0);
+	CHECK(power_on(&s, 0, 0x3, 1, 0) == 0);
+	CHECK(s.tries[1] == 0);
+
+	/* a system that is powered off every time stays usable if it confirms */
+	for (n = 0; n < 3 * BOOTSLOT_MAX_TRIES; n++)
+		CHECK(power_on(&s, 0, 0x3, 0, 1) == 0);
+	CHECK(s.tries[0] == 1);
+	/* ... until it stops confirming */
+	for (n = 1; n < BOOTSLOT_MAX_TRIES; n++)
+		CHECK(power_on(&s, 0, 0x3, 0, 0) == 0);
+	CHECK(power_on(&s, 0, 0x3, 0, 0) == 1);
+
+	/* an image that fails to load is out until it is flashed again */
+	bootslot_reset(&s, 0);
+	bootslot_failed(&s, 1);
+	CHECK(bootslot_pick(&s, 1, 0x3) == 0);
+	bootslot_failed(&s, 0);
+	CHECK(bootslot_pick(&s, 1, 0x3) == -1);
+	CHECK(power_on(&s, 0, 0x3, 1, 1) == -1);
+	bootslot_reset(&s, 1);
+	CHECK(power_on(&s, 0, 0x3, 0, 0) == 1);
+
+	/* slots without a partition are skipped, the search wraps around */
+	memset(&s, 0, sizeof(s));
+	bootslot_init(&s);
+	CHECK(bootslot_pick(&s, 2, 0x81) == 7);
+	CHECK(bootslot_pick(&s, 9, 0x81) == 0);
+	CHECK(bootslot_pick(&s, 3, 0) == -1);
+
+	/* the state survives a store and load, a bad 'last' does not */
+	bootslot_attempt(&s, 5);
+	bootslot_init(&s);
+	CHECK(s.tries[5] == 1 && s.last == 5);
+	s.last = BOOTSLOT_COUNT;
+	bootslot_init(&s);
+	CHECK(s.tries[5] == 0 && s.last == 0);
+
+	/* the count saturates */
+	for (n = 0; n < 300; n++)
+		bootslot_attempt(&s, 2);
+	CHECK(s.tries[2] == 255);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * boottrace_parse.c
+ *
+ * Turns the output of 'fastboot oem boottrace' into a per phase breakdown:
+ *
+ *   fastboot oem boottrace 2>&1 | ./boottrace_parse
+ *
+ * Trace points (P) split the boot into phases, each lasting until the
+ * next point. Begin/end pairs (B/E) of the same name are summed up per name.
+ * A last_boot_<path> point is not a phase: after a warm reboot it carries
+ * the kernel handoff time of the previous boot, in ms, as its argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ENTRIES	1024
+#define MAX_OPS		64
+
+struct entry
+{
+	unsigned usec;
+	char type;
+	char name[40];
+	unsigned arg;
+};
+
+struct op
+{
+	char name[40];
+	unsigned count;
+	unsigned long long total;
+	unsigned max;
+	unsigned begin;
+	int open;
+};
+
+static struct entry entries[MAX_ENTRIES];
+static struct op ops[MAX_OPS];
+static int noEntries, noOps;
+
+static struct op *find_op(const char *name)
+{
+	int i;
+
+	for (i = 0; i < noOps; i++)
+		if (strcmp(ops[i].name, name) == 0)
+			return &ops[i];
+	if (noOps == MAX_OPS)
+		return NULL;
+	strcpy(ops[noOps].name, name);
+	return &ops[noOps++];
+}
+
+int main(void)
+{
+	char line[256];
+	const char *p;
+	struct entry *e;
+	struct op *op;
+	int i, last = -1, prev = -1;
+
+	while (fgets(line, sizeof(line), stdin))
+	{
+		p = strstr(line, "bt ");
+		if (p == NULL || noEntries == MAX_ENTRIES)
+			continue;
+		e = &entries[noEntries];
+		if (sscanf(p, "bt %u %c %39s %u", &e->usec, &e->type, e->name, &e->arg) == 4)
+			noEntries++;
+	}
+	if (noEntries == 0)
+	{
+		fprintf(stderr, "no trace points found\n");
+		return 1;
+	}
+
+	printf("%-24s %10s %10s\n", "phase", "start(ms)", "took(ms)");
+	for (i = 0; i < noEntries; i++)
+	{
+		e = &entries[i];
+		if (e->type == 'P' && strncmp(e->name, "last_boot_", 10) == 0)
+		{
+			prev = i;
+			continue;
+		}
+		if (e->type == 'P')
+		{
+			if (last >= 0)
+				printf("%-24s %10.3f %10.3f\n", entries[last].name, entries[last].usec / 1000.0,
+					(e->usec - entries[last].usec) / 1000.0);
+			last = i;
+			continue;
+		}
+		op = find_op(e->name);
+		if (op == NULL)
+			continue;
+		if (e->type == 'B')
+		{
+			op->begin = e->usec;
+			op->open = 1;
+		}
+		else if (e->type == 'E' && op->open)
+		{
+			unsigned took = e->usec - op->begin;
+
+			op->open = 0;
+			op->count++;
+			op->total += took;
+			if (took > op->max)
+				op->max = took;
+		}
+	}
+	if (last >= 0)
+		printf("%-24s %10.3f %10s\n", entries[last].name, entries[last].usec / 1000.0, "-");
+
+	if (prev >= 0)
+		printf("\nprevious boot: kernel handoff at %u ms, %s path\n",
+			entries[prev].arg, entries[prev].name + 10);
+
+	if (noOps)
+	{
+		printf("\n%-24s %6s %10s %10s\n", "operation", "count", "total(ms)", "max(ms)");
+		for (i = 0; i < noOps; i++)
+			printf("%-24s %6u %10.3f %10.3f\n", ops[i].name, ops[i].count,
+				ops[i].total / 1000.0, ops[i].max / 1000.0);
+	}
+	return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * heap_replay.c
+ *
+ * Replays an allocation trace against lib/heap/heap.c on a 1 MB heap,
+ * the size of MEMSIZE on the device. Reports the time per operation,
+ * the allocations that failed, the largest block left once everything
+ * is freed again, and the slab counters:
+ *
+ *   gcc -O2 -no-pie -Wno-multichar -idirafter include heap_replay.c -o heap_replay
+ *   ./heap_replay [trace]
+ *
+ * A trace has one operation per line, ids name the allocations:
+ *
+ *   a <id> <size> [alignment]	heap_alloc()
+ *   r <id> <size>			heap_realloc()
+ *   f <id>				heap_free()
+ *
+ * Without a trace a boot-like mix is replayed: mostly small fixed sizes
+ * (fastboot command and variable nodes, thread structs, usb requests),
+ * some aligned, and a few buffers of some KB.
+ *
+ * Building with -DHEAP_C='"old_heap.c"' replays against another heap.c,
+ * e.g. the one before the slabs (git show <rev>:lib/heap/heap.c).
+ *
+ * heap.c keeps pointers in 32 bit masks, so the heap must live below
+ * 4 GB: the program is not position independent.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/* lk headers heap.c needs, replaced */
+#define __DEBUG_H
+#define __ASSERT_H
+#define __KERNEL_THREAD_H
+#define __KERNEL_MUTEX_H
+
+typedef uintptr_t addr_t;
+typedef uintptr_t vaddr_t;
+typedef unsigned int uint;
+
+#define INFO		1
+#define DEBUGLEVEL	1
+
+static int verbose;
+
+#define dprintf(level, x...) \
+	do { if (verbose) printf(x); } while (0)
+#define hexdump(ptr, len)	do { } while (0)
+#define panic(x...)		do { printf(x); abort(); } while (0)
+#define ASSERT(x) \
+	do { if (!(x)) panic("ASSERT FAILED at (%s:%d): %s\n", __FILE__, __LINE__, #x); } while (0)
+#define DEBUG_ASSERT(x)		do { } while (0)
+#define LTRACEF(x...)		do { } while (0)
+#define LTRACE_ENTRY		do { } while (0)
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+static void enter_critical_section(void) { }
+static void exit_critical_section(void) { }
+
+typedef int mutex_t;
+static void mutex_init(mutex_t *m) { }
+static int mutex_acquire(mutex_t *m) { return 0; }
+static int mutex_release(mutex_t *m) { return 0; }
+
+#define HEAP_SIZE	(1 << 20)
+static unsigned char heap_area[HEAP_SIZE] __attribute__((aligned(8)));
+
+#define WITH_STATIC_HEAP 1
+#define HEAP_START	((unsigned long) heap_area)
+#define HEAP_LEN	((size_t) HEAP_SIZE)
+
+static void heap_test(void) __attribute__((unused));
+
+#ifdef HEAP_C
+#include HEAP_C
+#else
+#include "lib/heap/heap.c"
+#endif
+
+#define MAX_IDS		4096
+
+struct op {
+	char type;			/* a, r or f */
+	unsigned id;
+	unsigned size;
+	unsigned align;
+};
+
+static struct op *ops;
+static unsigned nops, maxops;
+
+static void add_op(char type, unsigned id, unsigned size, unsigned align)
+{
+	if (nops == maxops) {
+		maxops = maxops ? 2 * maxops : 65536;
+		ops = realloc(ops, maxops * sizeof(*ops));
+		if (ops == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(2);
+		}
+	}
+	ops[nops].type = type;
+	ops[nops].id = id;
+	ops[nops].size = size;
+	ops[nops].align = align;
+	nops++;
+}
+
+static int read_trace(const char *path)
+{
+	char line[128];
+	unsigned id, size, align;
+	char type;
+	FILE *f = fopen(path, "r");
+	int n;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		align = 0;
+		size = 0;
+		n = sscanf(line, " %c %u %u %u", &type, &id, &size, &align);
+		if (n < 2 || line[0] == '#')
+			continue;
+		if (id >= MAX_IDS || (type != 'a' && type != 'r' && type != 'f')) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			fclose(f);
+			return -1;
+		}
+		add_op(type, id, size, align);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* the boot-like mix, 97% from a handful of small sizes */
+static void make_trace(unsigned count)
+{
+	static const unsigned small[] = { 12, 16, 24, 40, 64, 96, 160, 200, 256, 480 };
+	static bool live[MAX_IDS];
+	unsigned n, id;
+
+	srand(1);
+	for (n = 0; n < count; n++) {
+		id = rand() % MAX_IDS;
+		if (live[id]) {
+			if (rand() % 8 == 0) {
+				add_op('r', id, small[rand() % 10], 0);
+			} else {
+				add_op('f', id, 0, 0);
+				live[id] = false;
+			}
+			continue;
+		}
+		if (rand() % 100 < 97)
+			add_op('a', id, small[rand() % 10], (rand() % 10 == 0) ? 64 : 0);
+		else
+			add_op('a', id, 1024 + rand() % 8192, 0);
+		live[id] = true;
+	}
+}
+
+static void *ptrs[MAX_IDS];
+static unsigned sizes[MAX_IDS];
+
+/* allocations carry their id, a free or realloc checks nothing overwrote it */
+static int check(unsigned id)
+{
+	unsigned char *p = ptrs[id];
+
+	for (unsigned n = 0; n < sizes[id]; n++) {
+		if (p[n] != (unsigned char) id) {
+			printf("allocation %u corrupt at byte %u\n", id, n);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	unsigned fails = 0, largest = 0;
+	double ns;
+	void *p;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) {
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+	if (argc > 1) {
+		if (read_trace(argv[1]))
+			return 2;
+	} else {
+		make_trace(2000000);
+	}
+
+	heap_init();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned n = 0; n < nops; n++) {
+		struct op *op = &ops[n];
+
+		switch (op->type) {
+		case 'a':
+			if (ptrs[op->id])
+				heap_free(ptrs[op->id]);
+			p = heap_alloc(op->size, op->align);
+			if (p && op->align && ((uintptr_t) p & (op->align - 1))) {
+				printf("allocation %u misaligned\n", op->id);
+				return 1;
+			}
+			break;
+		case 'r':
+			if (ptrs[op->id] && check(op->id))
+				return 1;
+			p = heap_realloc(ptrs[op->id], op->size);
+			if (p == NULL && op->size) {
+				/* realloc leaves the old block alone */
+				fails++;
+				continue;
+			}
+			if (p && ptrs[op->id]) {
+				/* the kept part must have come along */
+				unsigned keep = sizes[op->id] < op->size ? sizes[op->id] : op->size;
+
+				for (unsigned i = 0; i < keep; i++) {
+					if (((unsigned char *) p)[i] != (unsigned char) op->id) {
+						printf("realloc of %u lost its data\n", op->id);
+						return 1;
+					}
+				}
+			}
+			break;
+		default:
+			if (ptrs[op->id] && check(op->id))
+				return 1;
+			heap_free(ptrs[op->id]);
+			p = NULL;
+			break;
+		}
+		if (p == NULL && op->type == 'a')
+			fails++;
+		ptrs[op->id] = p;
+		sizes[op->id] = p ? op->size : 0;
+		if (p)
+			memset(p, op->id, op->size);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+	for (unsigned id = 0; id < MAX_IDS; id++) {
+		if (ptrs[id] && check(id))
+			return 1;
+		heap_free(ptrs[id]);
+	}
+	heap_dump();
+
+	/* what fragmentation left: the largest block that can still be had, in 4K steps */
+	for (unsigned size = HEAP_SIZE; size >= 4096 && !largest; size -= 4096) {
+		if ((p = heap_alloc(size, 0)) != NULL) {
+			largest = size;
+			heap_free(p);
+		}
+	}
+
+	printf("%u operations, %.1f ns each, %u allocations failed\n", nops, ns / nops, fails);
+	printf("largest block once all is freed: %u KB of %u KB\n", largest >> 10, HEAP_SIZE >> 10);
+#ifndef HEAP_C
+	{
+		struct heap_slab_stats st;
+
+		printf("%6s %10s %10s %8s %8s %6s\n", "class", "allocs", "frees", "in use", "peak", "pages");
+		for (unsigned n = 0; heap_get_slab_stats(n, &st) == 0; n++)
+			printf("%6zu %10u %10u %8u %8u %6u\n", st.size, st.allocs, st.frees,
+			       st.inuse, st.peak, st.slabs);
+	}
+#endif
+	return 0;
+}
@@ -53,6 +53,10 @@ void arch_clean_cache_range(addr_t start, size_t len);
 void arch_clean_invalidate_cache_range(addr_t start, size_t len);
 void arch_invalidate_cache_range(addr_t start, size_t len);
 void arch_sync_cache_range(addr_t start, size_t len);
+/* 0 if no part of the range is mapped cacheable, the range ops above
+ * can be skipped for it then
+ */
+int arch_range_cached(addr_t start, size_t len);
 	
 void arch_idle(void);
 
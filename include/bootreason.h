@@ -3,6 +3,7 @@
 
 #define LK_BOOTREASON_ADDR 		0x2FFB0000
 #define SPL_BOOT_REASON_ADDR 	0x8105c
+#define LK_BOOTTIME_ADDR		(LK_BOOTREASON_ADDR + 8)	// last kernel handoff, see target_save_boot_time()
 /*
 #define SPL_TEST_ADDR			0x8113c
 
@@ -17,6 +18,7 @@
 #define MARK_ALARM_TAG 	0x53000000 
 #define MARK_OEM_TAG   	0x6f656d00
 #define MARK_LK_TAG 	0X004B4C63
+#define MARK_TIME_TAG	0x454D4954 //TIME
 
 #define MARK_BUTTON		0x42555454 //Power button
 #define MARK_RESET	 	0x52455354 //Reset
@@ -0,0 +1,35 @@
+/*
+ Boot phase tracing
+
+ A fixed ring of timestamped trace points, filled from kmain on and
+ dumped with 'fastboot oem boottrace'. Names must be string literals,
+ only the pointer is kept.
+*/
+#ifndef __BOOTTRACE_H
+#define __BOOTTRACE_H
+
+#include <sys/types.h>
+
+#define BOOTTRACE_ENTRIES	256	/* ring size, a power of two */
+
+#define BOOTTRACE_POINT	'P'	/* something happened */
+#define BOOTTRACE_BEGIN	'B'	/* an operation started ... */
+#define BOOTTRACE_END	'E'	/* ... and finished */
+
+struct boottrace_entry {
+	uint32_t usec;			/* current_time_hires(), truncated */
+	const char *name;
+	uint32_t arg;
+	char type;
+};
+
+void boottrace(char type, const char *name, uint32_t arg);
+
+/* copy out the oldest to newest entries, returns how many, 'lost' gets the overwritten count */
+unsigned boottrace_read(struct boottrace_entry *out, unsigned max, unsigned *lost);
+
+#define TRACE_POINT(name)		boottrace(BOOTTRACE_POINT, name, 0)
+#define TRACE_BEGIN(name, arg)		boottrace(BOOTTRACE_BEGIN, name, arg)
+#define TRACE_END(name, arg)		boottrace(BOOTTRACE_END, name, arg)
+
+#endif
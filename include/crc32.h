@@ -0,0 +1,13 @@
+/*
+ Table driven crc32 (same polynomial as zlib)
+*/
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <sys/types.h>
+
+/* standard (zlib compatible) crc32, pass 0 to start a new checksum */
+unsigned long crc32(unsigned long crc, const void *buf, size_t len);
+
+#endif
+
@@ -58,6 +58,51 @@ int flash_write(struct ptentry *ptn, unsigned extra_per_page, const void *data,
 		unsigned bytes);
 int flash_bad_block_table(struct ptentry *ptn);
 int flash_mark_badblock(struct ptentry *ptn, unsigned block);
+/* streaming writes: the image is handed over in pieces, every piece but
+ * the last one must be a multiple of flash_write_chunk_size() bytes.
+ * 'more' is the number of bytes that will still follow.
+ */
+unsigned flash_write_chunk_size(unsigned extra_per_page);
+int flash_write_begin(struct ptentry *ptn, unsigned extra_per_page);
+int flash_write_pages(const void *data, unsigned bytes, unsigned more);
+/* same, one source pointer per page and counts in pages; a NULL source
+ * leaves the page erased without programming it
+ */
+int flash_write_page_list(const void * const *pages, unsigned count, unsigned more);
+int flash_write_end(void);
+/* give up on a streaming write: unlike flash_write_end() the rest of the
+ * partition is not erased
+ */
+int flash_write_abort(void);
+/* write verification: crc32 of the page data (not the spare) of an
+ * image, and the same checksum of what ptn holds, read back into
+ * 'work' which must take 2 * flash_write_chunk_size() bytes
+ */
+unsigned long flash_image_crc(unsigned long crc, const void *data, unsigned bytes,
+			      unsigned extra_per_page);
+int flash_read_crc(struct ptentry *ptn, unsigned extra_per_page, unsigned bytes,
+		   void *work, unsigned long *crc);
+/* changes whenever flash_write()/flash_erase() or a streamed write
+ * may have changed partition contents, for caches of what is on flash
+ */
+unsigned flash_generation(void);
+/* flash layer counters since boot */
+struct flash_stats {
+	unsigned dmov_submits;		/* command lists handed to the data mover */
+	unsigned pages_read;
+	unsigned pages_written;
+	unsigned pages_blank;		/* all 0xff pages left erased instead */
+	unsigned pages_erased;		/* erased pages read back as 0xff */
+	unsigned blocks_erased;
+	unsigned l2p_lookups;		/* logical to physical block translations */
+	unsigned l2p_probes;		/* blocks read to learn if they are bad */
+};
+
+void flash_get_stats(struct flash_stats *stats);
+/* time 'loops' block translations over ptn, returns the ns one took */
+unsigned flash_bench_translate(struct ptentry *ptn, unsigned loops);
+int flash_bbt_load(struct ptentry *ptn);
+unsigned flash_bbt_image(void *buf);
 int flash_bad_blocks;
 
 static inline int flash_read(struct ptentry *ptn, unsigned offset, void *data,
@@ -45,6 +45,36 @@ void udc_request_free(struct udc_request *req);
 int udc_request_queue(struct udc_endpoint *ept, struct udc_request *req);
 int udc_request_cancel(struct udc_endpoint *ept, struct udc_request *req);
 
+/* transfer counters since udc_init() */
+struct udc_stats {
+	unsigned bytes_in;		/* sent to the host */
+	unsigned bytes_out;		/* received from it */
+	unsigned requests;
+	unsigned dtds;
+	unsigned reprimes;		/* queued after the controller ran dry */
+	unsigned naks;			/* OUT requests during which the host was NAKed */
+	unsigned errors;
+	unsigned resets;
+	unsigned retries;		/* completions left to the retry timer */
+};
+
+void udc_get_stats(struct udc_stats *stats);
+
+/* cache line aligned buffers for small transfers */
+#define UDC_BUFFER_SIZE		4096
+void *udc_buffer_alloc(void);
+void udc_buffer_free(void *buf);
+
+/* the most a single request can move */
+#define UDC_MAX_REQUEST		(16 * 1024 * 1024)
+
+/*
+ * Requests queued on an endpoint complete in order, a request can be
+ * queued while others are still pending (also from a complete()
+ * callback). udc_request_cancel() takes 'req' and everything queued
+ * behind it off the endpoint without calling their complete().
+ */
+
 #define UDC_TYPE_BULK_IN	1
 #define UDC_TYPE_BULK_OUT	2
 
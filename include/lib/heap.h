@@ -32,4 +32,17 @@ void heap_init(void);
 /* critical section time delayed free */
 void heap_delayed_free(void *);
 
+/* counters of one size class of the small object slabs */
+struct heap_slab_stats {
+	size_t size;			/* object size of the class */
+	unsigned int allocs;
+	unsigned int frees;
+	unsigned int inuse;		/* objects handed out right now */
+	unsigned int peak;
+	unsigned int slabs;		/* pages the class holds */
+};
+
+/* n counts from the smallest class, -1 past the last one */
+int heap_get_slab_stats(unsigned int n, struct heap_slab_stats *stats);
+
 #endif
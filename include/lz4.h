@@ -0,0 +1,38 @@
+/*
+ LZ4 decompression, legacy frame format ("lz4 -l", as used for Linux
+ kernels and initramfs)
+*/
+#ifndef __LZ4_H
+#define __LZ4_H
+
+#include <sys/types.h>
+
+#define LZ4_LEGACY_MAGIC	0x184c2102
+#define LZ4_LEGACY_BLOCK	(8 << 20)	/* uncompressed bytes per block */
+
+/*
+ * Incremental decoder: the compressed data arrives in one buffer that
+ * fills up over time, lz4_legacy_run() decodes whatever is complete
+ * and picks up from there on the next call.
+ */
+struct lz4_legacy {
+	unsigned char *dst;
+	unsigned char *op;		/* output so far */
+	unsigned char *dst_end;
+	unsigned in;			/* input consumed */
+	unsigned block_end;		/* input offset the current block ends at */
+	int in_block;
+};
+
+void lz4_legacy_init(struct lz4_legacy *s, void *dst, unsigned dst_max);
+
+/* decode src[0..avail), 0 or -1 on corrupt data or no room for the output */
+int lz4_legacy_run(struct lz4_legacy *s, const void *src, unsigned avail);
+
+/* decoded size if all of the len input bytes made a whole stream, else -1 */
+int lz4_legacy_done(struct lz4_legacy *s, unsigned len);
+
+/* one shot, the decoded size or -1 */
+int lz4_legacy_decode(const void *src, unsigned len, void *dst, unsigned dst_max);
+
+#endif
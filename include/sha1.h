@@ -0,0 +1,21 @@
+/*
+ SHA-1, as used for the id of Android boot images
+*/
+#ifndef __SHA1_H
+#define __SHA1_H
+
+#include <sys/types.h>
+
+#define SHA1_DIGEST_SIZE	20
+
+struct sha1_ctx {
+	uint32_t state[5];
+	uint32_t count;			/* bytes hashed so far */
+	unsigned char block[64];
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_SIZE]);
+
+#endif
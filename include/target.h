@@ -50,4 +50,8 @@ void target_shutdown(void);
 void target_reboot(unsigned reboot_reason);
 unsigned target_check_reboot_mode(void);
 
+/* the kernel handoff time in ms and boot path of the previous boot survive a warm reboot */
+void target_save_boot_time(unsigned ms, unsigned path);
+int target_last_boot_time(unsigned *ms, unsigned *path);
+
 #endif
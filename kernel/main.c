@@ -33,6 +33,7 @@
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/dpc.h>
+#include <boottrace.h>
 
 extern void *__ctor_list;
 extern void *__ctor_end;
@@ -72,6 +73,8 @@ void kmain(void)
 	// get us into some sort of thread context
 	thread_init_early();
 
+	TRACE_POINT("kmain");
+
 	// early arch stuff
 	arch_early_init();
 
@@ -90,6 +93,8 @@ void kmain(void)
 	//dprintf(SPEW, "Calling constructors\n");
 	call_constructors();
 
+	TRACE_POINT("early_init_done");
+
 	// bring up the kernel heap
 	//dprintf(SPEW, "Initializing heap\n");
 	heap_init();
@@ -105,6 +110,7 @@ void kmain(void)
 	// initialize kernel timers
 	//dprintf(SPEW, "Initializing timers\n");
 	timer_init();
+	TRACE_POINT("kernel_init_done");
 
 #if (!ENABLE_NANDWRITE)
 	// create a thread to complete system initialization
@@ -129,6 +135,8 @@ int main(void);
 
 static int bootstrap2(void *arg)
 {
+	TRACE_POINT("bootstrap2");
+
 	//dprintf(SPEW, "Initializing arch\n");
 	arch_init();
 	
@@ -137,6 +145,7 @@ static int bootstrap2(void *arg)
 
 	// initialize the rest of the platform
 	//dprintf(SPEW, "Initializing platform\n");
+	TRACE_POINT("platform_init");
 	platform_init();
 	
 	// initialize the target
@@ -147,9 +156,11 @@ static int bootstrap2(void *arg)
 	dprintf(SPEW,"   | Pressing HOME KEY will attempt to load recovery  |     ");
 	dprintf(SPEW,"   | Pressing MENU KEY will attempt to load sboot     |     \
 					   |__________________________________________________|     \n\n"); */
+	TRACE_POINT("target_init");
 	target_init();
 
 	//dprintf(SPEW, "Determining completion according to boot reason\n");
+	TRACE_POINT("apps_init");
 	apps_init();
 	
 	return 0;
@@ -0,0 +1,43 @@
+/*
+ Boot phase tracing, see include/boottrace.h
+
+ Recording is a handful of stores with interrupts off, no locks to
+ take and nothing to allocate, so it is safe from kmain on.
+*/
+#include <boottrace.h>
+#include <platform/timer.h>
+#include <kernel/thread.h>
+
+static struct boottrace_entry boottrace_ring[BOOTTRACE_ENTRIES];
+static unsigned boottrace_count;
+
+void boottrace(char type, const char *name, uint32_t arg)
+{
+	struct boottrace_entry *e;
+
+	enter_critical_section();
+	e = &boottrace_ring[boottrace_count++ & (BOOTTRACE_ENTRIES - 1)];
+	e->usec = (uint32_t) current_time_hires();
+	e->name = name;
+	e->arg = arg;
+	e->type = type;
+	exit_critical_section();
+}
+
+unsigned boottrace_read(struct boottrace_entry *out, unsigned max, unsigned *lost)
+{
+	unsigned first, count, n;
+
+	enter_critical_section();
+	count = boottrace_count;
+	first = (count > BOOTTRACE_ENTRIES) ? count - BOOTTRACE_ENTRIES : 0;
+	if (count - first > max)
+		first = count - max;
+	for (n = 0; first + n < count; n++)
+		out[n] = boottrace_ring[(first + n) & (BOOTTRACE_ENTRIES - 1)];
+	exit_critical_section();
+
+	if (lost)
+		*lost = first;
+	return n;
+}
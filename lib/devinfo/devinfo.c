@@ -117,7 +117,10 @@ int write_device_info(const struct dev_info *in)
 	memset( target_get_scratch_address(), 0, pagesize );
 	memcpy( target_get_scratch_address(), (void*) in, sizeof( *in ) );
 
-	if ( flash_write( ptn, 0, target_get_scratch_address(), pagesize ) )
+	// Erasing the block also drops the bad block table, write it back
+	unsigned size = pagesize + flash_bbt_image( target_get_scratch_address() + pagesize );
+
+	if ( flash_write( ptn, 0, target_get_scratch_address(), size ) )
 	{
 		printf( "   ERROR: failed to write DEVINFO header!!!\n" );
 		return -1;
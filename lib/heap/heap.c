@@ -59,17 +59,51 @@ extern int _heap_end;
 #define HEAP_LEN ((size_t)_heap_end - (size_t)&_end)
 #endif
 
+// small allocations come from per size class slabs: SLAB_SIZE aligned
+// pages carved from the free list on demand, holding objects of one
+// power of two size each. a bitmap over the heap tells slab pages apart.
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define SLAB_MIN_SHIFT 4
+#define SLAB_CLASSES 6 // 16 to 512 bytes
+#define SLAB_MAX_SIZE (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+// Delayed frees come from exiting threads, two at most (stack and struct)
+// each, and the next allocation (any thread_create) drains them. 64 covers
+// every thread of the bootloader dying at once.
+#define SLAB_DELAYED 64
+
 struct free_heap_chunk {
 	struct list_node node;
 	size_t len;
 };
 
+struct slab_class {
+	struct list_node partial; // slabs with free objects
+	unsigned int empty; // of which have none handed out
+	struct heap_slab_stats stats;
+};
+
+// header at the start of every slab page
+struct slab {
+	struct list_node node;
+	struct slab_class *cls;
+	void *free; // free objects, linked through their first word
+	unsigned int inuse;
+};
+
 struct heap {
 	void *base;
 	size_t len;
 	mutex_t lock;
 	struct list_node free_list;
 	struct list_node delayed_free_list;
+	struct slab_class slab[SLAB_CLASSES];
+	vaddr_t slab_base; // SLAB_SIZE page the bitmap starts at
+	uint8_t *slab_map;
+	// delayed frees of slab objects, the object may still be in use
+	// so nothing can be linked through it
+	void *delayed_slab_free[SLAB_DELAYED];
+	unsigned int delayed_slab_count;
 };
 
 // heap static vars
@@ -108,6 +142,14 @@ static void heap_dump(void)
 	list_for_every_entry(&theheap.delayed_free_list, chunk, struct free_heap_chunk, node) {
 		dump_free_chunk(chunk);
 	}
+
+	dprintf(INFO, "\tslabs:\n");
+	for (int n = 0; n < SLAB_CLASSES; n++) {
+		struct heap_slab_stats *st = &theheap.slab[n].stats;
+
+		dprintf(INFO, "\t\t%4zd bytes: %u in use (peak %u), %u allocs, %u frees, %u pages\n",
+			st->size, st->inuse, st->peak, st->allocs, st->frees, st->slabs);
+	}
 	mutex_release(&theheap.lock);
 }
 
@@ -236,9 +278,228 @@ struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len)
 	return chunk;
 }
 
+// the slab page an allocation lives in, NULL for the general heap
+static struct slab *heap_slab_of(void *ptr)
+{
+	vaddr_t addr = (vaddr_t)ptr;
+	unsigned int page;
+
+	if (addr < (vaddr_t)theheap.base || addr >= (vaddr_t)theheap.base + theheap.len)
+		return NULL;
+
+	page = (addr - theheap.slab_base) >> SLAB_SHIFT;
+	if (!(theheap.slab_map[page >> 3] & (1 << (page & 7))))
+		return NULL;
+
+	return (struct slab *)(addr & ~(SLAB_SIZE - 1));
+}
+
+static void slab_map_set(struct slab *slab, bool set)
+{
+	unsigned int page = ((vaddr_t)slab - theheap.slab_base) >> SLAB_SHIFT;
+
+	if (set)
+		theheap.slab_map[page >> 3] |= (1 << (page & 7));
+	else
+		theheap.slab_map[page >> 3] &= ~(1 << (page & 7));
+}
+
+// take an aligned page out of the free list, giving the space around it
+// back. slabs are carved from the top of the heap, away from the first
+// fit allocations at the bottom. called with the heap lock held.
+static struct slab *slab_page_alloc(void)
+{
+	struct free_heap_chunk *chunk;
+
+	for (chunk = list_peek_tail_type(&theheap.free_list, struct free_heap_chunk, node); chunk;
+	     chunk = list_prev_type(&theheap.free_list, &chunk->node, struct free_heap_chunk, node)) {
+		vaddr_t start = (vaddr_t)chunk;
+		vaddr_t end = start + chunk->len;
+		vaddr_t page;
+
+		if (chunk->len < SLAB_SIZE)
+			continue;
+
+		// whatever is left on either side has to hold a free chunk
+		for (page = (end - SLAB_SIZE) & ~(SLAB_SIZE - 1); page >= start; page -= SLAB_SIZE) {
+			if (page != start && page - start < sizeof(struct free_heap_chunk))
+				continue;
+			if (page + SLAB_SIZE != end && end - page - SLAB_SIZE < sizeof(struct free_heap_chunk))
+				continue;
+			break;
+		}
+		if (page < start)
+			continue;
+
+		struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
+
+		if (page != start)
+			chunk->len = page - start;
+		else
+			list_delete(&chunk->node);
+
+		if (page + SLAB_SIZE != end) {
+			struct free_heap_chunk *newchunk = heap_create_free_chunk((void *)(page + SLAB_SIZE), end - page - SLAB_SIZE);
+
+			if (next_node)
+				list_add_before(next_node, &newchunk->node);
+			else
+				list_add_tail(&theheap.free_list, &newchunk->node);
+		}
+
+		return (struct slab *)page;
+	}
+
+	return NULL;
+}
+
+// set up a fresh page, objects start at the first multiple of their
+// size past the header so they are aligned to it
+static void slab_init(struct slab *slab, struct slab_class *cls)
+{
+	size_t size = cls->stats.size;
+	vaddr_t obj;
+
+	slab->cls = cls;
+	slab->inuse = 0;
+	slab->free = NULL;
+	for (obj = (vaddr_t)slab + SLAB_SIZE - size; obj >= (vaddr_t)slab + ROUNDUP(sizeof(struct slab), size); obj -= size) {
+		*(void **)obj = slab->free;
+		slab->free = (void *)obj;
+	}
+
+	slab_map_set(slab, true);
+	list_add_head(&cls->partial, &slab->node);
+	cls->empty++;
+	cls->stats.slabs++;
+}
+
+// the class serving a request, -1 for the general heap
+static int slab_class_index(size_t size, unsigned int alignment)
+{
+	int n = 0;
+
+	if (size < alignment)
+		size = alignment;
+	if (size > SLAB_MAX_SIZE)
+		return -1;
+
+	while (((size_t)1 << (SLAB_MIN_SHIFT + n)) < size)
+		n++;
+
+	return n;
+}
+
+static void *slab_alloc(struct slab_class *cls)
+{
+	struct slab *slab;
+	void *obj;
+
+	mutex_acquire(&theheap.lock);
+
+	slab = list_peek_head_type(&cls->partial, struct slab, node);
+	if (!slab) {
+		slab = slab_page_alloc();
+		if (!slab) {
+			mutex_release(&theheap.lock);
+			return NULL;
+		}
+		slab_init(slab, cls);
+	}
+
+	obj = slab->free;
+	slab->free = *(void **)obj;
+	if (slab->inuse++ == 0)
+		cls->empty--;
+	if (!slab->free)
+		list_delete(&slab->node);
+
+	cls->stats.allocs++;
+	if (++cls->stats.inuse > cls->stats.peak)
+		cls->stats.peak = cls->stats.inuse;
+
+	mutex_release(&theheap.lock);
+
+	LTRACEF("slab %p obj %p\n", slab, obj);
+
+	return obj;
+}
+
+static void slab_free(struct slab *slab, void *ptr)
+{
+	struct slab_class *cls = slab->cls;
+	bool release = false;
+
+	LTRACEF("slab %p obj %p\n", slab, ptr);
+
+	mutex_acquire(&theheap.lock);
+
+	if (!slab->free)
+		list_add_head(&cls->partial, &slab->node);
+	*(void **)ptr = slab->free;
+	slab->free = ptr;
+
+	cls->stats.frees++;
+	cls->stats.inuse--;
+
+	// keep one empty page per class around, so a class going back and
+	// forth over a page boundary doesn't carve and merge every time
+	if (--slab->inuse == 0) {
+		if (cls->empty) {
+			list_delete(&slab->node);
+			slab_map_set(slab, false);
+			cls->stats.slabs--;
+			release = true;
+		} else {
+			cls->empty++;
+		}
+	}
+
+	mutex_release(&theheap.lock);
+
+	if (release)
+		heap_insert_free_chunk(heap_create_free_chunk(slab, SLAB_SIZE));
+}
+
+// hand the cached empty pages back when the general heap runs short,
+// returns how many there were
+static int slab_reclaim(void)
+{
+	struct list_node list;
+	struct slab *slab, *temp;
+	int count = 0;
+
+	list_initialize(&list);
+
+	mutex_acquire(&theheap.lock);
+	for (int n = 0; n < SLAB_CLASSES; n++) {
+		struct slab_class *cls = &theheap.slab[n];
+
+		list_for_every_entry_safe(&cls->partial, slab, temp, struct slab, node) {
+			if (slab->inuse)
+				continue;
+			list_delete(&slab->node);
+			list_add_tail(&list, &slab->node);
+			slab_map_set(slab, false);
+			cls->empty--;
+			cls->stats.slabs--;
+		}
+	}
+	mutex_release(&theheap.lock);
+
+	while ((slab = list_remove_head_type(&list, struct slab, node))) {
+		heap_insert_free_chunk(heap_create_free_chunk(slab, SLAB_SIZE));
+		count++;
+	}
+
+	return count;
+}
+
 static void heap_free_delayed_list(void)
 {
 	struct list_node list;
+	void *slab_objs[SLAB_DELAYED];
+	unsigned int slab_count;
 
 	list_initialize(&list);
 
@@ -248,24 +509,44 @@ static void heap_free_delayed_list(void)
 	while ((chunk = list_remove_head_type(&theheap.delayed_free_list, struct free_heap_chunk, node))) {
 		list_add_head(&list, &chunk->node);
 	}
+
+	slab_count = theheap.delayed_slab_count;
+	memcpy(slab_objs, theheap.delayed_slab_free, slab_count * sizeof(void *));
+	theheap.delayed_slab_count = 0;
 	exit_critical_section();
 
 	while ((chunk = list_remove_head_type(&list, struct free_heap_chunk, node))) {
 		LTRACEF("freeing chunk %p\n", chunk);
 		heap_insert_free_chunk(chunk);
 	}
+
+	for (unsigned int i = 0; i < slab_count; i++)
+		slab_free(heap_slab_of(slab_objs[i]), slab_objs[i]);
+}
+
+int heap_get_slab_stats(unsigned int n, struct heap_slab_stats *stats)
+{
+	if (n >= SLAB_CLASSES)
+		return -1;
+
+	mutex_acquire(&theheap.lock);
+	*stats = theheap.slab[n].stats;
+	mutex_release(&theheap.lock);
+
+	return 0;
 }
 
 void *heap_alloc(size_t size, unsigned int alignment)
 {
 	void *ptr;
+	int n;
 #if DEBUG_HEAP
 	size_t original_size = size;
 #endif
 	LTRACEF("size %zd, align %d\n", size, alignment);
 
 	// deal with the pending free list
-	if (unlikely(!list_is_empty(&theheap.delayed_free_list))) {
+	if (unlikely(!list_is_empty(&theheap.delayed_free_list) || theheap.delayed_slab_count)) {
 		heap_free_delayed_list();
 	}
 
@@ -273,6 +554,14 @@ void *heap_alloc(size_t size, unsigned int alignment)
 	if (alignment & (alignment - 1))
 		return NULL;
 
+	// small requests come from the slabs, unless no page can be had
+	n = slab_class_index(size, alignment);
+	if (n >= 0) {
+		ptr = slab_alloc(&theheap.slab[n]);
+		if (ptr)
+			return ptr;
+	}
+
 	// we always put a size field + base pointer + magic in front of the allocation
 	size += sizeof(struct alloc_struct_begin);
 #if DEBUG_HEAP
@@ -297,6 +586,7 @@ void *heap_alloc(size_t size, unsigned int alignment)
 		size += alignment;
 	}
 
+retry:
 	mutex_acquire(&theheap.lock);
 
 	// walk through the list
@@ -361,6 +651,9 @@ void *heap_alloc(size_t size, unsigned int alignment)
 
 	mutex_release(&theheap.lock);
 
+	if (!ptr && slab_reclaim())
+		goto retry;
+
 	LTRACEF("returning ptr %p\n", ptr);
 
 	return ptr;
@@ -369,14 +662,21 @@ void *heap_alloc(size_t size, unsigned int alignment)
 void *heap_realloc(void *ptr, size_t size)
 {
 	void * tmp_ptr = NULL;
-	size_t min_size;
+	size_t min_size, old_size;
 	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+	struct slab *slab;
 	as--;
 
 	if (size != 0){
 		tmp_ptr = heap_alloc(size, 0);
 		if (ptr != NULL && tmp_ptr != NULL){
-			min_size = (size < as->size) ? size : as->size;
+			slab = heap_slab_of(ptr);
+			// as->size is the whole chunk, header and alignment included
+			if (slab)
+				old_size = slab->cls->stats.size;
+			else
+				old_size = as->size - ((addr_t)ptr - (addr_t)as->ptr);
+			min_size = (size < old_size) ? size : old_size;
 			memcpy(tmp_ptr, ptr, min_size);
 			heap_free(ptr);
 		}
@@ -394,6 +694,12 @@ void heap_free(void *ptr)
 
 	LTRACEF("ptr %p\n", ptr);
 
+	struct slab *slab = heap_slab_of(ptr);
+	if (slab) {
+		slab_free(slab, ptr);
+		return;
+	}
+
 	// check for the old allocation structure
 	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
 	as--;
@@ -423,6 +729,14 @@ void heap_free(void *ptr)
 
 void heap_delayed_free(void *ptr)
 {
+	if (heap_slab_of(ptr)) {
+		enter_critical_section();
+		ASSERT(theheap.delayed_slab_count < SLAB_DELAYED);
+		theheap.delayed_slab_free[theheap.delayed_slab_count++] = ptr;
+		exit_critical_section();
+		return;
+	}
+
 	// check for the old allocation structure
 	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
 	as--;
@@ -457,6 +771,20 @@ void heap_init(void)
 	// initialize the delayed free list
 	list_initialize(&theheap.delayed_free_list);
 
+	// the slab bitmap goes in front of the first free chunk
+	theheap.slab_base = (vaddr_t)theheap.base & ~(SLAB_SIZE - 1);
+	size_t map_len = ((((vaddr_t)theheap.base + theheap.len - theheap.slab_base) >> SLAB_SHIFT) + 8) / 8;
+	map_len = ROUNDUP(map_len, sizeof(void *));
+	theheap.slab_map = (uint8_t *)theheap.base;
+	memset(theheap.slab_map, 0, map_len);
+	theheap.base = (uint8_t *)theheap.base + map_len;
+	theheap.len -= map_len;
+
+	for (int n = 0; n < SLAB_CLASSES; n++) {
+		list_initialize(&theheap.slab[n].partial);
+		theheap.slab[n].stats.size = 1 << (SLAB_MIN_SHIFT + n);
+	}
+
 	// create an initial free chunk
 	heap_insert_free_chunk(heap_create_free_chunk(theheap.base, theheap.len));
 
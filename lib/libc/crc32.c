@@ -0,0 +1,57 @@
+/*
+ Table driven crc32 (same polynomial as zlib), four bytes per step
+ on aligned little endian words ("slicing by 4")
+*/
+#include <crc32.h>
+
+static unsigned long crc_table[4][256];
+static int crc_table_ready = 0;
+
+static void crc32_make_table(void)
+{
+	unsigned long c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = (unsigned long) n;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (0xedb88320UL ^ (c >> 1)) : (c >> 1);
+		crc_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++) {
+		c = crc_table[0][n];
+		for (k = 1; k < 4; k++) {
+			c = crc_table[0][c & 0xff] ^ (c >> 8);
+			crc_table[k][n] = c;
+		}
+	}
+	crc_table_ready = 1;
+}
+
+unsigned long crc32(unsigned long crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const unsigned *w;
+
+	if (!crc_table_ready)
+		crc32_make_table();
+
+	crc = crc ^ 0xffffffffUL;
+	while (len && ((unsigned long) p & 3)) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	w = (const unsigned *) p;
+	while (len >= 4) {
+		crc ^= *w++;
+		crc = crc_table[3][crc & 0xff] ^ crc_table[2][(crc >> 8) & 0xff]
+		    ^ crc_table[1][(crc >> 16) & 0xff] ^ crc_table[0][(crc >> 24) & 0xff];
+		len -= 4;
+	}
+
+	p = (const unsigned char *) w;
+	while (len--)
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffffUL;
+}
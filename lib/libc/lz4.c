@@ -0,0 +1,147 @@
+/*
+ LZ4 legacy frame decoder
+
+ The whole output stays in place, so matches never need a window of
+ their own and decoding can stop after any complete sequence and carry
+ on once more input arrived. Copies go through memcpy, overlapping
+ matches by doubling the copied period.
+*/
+#include <string.h>
+#include <lz4.h>
+
+#define LZ4_LEGACY_BOUND	(LZ4_LEGACY_BLOCK + LZ4_LEGACY_BLOCK / 255 + 16)
+
+static unsigned lz4_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+/* decode sequences in src[s->in..limit), 'last' if limit ends the block */
+static int lz4_block_run(struct lz4_legacy *s, const unsigned char *src, unsigned limit, int last)
+{
+	const unsigned char *ip = src + s->in;
+	const unsigned char *iend = src + limit;
+	unsigned char *op = s->op;
+	unsigned lit, len, off, b;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					goto more;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > (unsigned)(iend - ip))
+			goto more;
+		if (lit > (unsigned)(s->dst_end - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* the last sequence of a block has no match */
+		if (ip == iend) {
+			if (!last)
+				goto more;
+			break;
+		}
+
+		if (iend - ip < 2)
+			goto more;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (unsigned)(op - s->dst))
+			return -1;
+
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					goto more;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (len > (unsigned)(s->dst_end - op))
+			return -1;
+
+		const unsigned char *m = op - off;
+		while (len > off) {
+			memcpy(op, m, off);
+			op += off;
+			len -= off;
+			off <<= 1;
+		}
+		memcpy(op, m, len);
+		op += len;
+
+		s->in = ip - src;
+		s->op = op;
+	}
+	s->in = ip - src;
+	s->op = op;
+	return 0;
+
+more:
+	/* the sequence is incomplete, start it again with more input */
+	return last ? -1 : 0;
+}
+
+void lz4_legacy_init(struct lz4_legacy *s, void *dst, unsigned dst_max)
+{
+	memset(s, 0, sizeof(*s));
+	s->dst = s->op = dst;
+	s->dst_end = s->dst + dst_max;
+}
+
+int lz4_legacy_run(struct lz4_legacy *s, const void *src, unsigned avail)
+{
+	const unsigned char *p = src;
+	unsigned size, limit;
+
+	for (;;) {
+		if (!s->in_block) {
+			if (avail - s->in < 4)
+				return 0;
+			size = lz4_le32(p + s->in);
+			s->in += 4;
+			/* the stream starts with the magic, concatenated streams repeat it */
+			if (size == LZ4_LEGACY_MAGIC)
+				continue;
+			if (s->in == 4 || size == 0 || size > LZ4_LEGACY_BOUND)
+				return -1;
+			s->block_end = s->in + size;
+			s->in_block = 1;
+		}
+
+		limit = (avail < s->block_end) ? avail : s->block_end;
+		if (lz4_block_run(s, p, limit, limit == s->block_end))
+			return -1;
+		if (s->in < s->block_end)
+			return 0;
+		s->in_block = 0;
+	}
+}
+
+int lz4_legacy_done(struct lz4_legacy *s, unsigned len)
+{
+	if (s->in_block || s->in != len || s->op == s->dst)
+		return -1;
+	return s->op - s->dst;
+}
+
+int lz4_legacy_decode(const void *src, unsigned len, void *dst, unsigned dst_max)
+{
+	struct lz4_legacy s;
+
+	lz4_legacy_init(&s, dst, dst_max);
+	if (lz4_legacy_run(&s, src, len))
+		return -1;
+	return lz4_legacy_done(&s, len);
+}
@@ -2,10 +2,13 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 OBJS += \
 	$(LOCAL_DIR)/atoi.o \
+	$(LOCAL_DIR)/crc32.o \
 	$(LOCAL_DIR)/ctype.o \
+	$(LOCAL_DIR)/lz4.o \
 	$(LOCAL_DIR)/printf.o \
 	$(LOCAL_DIR)/malloc.o \
 	$(LOCAL_DIR)/rand.o \
+	$(LOCAL_DIR)/sha1.o \
 	$(LOCAL_DIR)/atexit.o \
 	$(LOCAL_DIR)/eabi.o
 
@@ -0,0 +1,124 @@
+/*
+ SHA-1 (FIPS 180-1), with the 80 word schedule kept in a 16 word ring
+ and whole blocks hashed straight from the caller's buffer
+*/
+#include <string.h>
+#include <sha1.h>
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t sha1_be32(const unsigned char *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void sha1_block(uint32_t *state, const unsigned char *p)
+{
+	uint32_t w[16];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	uint32_t f, k, t;
+	int i;
+
+	for (i = 0; i < 80; i++) {
+		if (i < 16) {
+			w[i] = sha1_be32(p + 4 * i);
+		} else {
+			t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+			w[i & 15] = ROL(t, 1);
+		}
+
+		if (i < 20) {
+			f = d ^ (b & (c ^ d));
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (d & (b | c));
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = ROL(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->count = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned used = ctx->count & 63;
+	unsigned n;
+
+	ctx->count += len;
+
+	if (used) {
+		n = 64 - used;
+		if (len < n) {
+			memcpy(ctx->block + used, p, len);
+			return;
+		}
+		memcpy(ctx->block + used, p, n);
+		sha1_block(ctx->state, ctx->block);
+		p += n;
+		len -= n;
+	}
+
+	for (; len >= 64; p += 64, len -= 64)
+		sha1_block(ctx->state, p);
+
+	memcpy(ctx->block, p, len);
+}
+
+void sha1_final(struct sha1_ctx *ctx, unsigned char digest[SHA1_DIGEST_SIZE])
+{
+	unsigned used = ctx->count & 63;
+	uint32_t bits = ctx->count << 3;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		sha1_block(ctx->state, ctx->block);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	ctx->block[56] = 0;
+	ctx->block[57] = 0;
+	ctx->block[58] = 0;
+	ctx->block[59] = ctx->count >> 29;
+	ctx->block[60] = bits >> 24;
+	ctx->block[61] = bits >> 16;
+	ctx->block[62] = bits >> 8;
+	ctx->block[63] = bits;
+	sha1_block(ctx->state, ctx->block);
+
+	for (i = 0; i < 5; i++) {
+		digest[4 * i] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+}
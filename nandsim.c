@@ -0,0 +1,2327 @@
+/*
+ * nandsim.c
+ *
+ * Runs the flash layer of target/htcleo/nand.c on a Linux box. The data
+ * mover and the NAND controller are modelled as far as the command lists
+ * built by nand.c need them, the flash array is a file:
+ *
+ *   gcc -O2 -no-pie -funsigned-char -idirafter include -idirafter target/htcleo/include \
+ *       -idirafter platform/msm_shared/include -idirafter platform/qsd8k/include \
+ *       -idirafter app/aboot/include -o nandsim nandsim.c
+ *   ./nandsim test		run the checks, the exit status tells
+ *   ./nandsim bench		throughput on the model
+ *
+ * Both take name=value options after the command: page=2048|4096 picks
+ * the chip, spare=0|64 the spare bytes carried per page by the bench
+ * images, bad= the number of factory bad blocks the bench devices get and
+ * mb= the size of the read/write bench. The model times below are
+ * dmov=, tr=, tprog=, terase= and usb= in us, bus= and usbmbs= in MB/s.
+ *
+ * nand.c and the aboot code on top of it are included as they are, lk
+ * headers they need are replaced below. nand.c hands the data mover 32
+ * bit addresses, so everything it touches lives below 4 GB: the program
+ * is not position independent and its heap and stacks are MAP_32BIT
+ * mappings. char is unsigned, like on ARM. Threads are cooperative.
+ *
+ * Times are those of the model, not measured on a device: every command
+ * list handed to the data mover costs dmov_us, a page read tr_us plus the
+ * transfer of its codewords at bus_mbs, a program tprog_us and an erase
+ * terase_us. A usb transfer costs usb_us plus its bytes at usb_mbs, the
+ * controller moves them while the thread sleeps. The cpu time spent
+ * building command lists is not charged, only waiting for the data
+ * mover: polling its status or sleeping until the ADM interrupt.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <ucontext.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+/* model parameters */
+static unsigned dmov_us = 20;
+static unsigned tr_us = 25;
+static unsigned tprog_us = 200;
+static unsigned terase_us = 1500;
+static unsigned bus_mbs = 20;
+static unsigned usb_us = 50;
+static unsigned usb_mbs = 16;
+
+/* what 'bench' runs on */
+static unsigned page_size = 2048;
+static unsigned bench_spare = 0;	/* spare bytes per page in the images */
+static unsigned bench_bad = 20;		/* factory bad blocks */
+static unsigned bench_mb = 8;
+
+static int verbose;
+static unsigned failed;
+
+#define CHECK(x) \
+	do { if (!(x)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #x); failed++; } } while (0)
+
+static void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(2);
+}
+
+/*
+ * Memory below 4 GB, power of two sized chunks kept on free lists
+ */
+#define ARENA_SIZE	(256 << 20)
+#define CHUNK_HDR	32
+
+static unsigned char *arena;
+static unsigned arena_used;
+static void *chunk_free[32];
+
+static void arena_init(void)
+{
+	arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (arena == MAP_FAILED)
+		fatal("no memory below 4 GB\n");
+}
+
+static void *sim_malloc(size_t size)
+{
+	unsigned order = 5;
+	unsigned char *p;
+
+	while ((1u << order) < size + CHUNK_HDR)
+		order++;
+	if (chunk_free[order]) {
+		p = chunk_free[order];
+		chunk_free[order] = *(void **)p;
+	} else {
+		if (arena_used + (1u << order) > ARENA_SIZE)
+			return NULL;
+		p = arena + arena_used;
+		arena_used += 1u << order;
+	}
+	*(unsigned *)p = order;
+	return p + CHUNK_HDR;
+}
+
+static void sim_free(void *ptr)
+{
+	unsigned char *p = ptr;
+	unsigned order;
+
+	if (p == NULL)
+		return;
+	p -= CHUNK_HDR;
+	order = *(unsigned *)p;
+	*(void **)p = chunk_free[order];
+	chunk_free[order] = p;
+}
+
+static void *sim_memalign(size_t align, size_t size)
+{
+	if (align > CHUNK_HDR)
+		fatal("memalign(%zu) not supported\n", align);
+	return sim_malloc(size);
+}
+
+/*
+ * What nand.c gets from lk
+ */
+#define __DEBUG_H
+#define __REG_H
+#define __BOOTTRACE_H
+#define __LIST_H
+#define __KERNEL_THREAD_H
+#define __KERNEL_EVENT_H
+#define __KERNEL_MUTEX_H
+#define __KERNEL_SEMAPHORE_H
+#define __PLATFORM_TIMER_H
+#define __PLATFORM_INTERRUPTS_H
+#define __TARGET_H
+
+#define CRITICAL	0
+#define ALWAYS		0
+#define INFO		1
+#define SPEW		2
+
+#define dprintf(level, x...) \
+	do { if (verbose > (level)) printf(x); } while (0)
+
+#define ASSERT(x) \
+	do { if (!(x)) fatal("ASSERT FAILED at (%s:%d): %s\n", __FILE__, __LINE__, #x); } while (0)
+
+#define TRACE_POINT(name)	do { } while (0)
+#define TRACE_BEGIN(name, arg)	do { } while (0)
+#define TRACE_END(name, arg)	do { } while (0)
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define countof(a)	(sizeof(a) / sizeof((a)[0]))
+
+typedef unsigned long long bigtime_t;
+
+/* simulated time in ns */
+static unsigned long long sim_now;
+
+static bigtime_t current_time_hires(void)
+{
+	return sim_now / 1000;
+}
+
+static int critical_section_count;
+
+static void enter_critical_section(void)
+{
+	critical_section_count++;
+}
+
+static void exit_critical_section(void)
+{
+	critical_section_count--;
+}
+
+static bool in_critical_section(void)
+{
+	return critical_section_count > 0;
+}
+
+enum handler_return {
+	INT_NO_RESCHEDULE = 0,
+	INT_RESCHEDULE,
+};
+
+typedef enum handler_return (*int_handler)(void *arg);
+
+static int_handler irq_handler[64];
+static void *irq_arg[64];
+static int irq_unmasked[64];
+
+static void register_int_handler(unsigned vector, int_handler handler, void *arg)
+{
+	irq_handler[vector] = handler;
+	irq_arg[vector] = arg;
+}
+
+static int unmask_interrupt(unsigned vector)
+{
+	irq_unmasked[vector] = 1;
+	return 0;
+}
+
+/*
+ * Threads: cooperative, a thread runs until it waits. When none can run
+ * the cpu idles until the next thing the model has scheduled, with
+ * interrupts on like lk's idle thread.
+ */
+#define EVENT_FLAG_AUTOUNSIGNAL	1
+#define DEFAULT_PRIORITY	16
+#define DEFAULT_STACK_SIZE	8192
+#define SIM_THREADS		8
+
+typedef int status_t;
+
+typedef struct {
+	int signaled;
+	unsigned flags;
+} event_t;
+
+typedef struct {
+	int held;
+} mutex_t;
+
+typedef struct {
+	int count;
+} semaphore_t;
+
+typedef struct thread {
+	ucontext_t ctx;
+	int (*entry)(void *arg);
+	void *arg;
+	int running;		/* resumed and not yet returned */
+	int crit;		/* critical_section_count while switched out */
+	event_t *event;		/* what it waits for */
+	semaphore_t *sem;
+	mutex_t *mutex;
+	unsigned long long wake;
+} thread_t;
+
+static thread_t sim_threads[SIM_THREADS] = { { .running = 1 } };
+static unsigned sim_nthreads = 1;
+static thread_t *sim_cur = &sim_threads[0];
+
+static void sim_idle(void);
+
+static int sim_ready(thread_t *t)
+{
+	return t->running
+		&& (!t->event || t->event->signaled)
+		&& (!t->sem || t->sem->count > 0)
+		&& (!t->mutex || !t->mutex->held)
+		&& t->wake <= sim_now;
+}
+
+/* the current thread waits for what it noted in its thread_t */
+static void sim_block(void)
+{
+	for (;;) {
+		unsigned cur = sim_cur - sim_threads;
+
+		for (unsigned n = 1; n <= sim_nthreads; n++) {
+			thread_t *t = &sim_threads[(cur + n) % sim_nthreads];
+			thread_t *prev = sim_cur;
+
+			if (!sim_ready(t))
+				continue;
+			if (t != prev) {
+				prev->crit = critical_section_count;
+				sim_cur = t;
+				swapcontext(&prev->ctx, &t->ctx);
+				critical_section_count = prev->crit;
+			}
+			return;
+		}
+		sim_idle();
+	}
+}
+
+static void sim_thread_start(void)
+{
+	thread_t *t = sim_cur;
+
+	critical_section_count = 0;
+	t->entry(t->arg);
+	t->running = 0;
+	sim_block();
+	fatal("a finished thread was scheduled\n");
+}
+
+static thread_t *thread_create(const char *name, int (*entry)(void *arg), void *arg,
+			       int priority, size_t stack_size)
+{
+	static char *stacks[SIM_THREADS];
+	thread_t *t = NULL;
+
+	for (unsigned n = 1; n < SIM_THREADS && !t; n++)
+		if (n >= sim_nthreads || (!sim_threads[n].running && sim_threads[n].entry == NULL))
+			t = &sim_threads[n];
+	if (t == NULL)
+		fatal("out of threads\n");
+	if (t - sim_threads >= sim_nthreads)
+		sim_nthreads = t - sim_threads + 1;
+
+	memset(t, 0, sizeof(*t));
+	if (stacks[t - sim_threads] == NULL)
+		stacks[t - sim_threads] = sim_malloc(64 << 10);
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = stacks[t - sim_threads];
+	t->ctx.uc_stack.ss_size = 64 << 10;
+	t->ctx.uc_link = NULL;
+	makecontext(&t->ctx, sim_thread_start, 0);
+	t->entry = entry;
+	t->arg = arg;
+	return t;
+}
+
+static status_t thread_resume(thread_t *t)
+{
+	t->running = 1;
+	return 0;
+}
+
+/* forget finished threads */
+static void sim_threads_reset(void)
+{
+	for (unsigned n = 1; n < sim_nthreads; n++) {
+		if (sim_threads[n].running)
+			fatal("a thread is still running\n");
+		sim_threads[n].entry = NULL;
+	}
+	sim_nthreads = 1;
+}
+
+/* sleep until the model time 'when' */
+static void sim_sleep_until(unsigned long long when)
+{
+	sim_cur->wake = when;
+	while (sim_now < when)
+		sim_block();
+	sim_cur->wake = 0;
+}
+
+static void event_init(event_t *e, bool initial, unsigned flags)
+{
+	e->signaled = initial;
+	e->flags = flags;
+}
+
+static void event_destroy(event_t *e)
+{
+}
+
+static status_t event_signal(event_t *e, bool reschedule)
+{
+	e->signaled = 1;
+	return 0;
+}
+
+static status_t event_wait(event_t *e)
+{
+	sim_cur->event = e;
+	while (!e->signaled)
+		sim_block();
+	sim_cur->event = NULL;
+	if (e->flags & EVENT_FLAG_AUTOUNSIGNAL)
+		e->signaled = 0;
+	return 0;
+}
+
+static void mutex_init(mutex_t *m)
+{
+	m->held = 0;
+}
+
+static status_t mutex_acquire(mutex_t *m)
+{
+	sim_cur->mutex = m;
+	while (m->held)
+		sim_block();
+	sim_cur->mutex = NULL;
+	m->held = 1;
+	return 0;
+}
+
+static status_t mutex_release(mutex_t *m)
+{
+	ASSERT(m->held);
+	m->held = 0;
+	return 0;
+}
+
+static void sem_init(semaphore_t *s, unsigned int count)
+{
+	s->count = count;
+}
+
+static status_t sem_post(semaphore_t *s)
+{
+	s->count++;
+	return 0;
+}
+
+static status_t sem_wait(semaphore_t *s)
+{
+	sim_cur->sem = s;
+	while (s->count <= 0)
+		sim_block();
+	sim_cur->sem = NULL;
+	s->count--;
+	return 0;
+}
+
+static void dsb(void)
+{
+}
+
+static unsigned sim_readl(unsigned addr);
+static void sim_writel(unsigned val, unsigned addr);
+
+#define readl(a)	sim_readl(a)
+#define writel(v, a)	sim_writel(v, a)
+
+/* messages of nand.c only show with -v */
+static int sim_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int r = 0;
+
+	if (verbose) {
+		va_start(ap, fmt);
+		r = vprintf(fmt, ap);
+		va_end(ap);
+	}
+	return r;
+}
+
+/*
+ * fastboot's end of usb: the host sends 'usb_data', a transfer ends early
+ * once 'usb_fail_at' bytes went by
+ */
+#define SCRATCH_SIZE	(4 << 20)	/* eight blocks of 4 KB pages and their spare */
+
+static const unsigned char *usb_data;
+static unsigned usb_pos;
+static unsigned usb_fail_at = ~0U;
+static struct fastboot_sink *download_sink;
+static void *scratch;
+
+static void *target_get_scratch_address(void)
+{
+	if (scratch == NULL)
+		scratch = sim_malloc(SCRATCH_SIZE);
+	return scratch;
+}
+
+static unsigned target_get_scratch_size(void)
+{
+	return SCRATCH_SIZE;
+}
+
+static void sim_sleep_until(unsigned long long when);
+
+/* the time 'len' bytes take to come in */
+static void usb_receive(unsigned len)
+{
+	sim_sleep_until(sim_now + usb_us * 1000ull + (unsigned long long) len * 1000 / usb_mbs);
+}
+
+static int fastboot_read(void *buf, unsigned len)
+{
+	usb_receive(len);
+	if (usb_pos + len > usb_fail_at)
+		return -1;
+	memcpy(buf, usb_data + usb_pos, len);
+	usb_pos += len;
+	return len;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+#pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
+#define malloc		sim_malloc
+#define free		sim_free
+#define memalign	sim_memalign
+#define printf		sim_printf
+#include "lib/libc/crc32.c"
+#include "lib/ptable/ptable.c"
+#include "target/htcleo/nand.c"
+#include "app/aboot/flash_stream.c"
+#include "app/aboot/flash_sparse.c"
+#include "app/aboot/bootimg_cache.c"
+#include "lib/libc/sha1.c"
+#include "lib/libc/lz4.c"
+#include "app/aboot/bootimg_load.c"
+#undef malloc
+#undef free
+#undef memalign
+#undef printf
+#pragma GCC diagnostic pop
+
+void fastboot_set_download_sink(struct fastboot_sink *sink)
+{
+	download_sink = sink;
+}
+
+/*
+ * The NAND array
+ *
+ * Raw pages are codewords of 528 bytes: 512 data, 4 spare, 10 ecc and 2
+ * unused. The file keeps them inverted so that a sparse file is erased
+ * flash. Like the controller, an ecc codeword swaps the two bytes where
+ * the bad block marker sits with the unused ones.
+ */
+#define CW_RAW		528
+#define SIM_ECC_FAIL	1	/* page reads uncorrectable */
+#define SIM_PROG_FAIL	2	/* block fails to program pages, marking it works */
+#define SIM_ERASE_FAIL	4	/* block fails to erase */
+#define SIM_FACTORY_BAD	8	/* marked bad from the factory */
+
+static struct {
+	unsigned id;
+	unsigned pagesize;
+	unsigned cwperpage;
+	unsigned raw;		/* raw bytes per page */
+	unsigned ppb;		/* pages per block */
+	unsigned blocks;
+	unsigned wide;
+	unsigned char *array;
+	unsigned char *page_flags;
+	unsigned char *block_flags;
+	int fd;
+} nand;
+
+/* controller registers, 0x000-0x0ff, then the codeword buffer */
+static unsigned nand_regs[64];
+static unsigned char nand_buf[CW_RAW];
+static unsigned nand_cw;		/* codeword of the page being transferred */
+static unsigned long long nand_busy;	/* ns the current command list keeps the flash busy */
+
+static struct {
+	unsigned long long reads, programs, erases;
+	unsigned long long program_over;	/* programs of codewords that were not erased */
+} nand_counts;
+
+#define REG(r)	nand_regs[((r) - NAND_REG(0)) >> 2]
+
+static unsigned char *nand_raw(unsigned page)
+{
+	return nand.array + (size_t) page * nand.raw;
+}
+
+static void nand_swap_bbm(unsigned char *cw);
+
+static unsigned nand_bbm(void)
+{
+	/* offset of the bad block marker inside the last codeword */
+	return nand.pagesize - CW_RAW * (nand.cwperpage - 1);
+}
+
+static void nand_open(const char *path, unsigned id)
+{
+	size_t size;
+
+	nand.id = id;
+	nand.pagesize = 2048;
+	nand.blocks = 2048;
+	nand.wide = 0;
+	if (id == 0x6600bcec) {
+		/* 4 KB pages, 16 bit */
+		nand.pagesize = 4096;
+		nand.wide = 1;
+	}
+	nand.cwperpage = nand.pagesize / 512;
+	nand.raw = nand.cwperpage * CW_RAW;
+	nand.ppb = 64;
+
+	size = (size_t) nand.blocks * nand.ppb * nand.raw;
+	if (path) {
+		nand.fd = open(path, O_RDWR | O_CREAT, 0644);
+	} else {
+		char tmp[] = "/tmp/nandsimXXXXXX";
+		nand.fd = mkstemp(tmp);
+		unlink(tmp);
+	}
+	if (nand.fd < 0 || ftruncate(nand.fd, size))
+		fatal("cannot set up the flash image\n");
+	nand.array = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, nand.fd, 0);
+	if (nand.array == MAP_FAILED)
+		fatal("cannot map the flash image\n");
+	nand.page_flags = calloc(nand.blocks * nand.ppb, 1);
+	nand.block_flags = calloc(nand.blocks, 1);
+
+	memset(nand_regs, 0, sizeof(nand_regs));
+	REG(NAND_DEV0_CFG0) = 0xaad400da;
+	REG(NAND_DEV0_CFG1) = 0x0004745c | (nand.wide ? CFG1_WIDE_FLASH : 0);
+}
+
+/* a new device, all erased and no fault */
+static void nand_wipe(void)
+{
+	size_t size = (size_t) nand.blocks * nand.ppb * nand.raw;
+
+	if (ftruncate(nand.fd, 0) || ftruncate(nand.fd, size))
+		fatal("cannot wipe the flash image\n");
+	memset(nand.page_flags, 0, nand.blocks * nand.ppb);
+	memset(nand.block_flags, 0, nand.blocks);
+}
+
+static void nand_close(void)
+{
+	munmap(nand.array, (size_t) nand.blocks * nand.ppb * nand.raw);
+	close(nand.fd);
+	free(nand.page_flags);
+	free(nand.block_flags);
+}
+
+static void nand_erase_block(unsigned block)
+{
+	memset(nand_raw(block * nand.ppb), 0, (size_t) nand.ppb * nand.raw);
+}
+
+/* forget the bad block table, the next boot scans */
+static void nand_wipe_bbt(void)
+{
+	nand_erase_block(NUM_PROTECTED_BLOCKS);
+}
+
+/* a bad block the way the factory leaves it */
+static void nand_factory_bad(unsigned block)
+{
+	unsigned char *raw = nand_raw(block * nand.ppb);
+
+	nand.block_flags[block] |= SIM_FACTORY_BAD;
+	raw[nand.pagesize] = 0xff;
+	raw[nand.pagesize + 1] = 0xff;
+}
+
+/* program a page behind nand.c's back, the way an ecc write lays it out */
+static void nand_put_page(unsigned page, const unsigned char *data)
+{
+	unsigned char cw[CW_RAW];
+	unsigned char *raw = nand_raw(page);
+
+	for (unsigned n = 0; n < nand.cwperpage; n++) {
+		memset(cw, 0xff, CW_RAW);
+		memcpy(cw, data + n * 512, 512);
+		memset(cw + 516, 0, 10);
+		if (n == nand.cwperpage - 1)
+			nand_swap_bbm(cw);
+		for (unsigned i = 0; i < CW_RAW; i++)
+			raw[n * CW_RAW + i] = ~cw[i];
+	}
+}
+
+/* flip a byte of data in the first codeword, the ecc does not see it */
+static void nand_corrupt(unsigned page, unsigned offset)
+{
+	nand_raw(page)[offset] ^= 0x5a;
+}
+
+static unsigned nand_page(void)
+{
+	return (REG(NAND_ADDR0) >> 16) | ((REG(NAND_ADDR1) & 0xff) << 16);
+}
+
+static unsigned long long nand_xfer_ns(unsigned bytes)
+{
+	return (unsigned long long) bytes * 1000 / bus_mbs;
+}
+
+static void nand_swap_bbm(unsigned char *cw)
+{
+	unsigned off = nand_bbm();
+	unsigned char t;
+
+	t = cw[off]; cw[off] = cw[CW_RAW - 2]; cw[CW_RAW - 2] = t;
+	t = cw[off + 1]; cw[off + 1] = cw[CW_RAW - 1]; cw[CW_RAW - 1] = t;
+}
+
+static void nand_read(unsigned ecc)
+{
+	unsigned page = nand_page();
+	unsigned char cw[CW_RAW];
+	unsigned char *raw;
+	unsigned n, blank = 1;
+
+	if (page >= nand.blocks * nand.ppb) {
+		REG(NAND_FLASH_STATUS) = 0x110;
+		return;
+	}
+	if (nand_cw == 0) {
+		nand_busy += tr_us * 1000ull;
+		nand_counts.reads++;
+	}
+	nand_busy += nand_xfer_ns(CW_RAW);
+	REG(NAND_FLASH_STATUS) = 0x20;
+	REG(NAND_BUFFER_STATUS) = 0;
+
+	if (!ecc) {
+		/* raw: one codeword from the column in ADDR0 */
+		unsigned col = (REG(NAND_ADDR0) & 0xffff) << nand.wide;
+
+		raw = nand_raw(page) + col + nand_cw * CW_RAW;
+		for (n = 0; n < CW_RAW && col + nand_cw * CW_RAW + n < nand.raw; n++)
+			nand_buf[n] = ~raw[n];
+		nand_cw++;
+		return;
+	}
+
+	raw = nand_raw(page) + nand_cw * CW_RAW;
+	for (n = 0; n < CW_RAW; n++) {
+		cw[n] = ~raw[n];
+		blank &= (cw[n] == 0xff);
+	}
+	if (nand_cw == nand.cwperpage - 1)
+		nand_swap_bbm(cw);
+
+	/* ecc read: data, ecc, spare */
+	memcpy(nand_buf, cw, 512);
+	memcpy(nand_buf + 512, cw + 516, 10);
+	memcpy(nand_buf + 522, cw + 512, 4);
+
+	if (blank) {
+		/* no valid ecc on an erased codeword */
+		REG(NAND_FLASH_STATUS) |= 0x10;
+		nand_buf[3] = 0x54;
+	} else if (nand.page_flags[page] & SIM_ECC_FAIL) {
+		REG(NAND_FLASH_STATUS) |= 0x10;
+		nand_buf[7] ^= 0x5a;
+	}
+	nand_cw++;
+}
+
+static void nand_program(unsigned ecc)
+{
+	unsigned page = nand_page();
+	unsigned char cw[CW_RAW];
+	unsigned char *raw;
+	unsigned n, over = 0;
+
+	nand_busy += nand_xfer_ns(CW_RAW);
+	if (nand_cw == nand.cwperpage - 1) {
+		nand_busy += tprog_us * 1000ull;
+		nand_counts.programs++;
+	}
+
+	if (page >= nand.blocks * nand.ppb || nand_cw >= nand.cwperpage) {
+		REG(NAND_FLASH_STATUS) = 0x110;
+		return;
+	}
+
+	if (ecc) {
+		memset(cw, 0xff, CW_RAW);
+		memcpy(cw, nand_buf, 516);
+		memset(cw + 516, 0, 10);
+		if (nand_cw == nand.cwperpage - 1)
+			nand_swap_bbm(cw);
+	} else {
+		memcpy(cw, nand_buf, CW_RAW);
+	}
+
+	raw = nand_raw(page) + nand_cw * CW_RAW;
+	for (n = 0; n < CW_RAW; n++) {
+		if (ecc && raw[n])
+			over = 1;
+		raw[n] |= (unsigned char) ~cw[n];
+	}
+	if (over)
+		nand_counts.program_over++;
+
+	if (ecc && (nand.block_flags[page / nand.ppb] & SIM_PROG_FAIL))
+		REG(NAND_FLASH_STATUS) = 0x30;
+	else
+		REG(NAND_FLASH_STATUS) = 0xa0;
+	nand_cw++;
+}
+
+static void nand_erase(void)
+{
+	/* erase takes the page number in ADDR0 */
+	unsigned block = REG(NAND_ADDR0) / nand.ppb;
+
+	nand_busy += terase_us * 1000ull;
+	nand_counts.erases++;
+	if (block >= nand.blocks
+		|| (nand.block_flags[block] & (SIM_ERASE_FAIL | SIM_FACTORY_BAD))) {
+		REG(NAND_FLASH_STATUS) = 0x30;
+		return;
+	}
+	nand_erase_block(block);
+	REG(NAND_FLASH_STATUS) = 0xa0;
+}
+
+static void nand_exec(void)
+{
+	unsigned ecc = !(REG(NAND_DEV0_CFG1) & 1);
+
+	switch (REG(NAND_FLASH_CMD) & 0xff) {
+	case NAND_CMD_FETCH_ID:
+		REG(NAND_READ_ID) = nand.id;
+		REG(NAND_FLASH_STATUS) = 0x20;
+		break;
+	case NAND_CMD_PAGE_READ:
+	case NAND_CMD_PAGE_READ_ECC:
+	case NAND_CMD_PAGE_READ_ALL:
+		nand_read(ecc);
+		break;
+	case NAND_CMD_PRG_PAGE:
+	case NAND_CMD_PRG_PAGE_ECC:
+	case NAND_CMD_PRG_PAGE_ALL:
+		nand_program(ecc);
+		break;
+	case NAND_CMD_BLOCK_ERASE:
+		nand_erase();
+		break;
+	default:
+		fatal("nand: command %x not modelled\n", REG(NAND_FLASH_CMD));
+	}
+}
+
+static int nand_reg(unsigned addr)
+{
+	return addr >= NAND_REG(0) && addr < NAND_FLASH_BUFFER + CW_RAW;
+}
+
+static void nand_write(unsigned addr, const unsigned char *src, unsigned len)
+{
+	if (addr >= NAND_FLASH_BUFFER) {
+		memcpy(nand_buf + (addr - NAND_FLASH_BUFFER), src, len);
+		return;
+	}
+	for (; len >= 4; len -= 4, src += 4, addr += 4) {
+		memcpy(&REG(addr), src, 4);
+		if (addr == NAND_ADDR0)
+			nand_cw = 0;
+		if (addr == NAND_EXEC_CMD)
+			nand_exec();
+	}
+}
+
+static void nand_read_regs(unsigned addr, unsigned char *dst, unsigned len)
+{
+	if (addr >= NAND_FLASH_BUFFER)
+		memcpy(dst, nand_buf + (addr - NAND_FLASH_BUFFER), len);
+	else
+		memcpy(dst, &REG(addr), len);
+}
+
+/*
+ * The data mover, command pointer lists of single mode commands only
+ */
+#define DMOV_SD3_BASE	DMOV_SD3(0, 0)
+
+static struct {
+	unsigned config;
+	unsigned results;		/* in the result fifo */
+	int pending;			/* a command list is being worked on */
+	unsigned long long done;	/* when it finishes */
+} dmov_chan[DMOV_MAX_CHAN];
+
+static struct {
+	unsigned long long submits;
+	unsigned long long commands;
+	unsigned long long irqs;
+	unsigned long long poll_ns;	/* cpu time spent polling for results */
+	unsigned long long idle_ns;	/* time slept until an interrupt came */
+} dmov_counts;
+
+static void *mem(unsigned addr)
+{
+	return (void *)(uintptr_t) addr;
+}
+
+static void dmov_run(unsigned addr)
+{
+	unsigned *ptr = mem(addr);
+
+	for (;;) {
+		dmov_s *cmd = mem((*ptr & 0x1fffffff) << 3);
+
+		for (;;) {
+			unsigned char tmp[CW_RAW];
+
+			if ((cmd->cmd & 3) != CMD_MODE_SINGLE)
+				fatal("dmov: mode %x not modelled\n", cmd->cmd & 3);
+			if (cmd->len > sizeof(tmp))
+				fatal("dmov: %u byte transfer\n", cmd->len);
+			dmov_counts.commands++;
+
+			if (nand_reg(cmd->src))
+				nand_read_regs(cmd->src, tmp, cmd->len);
+			else
+				memcpy(tmp, mem(cmd->src), cmd->len);
+			if (nand_reg(cmd->dst))
+				nand_write(cmd->dst, tmp, cmd->len);
+			else
+				memcpy(mem(cmd->dst), tmp, cmd->len);
+
+			if (cmd->cmd & CMD_LC)
+				break;
+			cmd++;
+		}
+		if (*ptr++ & CMD_PTR_LP)
+			break;
+	}
+}
+
+/* the command list runs right away, its results show when the model says it is done */
+static void dmov_start(unsigned ch, unsigned val)
+{
+	if (dmov_chan[ch].pending || dmov_chan[ch].results)
+		fatal("dmov: channel %u is still busy\n", ch);
+
+	dmov_counts.submits++;
+	nand_busy = dmov_us * 1000ull;
+	dmov_run((val & 0x1fffffff) << 3);
+
+	dmov_chan[ch].pending = 1;
+	dmov_chan[ch].done = sim_now + nand_busy;
+}
+
+static unsigned dmov_isr(void)
+{
+	unsigned isr = 0;
+
+	for (unsigned ch = 0; ch < DMOV_MAX_CHAN; ch++)
+		if (dmov_chan[ch].results && (dmov_chan[ch].config & DMOV_CONFIG_IRQ_EN))
+			isr |= 1 << ch;
+	return isr;
+}
+
+/* let time pass up to 'when', finishing command lists on the way */
+static void sim_advance(unsigned long long when)
+{
+	if (when > sim_now)
+		sim_now = when;
+
+	for (unsigned ch = 0; ch < DMOV_MAX_CHAN; ch++) {
+		if (!dmov_chan[ch].pending || dmov_chan[ch].done > sim_now)
+			continue;
+		dmov_chan[ch].pending = 0;
+		dmov_chan[ch].results++;
+	}
+
+	if (dmov_isr() && irq_handler[INT_ADM_AARM] && irq_unmasked[INT_ADM_AARM]
+		&& !in_critical_section()) {
+		dmov_counts.irqs++;
+		critical_section_count++;
+		irq_handler[INT_ADM_AARM](irq_arg[INT_ADM_AARM]);
+		critical_section_count--;
+	}
+}
+
+/* the earliest time something finishes or a thread wakes, 0 if nothing is going on */
+static unsigned long long sim_next_event(void)
+{
+	unsigned long long next = 0;
+
+	for (unsigned ch = 0; ch < DMOV_MAX_CHAN; ch++)
+		if (dmov_chan[ch].pending && (!next || dmov_chan[ch].done < next))
+			next = dmov_chan[ch].done;
+	for (unsigned n = 0; n < sim_nthreads; n++)
+		if (sim_threads[n].running && sim_threads[n].wake > sim_now
+			&& (!next || sim_threads[n].wake < next))
+			next = sim_threads[n].wake;
+	return next;
+}
+
+/* no thread can run: the idle thread waits for the next interrupt */
+static void sim_idle(void)
+{
+	unsigned long long next = sim_next_event();
+	int crit = critical_section_count;
+
+	if (!next)
+		fatal("waiting for an event nothing will signal\n");
+	if (next > sim_now)
+		dmov_counts.idle_ns += next - sim_now;
+	critical_section_count = 0;
+	sim_advance(next);
+	critical_section_count = crit;
+}
+
+static unsigned sim_readl(unsigned addr)
+{
+	unsigned off = addr - DMOV_SD3_BASE;
+	unsigned ch = (off & 0x3f) >> 2;
+
+	if (off >= 0x400)
+		fatal("readl(%08x) not modelled\n", addr);
+
+	switch (off & ~0x3f) {
+	case 0x040: /* RSLT */
+		if (!dmov_chan[ch].results)
+			return 0;
+		dmov_chan[ch].results--;
+		return 0x80000002;
+	case 0x080: case 0x0c0: case 0x100: case 0x140: case 0x180: case 0x1c0:
+		return 0;
+	case 0x200: /* STATUS */
+		/* nothing to report yet: the cpu spins until there is */
+		if (!dmov_chan[ch].results && dmov_chan[ch].pending) {
+			dmov_counts.poll_ns += dmov_chan[ch].done - sim_now;
+			sim_advance(dmov_chan[ch].done);
+		}
+		return (dmov_chan[ch].results << 29)
+			| (dmov_chan[ch].results ? DMOV_STATUS_RSLT_VALID : 0)
+			| (dmov_chan[ch].pending ? 0 : DMOV_STATUS_CMD_PTR_RDY);
+	case 0x380: /* ISR */
+		return dmov_isr();
+	}
+	fatal("readl(%08x) not modelled\n", addr);
+	return 0;
+}
+
+static void sim_writel(unsigned val, unsigned addr)
+{
+	unsigned off = addr - DMOV_SD3_BASE;
+	unsigned ch = (off & 0x3f) >> 2;
+
+	if (off >= 0x400)
+		fatal("writel(%08x) not modelled\n", addr);
+
+	switch (off & ~0x3f) {
+	case 0x000: /* CMD_PTR */
+		dmov_start(ch, val);
+		return;
+	case 0x300: /* CONFIG */
+		dmov_chan[ch].config = val;
+		return;
+	}
+	fatal("writel(%08x) not modelled\n", addr);
+}
+
+/*
+ * A device: the flash, its partitions and the layer on top
+ */
+static struct ptable devinfo, parts;
+
+static void sim_reset(void)
+{
+	sim_now = 0;
+	memset(dmov_chan, 0, sizeof(dmov_chan));
+	memset(&dmov_counts, 0, sizeof(dmov_counts));
+	memset(&nand_counts, 0, sizeof(nand_counts));
+	critical_section_count = 0;
+
+	/* nand.c keeps its state in statics, start them over */
+	flash_ptable = NULL;
+	flash_devinfo = NULL;
+	flash_bad_blocks = -1;
+	flash_batch_pages = 0;
+	flash_bbt_gen = 0;
+	flash_probed_block = ~0U;
+	flash_bbt_ptn = NULL;
+	flash_bbt_seq = 0;
+	flash_bbt_next = 0;
+	flash_gen = 0;
+	memset(&flash_stats, 0, sizeof(flash_stats));
+	memset(&flash_stream, 0, sizeof(flash_stream));
+	for (unsigned n = 0; n < FLASH_L2P_SLOTS; n++) {
+		sim_free(flash_l2p_cache[n].map);
+		sim_free(flash_l2p_cache[n].bad);
+	}
+	memset(flash_l2p_cache, 0, sizeof(flash_l2p_cache));
+	flash_l2p_next = 0;
+	memset(dmov_active, 0, sizeof(dmov_active));
+	dmov_irq_enabled = 0;
+	sim_free(block_tbl.block_status);
+	memset(&block_tbl, 0, sizeof(block_tbl));
+}
+
+/* like htcleo_devinfo_init() and htcleo_ptable_init() */
+static void sim_boot(void)
+{
+	unsigned start = NUM_PROTECTED_BLOCKS;
+
+	sim_reset();
+	flash_init();
+
+	ptable_init(&devinfo);
+	ptable_add(&devinfo, "devinf", start, 1, 0, TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptable_add(&devinfo, "task29", start + 1, nand.blocks - start - 1, 0,
+		   TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	flash_set_devinfo(&devinfo);
+	if (flash_bbt_load(ptable_find(&devinfo, "devinf")) < 0)
+		flash_bad_block_table(ptable_find(&devinfo, "task29"));
+
+	start++;
+	ptable_init(&parts);
+	ptable_add(&parts, "misc", start, 1, 0, TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptable_add(&parts, "recovery", start + 1, 40, 0, TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptable_add(&parts, "boot", start + 41, 40, 0, TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptable_add(&parts, "system", start + 81, 1000, 0, TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptable_add(&parts, "cache", start + 1081, nand.blocks - start - 1081, 0,
+		   TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	flash_set_ptable(&parts);
+}
+
+static struct ptentry *part(const char *name)
+{
+	return ptable_find(&parts, name);
+}
+
+static unsigned rnd_state = 1;
+
+static unsigned rnd(void)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return rnd_state >> 8;
+}
+
+static unsigned char *random_image(unsigned bytes)
+{
+	unsigned char *p = sim_malloc(bytes);
+
+	for (unsigned n = 0; n < bytes; n++)
+		p[n] = rnd();
+	return p;
+}
+
+/*
+ * Batched reads (flash_read_ext() reading a block per command list)
+ */
+static unsigned char *read_back(struct ptentry *ptn, unsigned bytes, int batch, int *ret)
+{
+	unsigned char *p = sim_malloc(bytes);
+	unsigned saved = flash_batch_pages;
+
+	memset(p, 0xa5, bytes);
+	if (!batch)
+		flash_batch_pages = 0;
+	*ret = flash_read(ptn, 0, p, bytes);
+	flash_batch_pages = saved;
+	return p;
+}
+
+static void test_batch_read(void)
+{
+	struct ptentry *ptn;
+	unsigned pagesize = nand.pagesize;
+	unsigned bytes = 3 * 64 * pagesize + 17 * pagesize;
+	unsigned char *img = random_image(bytes);
+	unsigned char *a, *b;
+	unsigned long long submits;
+	int ra, rb;
+
+	printf("batched reads\n");
+	nand_wipe();
+	sim_boot();
+	ptn = part("system");
+	CHECK(flash_batch_pages == nand.ppb);
+	CHECK(flash_write(ptn, 0, img, bytes) == 0);
+
+	submits = dmov_counts.submits;
+	a = read_back(ptn, bytes, 1, &ra);
+	submits = dmov_counts.submits - submits;
+	CHECK(ra == 0 && !memcmp(a, img, bytes));
+	/* one command list per block, plus the block lookups */
+	CHECK(submits <= 4 + 4);
+	sim_free(a);
+
+	submits = dmov_counts.submits;
+	b = read_back(ptn, bytes, 0, &rb);
+	submits = dmov_counts.submits - submits;
+	CHECK(rb == 0 && !memcmp(b, img, bytes));
+	CHECK(submits >= bytes / pagesize);
+	sim_free(b);
+
+	/* a page that does not read back: both paths skip it the same way */
+	nand.page_flags[ptn->start * nand.ppb + 70] |= SIM_ECC_FAIL;
+	a = read_back(ptn, bytes - pagesize, 1, &ra);
+	b = read_back(ptn, bytes - pagesize, 0, &rb);
+	CHECK(ra == rb && !memcmp(a, b, bytes - pagesize));
+	CHECK(!memcmp(a, img, 70 * pagesize));
+	CHECK(!memcmp(a + 70 * pagesize, img + 71 * pagesize, bytes - 71 * pagesize));
+	nand.page_flags[ptn->start * nand.ppb + 70] = 0;
+	sim_free(a);
+	sim_free(b);
+
+	/* reading past the end of what was written: erased pages read as 0xff */
+	a = read_back(ptn, bytes + 5 * pagesize, 1, &ra);
+	b = read_back(ptn, bytes + 5 * pagesize, 0, &rb);
+	CHECK(ra == 0 && rb == 0 && !memcmp(a, b, bytes + 5 * pagesize));
+	CHECK(a[bytes] == 0xff && a[bytes + 3] == 0xff && a[bytes + 5 * pagesize - 1] == 0xff);
+	sim_free(a);
+	sim_free(b);
+
+	/* with spare bytes, a bad block in the way: a new device finds it scanning */
+	nand_factory_bad(part("cache")->start + 1);
+	nand_wipe_bbt();
+	sim_boot();
+	CHECK(flash_bad_blocks == 1);
+	ptn = part("cache");
+	{
+		unsigned wsize = pagesize + 64;
+		unsigned n = 2 * 64 + 9;
+		unsigned char *yaffs = random_image(n * wsize);
+		unsigned char *c;
+
+		CHECK(flash_write(ptn, 64, yaffs, n * wsize) == 0);
+		c = sim_malloc(n * wsize);
+		CHECK(flash_read_ext(ptn, 64, 0, c, n * wsize) == 0);
+		for (unsigned i = 0; i < n; i++) {
+			/* the controller keeps 16 bytes of the spare area */
+			CHECK(!memcmp(c + i * wsize, yaffs + i * wsize, pagesize + 16));
+		}
+		sim_free(c);
+		sim_free(yaffs);
+	}
+	CHECK(nand_counts.program_over == 0);
+	sim_free(img);
+}
+
+/*
+ * Completion from the ADM interrupt (dmov_submit() and dmov_wait())
+ */
+static void test_dmov_irq(void)
+{
+	struct ptentry *ptn;
+	unsigned bytes = 2 * 64 * nand.pagesize + 5 * nand.pagesize;
+	unsigned char *img = random_image(bytes);
+	unsigned char *p;
+	unsigned long long submits, irqs;
+	int r;
+
+	printf("interrupt driven transfers\n");
+	nand_wipe();
+	sim_boot();
+	ptn = part("boot");
+	CHECK(dmov_irq_enabled && irq_unmasked[INT_ADM_AARM]);
+
+	/* every command list completes from the interrupt, the cpu never polls */
+	submits = dmov_counts.submits;
+	irqs = dmov_counts.irqs;
+	dmov_counts.poll_ns = 0;
+	CHECK(flash_write(ptn, 0, img, bytes) == 0);
+	p = read_back(ptn, bytes, 1, &r);
+	CHECK(r == 0 && !memcmp(p, img, bytes));
+	CHECK(dmov_counts.irqs - irqs == dmov_counts.submits - submits);
+	CHECK(dmov_counts.poll_ns == 0);
+	CHECK(dmov_counts.idle_ns > 0);
+	sim_free(p);
+
+	/* the channel is left with IRQ_EN low for the kernel */
+	CHECK(!(dmov_chan[DMOV_NAND_CHAN].config & DMOV_CONFIG_IRQ_EN));
+	CHECK(dmov_active[DMOV_NAND_CHAN] == NULL);
+
+	/* with interrupts held off it polls */
+	irqs = dmov_counts.irqs;
+	enter_critical_section();
+	p = read_back(ptn, bytes, 1, &r);
+	exit_critical_section();
+	CHECK(r == 0 && !memcmp(p, img, bytes));
+	CHECK(dmov_counts.irqs == irqs);
+	CHECK(dmov_counts.poll_ns > 0);
+	sim_free(p);
+
+	/* an interrupt nobody waits for is ignored */
+	CHECK(dmov_irq(NULL) == INT_NO_RESCHEDULE);
+
+	/* a failing command list reports its error through the interrupt as well */
+	nand.page_flags[ptn->start * nand.ppb + 3] |= SIM_ECC_FAIL;
+	p = read_back(ptn, 4 * nand.pagesize, 0, &r);
+	CHECK(!memcmp(p, img, 3 * nand.pagesize));
+	CHECK(!memcmp(p + 3 * nand.pagesize, img + 4 * nand.pagesize, nand.pagesize));
+	nand.page_flags[ptn->start * nand.ppb + 3] = 0;
+	CHECK(dmov_active[DMOV_NAND_CHAN] == NULL);
+	sim_free(p);
+	sim_free(img);
+}
+
+/*
+ * The bad block table in the DEVINFO block
+ */
+static unsigned long long boot_reads(void)
+{
+	sim_boot();
+	return nand_counts.reads;
+}
+
+static void test_bbt(void)
+{
+	unsigned devinf = NUM_PROTECTED_BLOCKS;
+	unsigned first = devinf * nand.ppb;
+	unsigned factory, cache, boot, n;
+	unsigned char *page0 = random_image(nand.pagesize);
+	unsigned char *p;
+	unsigned long long erases;
+	int r;
+
+	printf("bad block table\n");
+
+	/* a new device: no table, the first boot scans and stores one */
+	nand_wipe();
+	nand_put_page(first, page0);
+	sim_boot();
+	factory = part("cache")->start + 3;
+	nand_factory_bad(factory);
+	nand_erase_block(devinf);
+	nand_put_page(first, page0);
+	CHECK(boot_reads() >= nand.blocks - devinf - 1);
+	CHECK(flash_bad_blocks == 1 && block_tbl.block_status[factory] == 1);
+	CHECK(flash_bbt_next == FLASH_BBT_PAGE + FLASH_BBT_COPIES);
+
+	/* the next boot probes the DEVINFO block and reads the log up to an erased page */
+	CHECK(boot_reads() == 1 + FLASH_BBT_COPIES + 1);
+	CHECK(flash_bad_blocks == 1 && block_tbl.block_status[factory] == 1);
+
+	/* marking a block bad appends to the log, the block is not erased */
+	cache = part("cache")->start + 10;
+	erases = nand_counts.erases;
+	CHECK(flash_mark_badblock(part("cache"), cache) == 0);
+	CHECK(nand_counts.erases == erases);
+	CHECK(flash_bad_blocks == 2 && flash_bbt_next == FLASH_BBT_PAGE + 2 * FLASH_BBT_COPIES);
+	CHECK(boot_reads() == 1 + 2 * FLASH_BBT_COPIES + 1);
+	CHECK(flash_bad_blocks == 2 && block_tbl.block_status[cache] == 1);
+
+	/* so does a block that fails to program during flash_write() */
+	boot = part("boot")->start + 1;
+	nand.block_flags[boot] |= SIM_PROG_FAIL;
+	{
+		unsigned bytes = 3 * 64 * nand.pagesize;
+		unsigned char *img = random_image(bytes);
+
+		CHECK(flash_write(part("boot"), 0, img, bytes) == 0);
+		CHECK(block_tbl.block_status[boot] == 1);
+		p = read_back(part("boot"), bytes, 1, &r);
+		CHECK(r == 0 && !memcmp(p, img, bytes));
+		sim_free(p);
+		sim_free(img);
+	}
+	nand.block_flags[boot] = 0;
+	sim_boot();
+	CHECK(flash_bad_blocks == 3 && block_tbl.block_status[boot] == 1);
+
+	/* a spoilt copy: the mirror is used and the pair written again */
+	n = flash_bbt_next;
+	nand_corrupt(first + n - 2, 40);
+	sim_boot();
+	CHECK(flash_bad_blocks == 3 && block_tbl.block_status[boot] == 1);
+	CHECK(flash_bbt_next == n + FLASH_BBT_COPIES);
+
+	/* power lost while writing a pair: the previous table is loaded */
+	n = flash_bbt_next;
+	CHECK(flash_mark_badblock(part("cache"), cache + 1) == 0);
+	nand_corrupt(first + n, 40);
+	nand_corrupt(first + n + 1, 40);
+	sim_boot();
+	CHECK(flash_bad_blocks == 3 && block_tbl.block_status[cache + 1] == 0);
+	CHECK(block_tbl.block_status[boot] == 1);
+
+	/* a full log is compacted, keeping the devinfo page */
+	erases = nand_counts.erases;
+	for (n = 0; n < 40; n++)
+		CHECK(flash_mark_badblock(part("cache"), cache + 2 + n) == 0);
+	CHECK(nand_counts.erases > erases);
+	CHECK(flash_bbt_next < nand.ppb / 2);
+	p = sim_malloc(nand.pagesize);
+	CHECK(flash_read(ptable_find(&devinfo, "devinf"), 0, p, nand.pagesize) == 0);
+	CHECK(!memcmp(p, page0, nand.pagesize));
+	sim_free(p);
+	sim_boot();
+	CHECK(flash_bad_blocks == 43);
+	CHECK(block_tbl.block_status[cache + 41] == 1 && block_tbl.block_status[factory] == 1);
+
+	/* no good copy left: the blocks are scanned again and the markers found */
+	for (n = FLASH_BBT_PAGE; n < flash_bbt_next; n++)
+		nand_corrupt(first + n, 40);
+	CHECK(boot_reads() >= nand.blocks - devinf - 1);
+	CHECK(flash_bad_blocks == 44 && block_tbl.block_status[cache + 1] == 1);
+	n = flash_bbt_next;
+	CHECK(boot_reads() == 1 + n - FLASH_BBT_PAGE + 1);
+	CHECK(flash_bad_blocks == 44);
+	sim_free(page0);
+}
+
+/*
+ * Partition offsets to blocks (flash_l2p_translate())
+ */
+
+/* the walk flash_read_ext() did before the map, from the partition start every time */
+static int walk_translate(struct ptentry *ptn, unsigned lblock)
+{
+	unsigned block;
+	int bad;
+
+	for (block = ptn->start; block < ptn->start + ptn->length; block++) {
+		if (flash_bad_blocks == -1)
+			bad = _flash_block_isbad(flash_cmdlist, flash_ptrlist, block * 64);
+		else
+			bad = (int) block_tbl.block_status[block] > 0;
+		if (!bad && lblock-- == 0)
+			return block - ptn->start;
+	}
+	return -1;
+}
+
+static int translate_matches(struct ptentry *ptn)
+{
+	for (unsigned n = 0; n <= ptn->length; n++)
+		if (flash_l2p_translate(ptn, n) != walk_translate(ptn, n))
+			return 0;
+	return 1;
+}
+
+static void test_translate(void)
+{
+	struct ptentry *ptn;
+	unsigned char *img, *p;
+	unsigned bytes = 4 * 64 * nand.pagesize;
+	int r;
+
+	printf("block translation\n");
+	nand_wipe();
+	sim_boot();
+	ptn = part("cache");
+	nand_factory_bad(ptn->start + 5);
+	nand_factory_bad(ptn->start + 6);
+	nand_factory_bad(ptn->start + ptn->length - 1);
+	nand_wipe_bbt();
+	sim_boot();
+	ptn = part("cache");
+	CHECK(flash_bad_blocks == 3);
+	CHECK(translate_matches(ptn));
+	CHECK(flash_l2p_translate(ptn, ptn->length - 3) == -1);
+
+	/* a block going bad changes the map */
+	CHECK(flash_mark_badblock(ptn, ptn->start + 2) == 0);
+	CHECK(translate_matches(ptn));
+	CHECK(flash_l2p_translate(ptn, 2) == 3 && flash_l2p_translate(ptn, 4) == 7);
+
+	/* before there is a table the blocks are probed, once */
+	flash_bad_blocks = -1;
+	flash_bbt_gen++;
+	CHECK(translate_matches(ptn));
+	flash_stats.l2p_probes = 0;
+	CHECK(flash_l2p_translate(ptn, 100) == 103);
+	CHECK(flash_stats.l2p_probes == 0);
+	sim_boot();
+	ptn = part("cache");
+
+	/* reads and writes use the same map: deep offsets land past the bad blocks */
+	img = random_image(bytes);
+	CHECK(flash_write(ptn, 0, img, bytes) == 0);
+	p = sim_malloc(64 * nand.pagesize);
+	CHECK(flash_read(ptn, 3 * 64 * nand.pagesize, p, 64 * nand.pagesize) == 0);
+	CHECK(!memcmp(p, img + 3 * 64 * nand.pagesize, 64 * nand.pagesize));
+	p = read_back(ptn, bytes, 0, &r);
+	CHECK(r == 0 && !memcmp(p, img, bytes));
+	sim_free(p);
+	sim_free(img);
+}
+
+/*
+ * Streaming flash (flash_stream.c): usb feeds the ring, a thread writes
+ */
+
+/* 'download:' with the sink armed, as cmd_download() does it */
+static int stream_download(const unsigned char *img, unsigned len)
+{
+	struct fastboot_sink *sink = download_sink;
+	int r;
+
+	download_sink = NULL;
+	usb_data = img;
+	usb_pos = 0;
+	if (sink == NULL || sink->start(len))
+		return -1;
+	r = sink->receive(len);
+	return r;
+}
+
+static int stream_flash(struct ptentry *ptn, unsigned extra, int boot_image,
+			const unsigned char *img, unsigned len, unsigned *bytes)
+{
+	unsigned long crc;
+	int r;
+
+	if (flash_stream_arm(ptn, extra, boot_image, 0))
+		return -2;
+	r = stream_download(img, len);
+	if (flash_stream_finish(&crc, bytes))
+		r = -1;
+	sim_threads_reset();
+	return r;
+}
+
+static void test_stream(void)
+{
+	struct ptentry *ptn;
+	unsigned pagesize = nand.pagesize;
+	unsigned len = 40 * 64 * pagesize + 3 * pagesize + 100;
+	unsigned char *img = random_image(len);
+	unsigned char *p;
+	unsigned bytes;
+	unsigned long crc;
+	int r;
+
+	printf("streaming flash\n");
+	nand_wipe();
+	sim_boot();
+	ptn = part("system");
+	nand_factory_bad(ptn->start + 2);
+	nand_wipe_bbt();
+	sim_boot();
+	ptn = part("system");
+
+	/* more than the scratch area, the tail padded to a page */
+	CHECK(len > target_get_scratch_size());
+	CHECK(stream_flash(ptn, 0, 0, img, len, &bytes) == 0);
+	CHECK(bytes == (len + pagesize - 1) / pagesize * pagesize);
+	p = read_back(ptn, bytes + pagesize, 1, &r);
+	CHECK(r == 0 && !memcmp(p, img, len));
+	CHECK(p[len] == 0xff && p[bytes + pagesize - 1] == 0xff);
+	sim_free(p);
+
+	/* with verification, the crc matches what a read back finds */
+	CHECK(flash_stream_arm(ptn, 0, 0, 1) == 0);
+	CHECK(stream_download(img, 64 * pagesize * 3) == 0);
+	CHECK(flash_stream_finish(&crc, &bytes) == 0);
+	sim_threads_reset();
+	{
+		unsigned long crc2 = 0;
+		void *work = sim_malloc(2 * flash_write_chunk_size(0));
+
+		CHECK(flash_read_crc(ptn, 0, bytes, work, &crc2) == 0);
+		CHECK(crc == crc2 && crc == flash_image_crc(0, img, bytes, 0));
+		sim_free(work);
+	}
+
+	/* yaffs images with their spare bytes */
+	{
+		unsigned wsize = pagesize + 64;
+		unsigned n = 3 * 64 + 5;
+		unsigned char *yaffs = random_image(n * wsize);
+		unsigned char *c = sim_malloc(n * wsize);
+
+		CHECK(stream_flash(part("cache"), 64, 0, yaffs, n * wsize, &bytes) == 0);
+		CHECK(flash_read_ext(part("cache"), 64, 0, c, n * wsize) == 0);
+		for (unsigned i = 0; i < n; i++)
+			CHECK(!memcmp(c + i * wsize, yaffs + i * wsize, pagesize + 16));
+		/* not a whole number of pages is refused before any data */
+		CHECK(stream_flash(part("cache"), 64, 0, yaffs, n * wsize - 1, &bytes) == -1);
+		sim_free(c);
+		sim_free(yaffs);
+	}
+
+	/* a boot partition only takes boot images, checked before anything is written */
+	{
+		unsigned long long erases = nand_counts.erases;
+
+		CHECK(stream_flash(part("boot"), 0, 1, img, 64 * pagesize, &bytes) == -1);
+		CHECK(nand_counts.erases == erases);
+	}
+
+	/* usb failing half way: the stream gives up, the partition is left alone past it */
+	p = read_back(ptn, len, 1, &r);
+	usb_fail_at = 2 * 64 * pagesize;
+	CHECK(stream_flash(ptn, 0, 0, img + pagesize, len, &bytes) == -1);
+	usb_fail_at = ~0U;
+	{
+		unsigned char *q = read_back(ptn, len, 1, &r);
+
+		CHECK(!memcmp(q + 3 * 64 * pagesize, p + 3 * 64 * pagesize, len - 3 * 64 * pagesize));
+		sim_free(q);
+	}
+	sim_free(p);
+	sim_free(img);
+}
+
+/*
+ * Sparse images (flash_sparse.c)
+ */
+
+/* like img2simg: blocks that are all 0xff stand for holes and become
+ * DONT_CARE, blocks of one repeated word FILL, the rest RAW
+ */
+static unsigned sparse_build(unsigned char *out, const unsigned char *img, unsigned len,
+			     unsigned blk_sz)
+{
+	sparse_header_t *h = (sparse_header_t*) out;
+	chunk_header_t *c = NULL;
+	unsigned char *p = out + sizeof(*h);
+	unsigned blk, type = 0, value = 0;
+
+	memset(h, 0, sizeof(*h));
+	h->magic = SPARSE_HEADER_MAGIC;
+	h->major_version = SPARSE_HEADER_MAJOR_VER;
+	h->file_hdr_sz = sizeof(sparse_header_t);
+	h->chunk_hdr_sz = sizeof(chunk_header_t);
+	h->blk_sz = blk_sz;
+	h->total_blks = len / blk_sz;
+
+	for (blk = 0; blk < h->total_blks; blk++) {
+		const unsigned char *b = img + blk * blk_sz;
+		unsigned word, t, i;
+
+		memcpy(&word, b, 4);
+		for (i = 4; i < blk_sz && !memcmp(b + i, &word, 4); i += 4)
+			;
+		if (i < blk_sz)
+			t = CHUNK_TYPE_RAW;
+		else if (word == 0xffffffff)
+			t = CHUNK_TYPE_DONT_CARE;
+		else
+			t = CHUNK_TYPE_FILL;
+
+		if (c == NULL || t != type || (t == CHUNK_TYPE_FILL && word != value)) {
+			c = (chunk_header_t*) p;
+			c->chunk_type = type = t;
+			c->reserved1 = 0;
+			c->chunk_sz = 0;
+			c->total_sz = sizeof(*c);
+			p += sizeof(*c);
+			h->total_chunks++;
+			if (t == CHUNK_TYPE_FILL) {
+				memcpy(p, &word, 4);
+				value = word;
+				p += 4;
+				c->total_sz += 4;
+			}
+		}
+		c->chunk_sz++;
+		if (t == CHUNK_TYPE_RAW) {
+			memcpy(p, b, blk_sz);
+			p += blk_sz;
+			c->total_sz += blk_sz;
+		}
+	}
+	return p - out;
+}
+
+/* an image with runs of data, zeros, a pattern and erased space, page by page */
+static unsigned char *sparse_image(unsigned pages, unsigned wsize)
+{
+	unsigned char *img = random_image(pages * wsize);
+
+	for (unsigned n = 0; n < pages; n++) {
+		unsigned char *page = img + n * wsize;
+
+		switch ((n / 37) % 4) {
+		case 1:
+			memset(page, 0, wsize);
+			break;
+		case 2:
+			for (unsigned i = 0; i < wsize; i += 4)
+				memcpy(page + i, "\xef\xbe\xad\xde", 4);
+			break;
+		case 3:
+			memset(page, 0xff, wsize);
+			break;
+		}
+	}
+	return img;
+}
+
+static unsigned count_blank(const unsigned char *img, unsigned pages, unsigned wsize)
+{
+	unsigned blank = 0;
+
+	for (unsigned n = 0; n < pages; n++) {
+		unsigned i;
+
+		for (i = 0; i < wsize && img[n * wsize + i] == 0xff; i++)
+			;
+		blank += (i == wsize);
+	}
+	return blank;
+}
+
+static void test_sparse(void)
+{
+	unsigned pagesize = nand.pagesize;
+	unsigned char *sparse = target_get_scratch_address();
+	unsigned extra;
+
+	printf("sparse images\n");
+	nand_wipe();
+	sim_boot();
+	nand_factory_bad(part("system")->start + 1);
+	nand_wipe_bbt();
+	sim_boot();
+
+	for (extra = 0; extra <= 64; extra += 64) {
+		struct ptentry *ptn = part(extra ? "cache" : "system");
+		unsigned wsize = pagesize + extra;
+		unsigned pages = 5 * 64;
+		unsigned char *img = sparse_image(pages, wsize);
+		unsigned char *c = sim_malloc(pages * wsize + wsize);
+		unsigned long long programs;
+		unsigned long crc;
+		unsigned sz, bytes;
+
+		/* 4 KB blocks: chunks straddle pages when the spare is included */
+		sz = sparse_build(sparse, img, pages * wsize, 4096);
+		CHECK(sz < pages * wsize / 2);
+		CHECK(flash_is_sparse(sparse, sz));
+
+		programs = nand_counts.programs;
+		CHECK(flash_write_sparse(ptn, extra, sparse, sz, &crc, &bytes) == 0);
+		CHECK(bytes == pages * wsize);
+		CHECK(crc == flash_image_crc(0, img, pages * wsize, extra));
+		/* erased pages are not programmed */
+		CHECK(nand_counts.programs - programs == pages - count_blank(img, pages, wsize));
+
+		CHECK(flash_read_ext(ptn, extra, 0, c, pages * wsize + wsize) == 0);
+		for (unsigned i = 0; i <= pages; i++) {
+			const unsigned char *want = i < pages ? img + i * wsize : NULL;
+			unsigned char *got = c + i * wsize;
+
+			if (want)
+				CHECK(!memcmp(got, want, extra ? pagesize + 16 : pagesize));
+			else
+				CHECK(got[0] == 0xff && got[pagesize - 1] == 0xff);
+		}
+		sim_free(c);
+		sim_free(img);
+	}
+
+	/* a corrupt chunk is found before anything is erased */
+	{
+		unsigned pages = 64;
+		unsigned char *img = sparse_image(pages, pagesize);
+		unsigned sz = sparse_build(sparse, img, pages * pagesize, 4096);
+		unsigned long long erases = nand_counts.erases;
+		chunk_header_t *chunk = (chunk_header_t*) (sparse + sizeof(sparse_header_t));
+		unsigned bytes;
+
+		chunk->total_sz -= 4;
+		CHECK(flash_write_sparse(part("system"), 0, sparse, sz, NULL, &bytes) == -1);
+		chunk->total_sz += 4;
+		((sparse_header_t*) sparse)->total_blks = part("system")->length * 64 * 2 + 1;
+		CHECK(flash_write_sparse(part("system"), 0, sparse, sz, NULL, &bytes) == -1);
+		CHECK(nand_counts.erases == erases);
+		sim_free(img);
+	}
+}
+
+/* a boot image header page with 'cmdline' */
+static void put_bootimg(struct ptentry *ptn, const char *cmdline)
+{
+	unsigned char *page = sim_malloc(nand.pagesize);
+	struct boot_img_hdr *hdr = (struct boot_img_hdr*) page;
+
+	memset(page, 0, nand.pagesize);
+	memcpy(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+	hdr->kernel_size = 0x200000;
+	hdr->ramdisk_size = 0x80000;
+	hdr->page_size = nand.pagesize;
+	strcpy((char*) hdr->cmdline, cmdline);
+	CHECK(flash_write(ptn, 0, page, nand.pagesize) == 0);
+	sim_free(page);
+}
+
+static void test_bootimg_cache(void)
+{
+	const struct bootimg_info *info, *rec;
+	struct ptentry moved;
+	unsigned long long reads;
+	unsigned char *page = sim_malloc(nand.pagesize);
+
+	printf("boot image header cache\n");
+	nand_wipe();
+	sim_boot();
+	put_bootimg(part("boot"), "rel_path=CoolRom console=null");
+	put_bootimg(part("recovery"), "quiet rel_path=Recovery");
+
+	/* the first lookup reads the header page, later ones nothing */
+	reads = nand_counts.reads;
+	info = bootimg_cache_get(part("boot"));
+	CHECK(info && info->status == 0 && !strcmp(info->rom_name, "CoolRom"));
+	CHECK(info->hdr.kernel_size == 0x200000 && info->hdr.ramdisk_size == 0x80000);
+	CHECK(nand_counts.reads - reads == 1);
+	rec = bootimg_cache_get(part("recovery"));
+	CHECK(rec && rec->status == 0 && !strcmp(rec->rom_name, "Recovery"));
+	reads = nand_counts.reads;
+	for (unsigned n = 0; n < 10; n++) {
+		CHECK(bootimg_cache_get(part("boot")) == info);
+		CHECK(bootimg_cache_get(part("recovery")) == rec);
+	}
+	CHECK(nand_counts.reads == reads);
+	CHECK(bootimg_cache_get(NULL) == NULL);
+
+	/* any write invalidates, the header is read again */
+	CHECK(flash_write(part("system"), 0, page, nand.pagesize) == 0);
+	reads = nand_counts.reads;
+	CHECK(bootimg_cache_get(part("boot")) == info && info->status == 0);
+	CHECK(nand_counts.reads - reads == 1);
+
+	/* a new image shows its name, an erase leaves no boot image */
+	put_bootimg(part("boot"), "rel_path=OtherRom");
+	info = bootimg_cache_get(part("boot"));
+	CHECK(info && !strcmp(info->rom_name, "OtherRom"));
+	CHECK(flash_erase(part("boot")) == 0);
+	info = bootimg_cache_get(part("boot"));
+	CHECK(info && info->status == BOOTIMG_INVALID && !strcmp(info->rom_name, "INVALID"));
+
+	/* so does a partition that moved */
+	reads = nand_counts.reads;
+	CHECK(bootimg_cache_get(part("recovery")) == rec);
+	CHECK(nand_counts.reads - reads == 1);
+	moved = *part("recovery");
+	moved.start = part("boot")->start;
+	reads = nand_counts.reads;
+	CHECK(bootimg_cache_get(&moved)->status == BOOTIMG_INVALID);
+	CHECK(nand_counts.reads - reads == 1);
+	sim_free(page);
+}
+
+/* a boot image as mkbootimg builds it, the id is the SHA-1 of its sections and their sizes */
+static unsigned char *build_bootimg(unsigned kernel, unsigned ramdisk, unsigned flags,
+				    unsigned *bytes)
+{
+	unsigned pagesize = nand.pagesize;
+	unsigned k = (kernel + pagesize - 1) & ~(pagesize - 1);
+	unsigned r = (ramdisk + pagesize - 1) & ~(pagesize - 1);
+	unsigned char *img = random_image(pagesize + k + r);
+	struct boot_img_hdr *hdr = (struct boot_img_hdr*) img;
+	struct sha1_ctx ctx;
+	unsigned zero = 0;
+
+	memset(img, 0, pagesize);
+	memcpy(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+	hdr->kernel_size = kernel;
+	hdr->ramdisk_size = ramdisk;
+	hdr->page_size = pagesize;
+	hdr->unused[0] = BOOT_FLAGS_MAGIC | flags;
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, img + pagesize, kernel);
+	sha1_update(&ctx, &kernel, sizeof(kernel));
+	sha1_update(&ctx, img + pagesize + k, ramdisk);
+	sha1_update(&ctx, &ramdisk, sizeof(ramdisk));
+	sha1_update(&ctx, &zero, sizeof(zero));
+	sha1_final(&ctx, (unsigned char*) hdr->id);
+
+	*bytes = pagesize + k + r;
+	return img;
+}
+
+/* the header of img, loading kernel, ramdisk and tags 1 MB apart from mem on */
+static void load_at(struct boot_img_hdr *hdr, const unsigned char *img, unsigned char *mem)
+{
+	memcpy(hdr, img, sizeof(*hdr));
+	hdr->kernel_addr = (unsigned) (uintptr_t) mem;
+	hdr->ramdisk_addr = hdr->kernel_addr + (1 << 20);
+	hdr->tags_addr = hdr->kernel_addr + (2 << 20);
+}
+
+static void test_bootimg_digest(void)
+{
+	static const unsigned char abc[SHA1_DIGEST_SIZE] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+	};
+	static const unsigned char million_a[SHA1_DIGEST_SIZE] = {
+		0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+		0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f,
+	};
+	unsigned pagesize = nand.pagesize;
+	unsigned kernel = 300 * 1024 + 123, ramdisk = 100 * 1024 + 7;
+	unsigned char digest[SHA1_DIGEST_SIZE];
+	unsigned char *mem = sim_malloc(3 << 20);
+	struct boot_img_hdr hdr;
+	struct sha1_ctx ctx;
+	unsigned char *img;
+	unsigned ramdisk_pages = (ramdisk + pagesize - 1) / pagesize;
+	unsigned bytes, flip;
+
+	printf("boot image digest\n");
+
+	/* FIPS 180 vectors, the million a's fed in odd sized pieces */
+	sha1_init(&ctx);
+	sha1_update(&ctx, "abc", 3);
+	sha1_final(&ctx, digest);
+	CHECK(!memcmp(digest, abc, sizeof(digest)));
+	memset(mem, 'a', 1000000);
+	sha1_init(&ctx);
+	for (unsigned n = 0; n < 1000000; n += 997)
+		sha1_update(&ctx, mem + n, MIN(997, 1000000 - n));
+	sha1_final(&ctx, digest);
+	CHECK(!memcmp(digest, million_a, sizeof(digest)));
+
+	nand_wipe();
+	sim_boot();
+
+	/* a good image loads, with and without the check */
+	for (unsigned flags = 0; flags <= BOOT_FLAG_VERIFY; flags += BOOT_FLAG_VERIFY) {
+		img = build_bootimg(kernel, ramdisk, flags, &bytes);
+		CHECK(flash_write(part("boot"), 0, img, bytes) == 0);
+		load_at(&hdr, img, mem);
+		memset(mem, 0, 3 << 20);
+		CHECK(bootimg_load(part("boot"), &hdr, NULL) == 0);
+		CHECK(hdr.kernel_size == kernel && hdr.ramdisk_size == ramdisk);
+		CHECK(!memcmp(mem, img + pagesize, kernel));
+		CHECK(!memcmp(mem + (1 << 20), img + bytes - (ramdisk_pages * pagesize), ramdisk));
+
+		/* a bit flipped on the flash, that the ecc does not see */
+		flip = part("boot")->start * nand.ppb + 1 + 70;
+		nand_corrupt(flip, 40);
+		load_at(&hdr, img, mem);
+		CHECK(bootimg_load(part("boot"), &hdr, NULL) == (flags ? BOOTIMG_LOAD_DIGEST : 0));
+		sim_free(img);
+	}
+
+	/* the ramdisk and the sizes count too */
+	img = build_bootimg(kernel, ramdisk, BOOT_FLAG_VERIFY, &bytes);
+	img[bytes - pagesize] ^= 1;
+	CHECK(flash_write(part("boot"), 0, img, bytes) == 0);
+	load_at(&hdr, img, mem);
+	CHECK(bootimg_load(part("boot"), &hdr, NULL) == BOOTIMG_LOAD_DIGEST);
+	img[bytes - pagesize] ^= 1;
+	((struct boot_img_hdr*) img)->ramdisk_size--;
+	CHECK(flash_write(part("boot"), 0, img, bytes) == 0);
+	load_at(&hdr, img, mem);
+	CHECK(bootimg_load(part("boot"), &hdr, NULL) == BOOTIMG_LOAD_DIGEST);
+	sim_free(img);
+	sim_free(mem);
+}
+
+/* a new device with 'bench_bad' factory bad blocks, anywhere but the DEVINFO block */
+static void bench_wipe(void)
+{
+	unsigned n = 0;
+
+	nand_wipe();
+	rnd_state = 7;
+	while (n < bench_bad) {
+		unsigned block = NUM_PROTECTED_BLOCKS + 1 + rnd() % (nand.blocks - NUM_PROTECTED_BLOCKS - 1);
+
+		if (!(nand.block_flags[block] & SIM_FACTORY_BAD)) {
+			nand_factory_bad(block);
+			n++;
+		}
+	}
+}
+
+static void bench_report(const char *what, unsigned pages, unsigned long long ns,
+			 unsigned long long submits)
+{
+	double mb = (double) pages * nand.pagesize / (1 << 20);
+
+	printf("  %-20s %7.2f MB/s %8.0f pages/s %6.0f command lists/MB\n", what,
+	       mb / ns * 1e9, pages / (ns / 1e9), submits / mb);
+}
+
+/* flash_write() and flash_read_ext() of 'bench_mb' MB, spare bytes included */
+static void bench_nand(void)
+{
+	struct ptentry *ptn;
+	unsigned wsize = nand.pagesize + bench_spare;
+	unsigned pages = (bench_mb << 20) / nand.pagesize;
+	unsigned char *img = random_image(pages * wsize);
+	unsigned char *p = sim_malloc(pages * wsize);
+	unsigned long long t, submits;
+	int batch;
+
+	bench_wipe();
+	sim_boot();
+	ptn = part("system");
+
+	printf("%u MB of %u+%u byte pages, %u bad blocks, tR %u us, tPROG %u us, tBERS %u us\n",
+	       bench_mb, nand.pagesize, bench_spare, bench_bad, tr_us, tprog_us, terase_us);
+
+	t = sim_now;
+	submits = dmov_counts.submits;
+	flash_write(ptn, bench_spare, img, pages * wsize);
+	bench_report("flash_write", pages, sim_now - t, dmov_counts.submits - submits);
+
+	for (batch = 1; batch >= 0; batch--) {
+		unsigned saved = flash_batch_pages;
+		int r;
+
+		if (!batch)
+			flash_batch_pages = 0;
+		t = sim_now;
+		submits = dmov_counts.submits;
+		r = flash_read_ext(ptn, bench_spare, 0, p, pages * wsize);
+		bench_report(batch ? "flash_read, batched" : "flash_read, by page", pages,
+			     sim_now - t, dmov_counts.submits - submits);
+		flash_batch_pages = saved;
+		for (unsigned n = 0; n < pages && !r; n++)
+			if (memcmp(p + n * wsize, img + n * wsize, nand.pagesize))
+				r = -1;
+		if (r)
+			printf("  MISMATCH\n");
+	}
+	sim_free(p);
+	sim_free(img);
+}
+
+/* what the cpu does while the flash works: polls, or leaves it to other threads */
+static void bench_irq(void)
+{
+	struct ptentry *ptn;
+	unsigned bytes = 8 << 20;
+	unsigned char *img = random_image(bytes);
+	int irq;
+
+	bench_wipe();
+	sim_boot();
+	ptn = part("system");
+
+	printf("flash_write of %u MB\n", bytes >> 20);
+	for (irq = 1; irq >= 0; irq--) {
+		unsigned long long t = sim_now, idle = dmov_counts.idle_ns, poll = dmov_counts.poll_ns;
+
+		dmov_irq_enabled = irq;
+		flash_write(ptn, 0, img, bytes);
+		t = sim_now - t;
+		idle = dmov_counts.idle_ns - idle;
+		poll = dmov_counts.poll_ns - poll;
+		printf("  %-12s %7.2f MB/s, cpu polling %3.0f%%, free for other threads %3.0f%%\n",
+		       irq ? "interrupt" : "polled", (double) bytes / t * 1000,
+		       100.0 * poll / t, 100.0 * idle / t);
+	}
+	sim_free(img);
+}
+
+static double host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* translating a partition offset, walking from the start or through the map */
+static void bench_translate(void)
+{
+	static const unsigned lengths[] = { 40, 256, 1024, 1500 };
+	struct ptable tbl;
+	unsigned n, i;
+
+	bench_wipe();
+	sim_boot();
+
+	printf("block lookups, random offsets, %u bad blocks\n", bench_bad);
+	printf("  %6s %14s %14s %16s %16s\n", "blocks", "walk (host)", "map (host)",
+	       "walk (no table)", "map (no table)");
+	ptable_init(&tbl);
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		struct ptentry *ptn;
+		unsigned loops = 200000, probe_loops = 200;
+		double t[4];
+		unsigned long long sim;
+		volatile int sink = 0;
+
+		ptable_add(&tbl, "bench", NUM_PROTECTED_BLOCKS + 1, lengths[i], 0,
+			   TYPE_APPS_PARTITION, PERM_WRITEABLE);
+		ptn = ptable_get(&tbl, i);
+
+		t[0] = host_ns();
+		for (n = 0; n < loops; n++)
+			sink += walk_translate(ptn, rnd() % (ptn->length * 98 / 100));
+		t[0] = (host_ns() - t[0]) / loops;
+		flash_l2p_translate(ptn, ptn->length - 1);
+		t[1] = host_ns();
+		for (n = 0; n < loops; n++)
+			sink += flash_l2p_translate(ptn, rnd() % (ptn->length * 98 / 100));
+		t[1] = (host_ns() - t[1]) / loops;
+
+		/* no table yet: the walk reads the flash for every block it passes */
+		flash_bad_blocks = -1;
+		sim = sim_now;
+		for (n = 0; n < probe_loops; n++)
+			sink += walk_translate(ptn, rnd() % (ptn->length * 98 / 100));
+		t[2] = (double) (sim_now - sim) / probe_loops;
+		flash_bbt_gen++;
+		sim = sim_now;
+		for (n = 0; n < probe_loops; n++)
+			sink += flash_l2p_translate(ptn, rnd() % (ptn->length * 98 / 100));
+		t[3] = (double) (sim_now - sim) / probe_loops;
+		flash_bad_blocks = block_tbl.count;
+		flash_bbt_gen++;
+
+		printf("  %6u %11.0f ns %11.0f ns %13.0f us %13.0f us\n", ptn->length,
+		       t[0], t[1], t[2] / 1000, t[3] / 1000);
+	}
+}
+
+/* download then flash, against flashing while downloading */
+static void bench_stream(void)
+{
+	unsigned bytes = 16 << 20;
+	unsigned blocks = bytes / (64 * nand.pagesize) + 2;
+	unsigned char *img = random_image(bytes);
+	unsigned char *buf = sim_malloc(bytes);
+	struct ptable tbl;
+	struct ptentry *ptn;
+	unsigned long long t;
+	unsigned n;
+
+	bench_wipe();
+	sim_boot();
+	ptable_init(&tbl);
+	ptable_add(&tbl, "bench", part("system")->start, blocks, 0,
+		   TYPE_APPS_PARTITION, PERM_WRITEABLE);
+	ptn = ptable_find(&tbl, "bench");
+
+	printf("fastboot flash of %u MB, usb at %u MB/s\n", bytes >> 20, usb_mbs);
+	t = sim_now;
+	usb_receive(bytes);
+	memcpy(buf, img, bytes);
+	flash_write(ptn, 0, buf, bytes);
+	t = sim_now - t;
+	printf("  %-20s %7.2f MB/s\n", "download, then flash", (double) bytes / t * 1000);
+
+	t = sim_now;
+	stream_flash(ptn, 0, 0, img, bytes, &n);
+	t = sim_now - t;
+	printf("  %-20s %7.2f MB/s\n", "streamed", (double) bytes / t * 1000);
+	sim_free(buf);
+	sim_free(img);
+}
+
+/* a mostly empty 16 MB image, raw against sparse */
+static void bench_sparse(void)
+{
+	unsigned pagesize = nand.pagesize;
+	unsigned bytes = 16 << 20, pages = bytes / pagesize;
+	unsigned char *img = random_image(bytes);
+	unsigned char *sparse = target_get_scratch_address();
+	struct ptentry *ptn;
+	unsigned long long t, programs;
+	unsigned sz, n;
+
+	/* 1 MB of data, some zeroed pages, the rest erased */
+	memset(img + (1 << 20), 0xff, bytes - (1 << 20));
+	for (n = 1024; n < pages; n += 97)
+		memset(img + n * pagesize, 0, pagesize);
+	sz = sparse_build(sparse, img, bytes, 4096);
+
+	bench_wipe();
+	sim_boot();
+	ptn = part("system");
+	printf("flash of a 16 MB image with 1 MB of data, usb at %u MB/s\n", usb_mbs);
+
+	t = sim_now;
+	programs = nand_counts.programs;
+	usb_receive(bytes);
+	flash_write(ptn, 0, img, bytes);
+	printf("  %-8s %8u KB over usb %6llu pages programmed %7.0f ms\n", "raw", bytes >> 10,
+	       nand_counts.programs - programs, (sim_now - t) / 1e6);
+
+	t = sim_now;
+	programs = nand_counts.programs;
+	usb_receive(sz);
+	flash_write_sparse(ptn, 0, sparse, sz, NULL, &n);
+	printf("  %-8s %8u KB over usb %6llu pages programmed %7.0f ms\n", "sparse", sz >> 10,
+	       nand_counts.programs - programs, (sim_now - t) / 1e6);
+	sim_free(img);
+}
+
+/* what 'oem flash-verify' adds to a flash: a batched read back and the crc */
+static void bench_verify(void)
+{
+	unsigned bytes = 8 << 20;
+	unsigned char *img = random_image(bytes);
+	void *work = sim_malloc(2 * flash_write_chunk_size(0));
+	struct ptentry *ptn;
+	unsigned long long write, verify;
+	unsigned long crc;
+	double crc_ns;
+
+	bench_wipe();
+	sim_boot();
+	ptn = part("system");
+	printf("verified flash of %u MB\n", bytes >> 20);
+
+	write = sim_now;
+	flash_write(ptn, 0, img, bytes);
+	write = sim_now - write;
+	verify = sim_now;
+	flash_read_crc(ptn, 0, bytes, work, &crc);
+	verify = sim_now - verify;
+
+	crc_ns = host_ns();
+	crc = flash_image_crc(0, img, bytes, 0);
+	crc_ns = host_ns() - crc_ns;
+
+	printf("  write %7.0f ms, read back %7.0f ms (+%.0f%%)\n", write / 1e6, verify / 1e6,
+	       100.0 * verify / write);
+	printf("  crc32 on this host %7.0f MB/s, %.1f%% of the read back\n",
+	       bytes / crc_ns * 1000, 100.0 * crc_ns / verify);
+	sim_free(work);
+	sim_free(img);
+}
+
+/* flash_init() up to a bad block table, scanning or from the DEVINFO block */
+static void bench_boot(void)
+{
+	unsigned long long reads;
+
+	bench_wipe();
+	printf("bad block table at boot\n");
+	reads = boot_reads();
+	printf("  %-12s %7.1f ms %6llu page reads\n", "scan", sim_now / 1e6, reads);
+	reads = boot_reads();
+	printf("  %-12s %7.1f ms %6llu page reads\n", "load", sim_now / 1e6, reads);
+}
+
+/*
+ * nand.c passes stack addresses to the data mover, so it runs on a
+ * stack below 4 GB
+ */
+static int main_argc;
+static char **main_argv;
+static int main_ret;
+
+static const struct {
+	const char *name;
+	unsigned *value;
+} options[] = {
+	{ "page", &page_size },
+	{ "spare", &bench_spare },
+	{ "bad", &bench_bad },
+	{ "mb", &bench_mb },
+	{ "dmov", &dmov_us },
+	{ "tr", &tr_us },
+	{ "tprog", &tprog_us },
+	{ "terase", &terase_us },
+	{ "bus", &bus_mbs },
+	{ "usb", &usb_us },
+	{ "usbmbs", &usb_mbs },
+};
+
+static int parse_options(int argc, char **argv)
+{
+	for (int i = 0; i < argc; i++) {
+		char *eq = strchr(argv[i], '=');
+		unsigned n;
+
+		for (n = 0; eq && n < countof(options); n++)
+			if (strlen(options[n].name) == (size_t)(eq - argv[i]) &&
+			    !strncmp(argv[i], options[n].name, eq - argv[i]))
+				break;
+		if (!eq || n == countof(options))
+			return -1;
+		*options[n].value = strtoul(eq + 1, NULL, 0);
+	}
+	if (page_size != 2048 && page_size != 4096)
+		return -1;
+	if (bench_spare != 0 && bench_spare != 64)
+		return -1;
+	if (!bench_mb || bench_mb > 100)
+		return -1;
+	return 0;
+}
+
+static void sim_main(void)
+{
+	const char *cmd = main_argc > 1 ? main_argv[1] : "test";
+
+	if (main_argc > 1 && parse_options(main_argc - 2, main_argv + 2))
+		cmd = "";
+	nand_open(NULL, page_size == 4096 ? 0x6600bcec : 0x1500aaec);
+	if (!strcmp(cmd, "test")) {
+		test_batch_read();
+		test_dmov_irq();
+		test_bbt();
+		test_translate();
+		test_stream();
+		test_sparse();
+		test_bootimg_cache();
+		test_bootimg_digest();
+		printf("%s\n", failed ? "FAILED" : "ok");
+		main_ret = failed ? 1 : 0;
+	} else if (!strcmp(cmd, "bench")) {
+		bench_nand();
+		bench_irq();
+		bench_boot();
+		bench_translate();
+		bench_stream();
+		bench_sparse();
+		bench_verify();
+	} else {
+		printf("usage: nandsim [-v] test|bench [option=value ...]\n"
+		       "  page=2048|4096 spare=0|64 bad=blocks mb=image size\n"
+		       "  dmov= tr= tprog= terase= usb= (us) bus= usbmbs= (MB/s)\n");
+		main_ret = 2;
+	}
+	nand_close();
+}
+
+int main(int argc, char **argv)
+{
+	static ucontext_t main_ctx, sim_ctx;
+	const size_t stack = 1 << 20;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) {
+		verbose = 2;
+		argc--;
+		argv++;
+	}
+	main_argc = argc;
+	main_argv = argv;
+
+	arena_init();
+	getcontext(&sim_ctx);
+	sim_ctx.uc_stack.ss_sp = sim_malloc(stack);
+	sim_ctx.uc_stack.ss_size = stack;
+	sim_ctx.uc_link = &main_ctx;
+	makecontext(&sim_ctx, sim_main, 0);
+	swapcontext(&main_ctx, &sim_ctx);
+	return main_ret;
+}
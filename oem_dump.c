@@ -0,0 +1,227 @@
+/*
+ * oem_dump.c
+ *
+ * Host side of the binary dumps (replaces oem_filter, which decoded the
+ * old hex INFO lines). Runs an oem command that stages data and reads it
+ * back with 'upload', straight from the fastboot interface:
+ *
+ *   ./oem_dump dmesg > dmesg.txt
+ *   ./oem_dump smesg > smesg.txt
+ *   ./oem_dump pwf 0x11800000 0x100000 > ram.bin
+ *   ./oem_dump stage-ptn boot > boot.img
+ *
+ * Same as 'fastboot oem <cmd>' followed by 'fastboot get_staged <file>',
+ * for fastboot binaries that predate get_staged. Linux only (usbdevfs),
+ * needs access to the device node like fastboot does.
+ *
+ *   gcc -O2 oem_dump.c -o oem_dump
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#define CHUNK		(1024 * 1024)
+#define TIMEOUT_MS	5000
+
+static int fd = -1;
+static unsigned ep_in, ep_out;
+
+static int read_hex(const char *path)
+{
+	char buf[16];
+	FILE *f = fopen(path, "r");
+	int ok;
+	unsigned v = 0;
+
+	if (f == NULL)
+		return -1;
+	ok = fgets(buf, sizeof(buf), f) != NULL && sscanf(buf, "%x", &v) == 1;
+	fclose(f);
+	return ok ? (int) v : -1;
+}
+
+static int read_dec(const char *path)
+{
+	char buf[16];
+	FILE *f = fopen(path, "r");
+	int ok;
+	int v = 0;
+
+	if (f == NULL)
+		return -1;
+	ok = fgets(buf, sizeof(buf), f) != NULL && sscanf(buf, "%d", &v) == 1;
+	fclose(f);
+	return ok ? v : -1;
+}
+
+/* find the fastboot interface (ff/42/03) and its bulk endpoints */
+static int usb_open(void)
+{
+	DIR *dir = opendir("/sys/bus/usb/devices");
+	struct dirent *d, *e;
+	char path[512], dev[64], node[64];
+	int ifc;
+
+	if (dir == NULL)
+		return -1;
+
+	while ((d = readdir(dir)) != NULL) {
+		if (strchr(d->d_name, ':') == NULL)
+			continue;
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/bInterfaceClass", d->d_name);
+		if (read_hex(path) != 0xff)
+			continue;
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/bInterfaceSubClass", d->d_name);
+		if (read_hex(path) != 0x42)
+			continue;
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/bInterfaceProtocol", d->d_name);
+		if (read_hex(path) != 0x03)
+			continue;
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/bInterfaceNumber", d->d_name);
+		ifc = read_hex(path);
+
+		/* the endpoints, ep_XX with bit 7 set is IN */
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s", d->d_name);
+		DIR *eps = opendir(path);
+		if (eps == NULL)
+			continue;
+		ep_in = ep_out = 0;
+		while ((e = readdir(eps)) != NULL) {
+			unsigned ep;
+			if (sscanf(e->d_name, "ep_%x", &ep) != 1)
+				continue;
+			if (ep & 0x80)
+				ep_in = ep;
+			else
+				ep_out = ep;
+		}
+		closedir(eps);
+		if (!ep_in || !ep_out)
+			continue;
+
+		/* the device is the interface name up to the ':' */
+		snprintf(dev, sizeof(dev), "%.*s", (int)(strchr(d->d_name, ':') - d->d_name), d->d_name);
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/busnum", dev);
+		int bus = read_dec(path);
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/devnum", dev);
+		int num = read_dec(path);
+		snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d", bus, num);
+
+		fd = open(node, O_RDWR);
+		if (fd < 0) {
+			perror(node);
+			continue;
+		}
+		if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &ifc) < 0) {
+			perror("claim interface");
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		closedir(dir);
+		return 0;
+	}
+	closedir(dir);
+	return -1;
+}
+
+static int usb_bulk(unsigned ep, void *data, unsigned len)
+{
+	struct usbdevfs_bulktransfer bulk;
+
+	bulk.ep = ep;
+	bulk.len = len;
+	bulk.timeout = TIMEOUT_MS;
+	bulk.data = data;
+	return ioctl(fd, USBDEVFS_BULK, &bulk);
+}
+
+/* print INFO lines, 0 on OKAY (or DATA, 'data' gets its size) */
+static int response(const char *cmd, unsigned *data)
+{
+	char resp[65];
+	int n;
+
+	for (;;) {
+		n = usb_bulk(ep_in, resp, 64);
+		if (n < 0) {
+			perror("response");
+			return -1;
+		}
+		resp[n] = 0;
+		if (!strncmp(resp, "INFO", 4)) {
+			fprintf(stderr, "(bootloader) %s\n", resp + 4);
+		} else if (!strncmp(resp, "OKAY", 4)) {
+			return 0;
+		} else if (!strncmp(resp, "DATA", 4) && data) {
+			*data = strtoul(resp + 4, NULL, 16);
+			return 0;
+		} else {
+			fprintf(stderr, "%s: %s\n", cmd, resp);
+			return -1;
+		}
+	}
+}
+
+static int command(const char *cmd, unsigned *data)
+{
+	if (usb_bulk(ep_out, (void *) cmd, strlen(cmd)) < 0) {
+		perror("command");
+		return -1;
+	}
+	return response(cmd, data);
+}
+
+int main(int argc, char **argv)
+{
+	char cmd[65] = "oem";
+	unsigned len, got = 0;
+	char *buf;
+	int i, n;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: oem_dump <oem command> [args] > file\n");
+		return 1;
+	}
+	for (i = 1; i < argc; i++) {
+		if (strlen(cmd) + strlen(argv[i]) + 1 >= sizeof(cmd)) {
+			fprintf(stderr, "command too long\n");
+			return 1;
+		}
+		strcat(cmd, " ");
+		strcat(cmd, argv[i]);
+	}
+
+	if (usb_open()) {
+		fprintf(stderr, "no fastboot device found\n");
+		return 1;
+	}
+
+	if (command(cmd, NULL) || command("upload", &len))
+		return 1;
+
+	buf = malloc(CHUNK);
+	if (buf == NULL)
+		return 1;
+	while (got < len) {
+		n = usb_bulk(ep_in, buf, (len - got > CHUNK) ? CHUNK : len - got);
+		if (n <= 0) {
+			perror("data");
+			return 1;
+		}
+		fwrite(buf, 1, n, stdout);
+		got += n;
+	}
+	free(buf);
+
+	if (response("upload", NULL))
+		return 1;
+	fprintf(stderr, "%u bytes\n", got);
+	return 0;
+}
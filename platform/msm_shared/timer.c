@@ -107,6 +107,14 @@ static void *timer_arg;
 static time_t timer_interval;
 
 static volatile uint32_t ticks;
+static bigtime_t hires_base;	/* gpt time when the dgt started */
+static bigtime_t hires_last;
+
+/* the gpt free runs at 32768 Hz from power up */
+static bigtime_t gpt_usecs(void)
+{
+	return ((bigtime_t) readl(GPT_COUNT_VAL) * 15625) >> 9;
+}
 
 static enum handler_return timer_irq(void *arg)
 {
@@ -137,6 +145,7 @@ status_t platform_set_periodic_timer(
 
 	writel(timer_interval * (DGT_HZ / 1000), DGT_MATCH_VAL);
 	writel(0, DGT_CLEAR);
+	hires_base = gpt_usecs();
 	writel(DGT_ENABLE_EN | DGT_ENABLE_CLR_ON_MATCH_EN, DGT_ENABLE);
 	
 	register_int_handler(INT_DEBUG_TIMER_EXP, timer_irq, 0);
@@ -146,9 +155,30 @@ status_t platform_set_periodic_timer(
 	return 0;
 }
 
+/*
+ * Microseconds since power up: the gpt until the periodic timer runs,
+ * then the tick count plus the dgt count since the last tick.
+ */
 bigtime_t current_time_hires(void)
 {
-	return (ticks * 1000ULL);
+	uint32_t t, count;
+	bigtime_t now;
+
+	if (!timer_interval)
+		return gpt_usecs();
+
+	do {
+		t = ticks;
+		count = readl(DGT_COUNT_VAL);
+	} while (t != ticks);
+
+	now = hires_base + t * 1000ULL + (count * 1000) / (DGT_HZ / 1000);
+
+	/* the count restarts before a pending match irq bumps ticks */
+	if (now < hires_last)
+		now = hires_last;
+	hires_last = now;
+	return now;
 }
 
 time_t current_time(void)
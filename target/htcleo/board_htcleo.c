@@ -21,6 +21,7 @@
 #include <bits.h>
 #include <board.h>
 #include <bootreason.h>
+#include <boottrace.h>
 #include <debug.h>
 #include <platform.h>
 #include <reg.h>
@@ -208,8 +209,10 @@ void htcleo_display_init(void)
 {
 	if (msm_microp_i2c_status) // Set brightness to a desired level
 		htcleo_panel_set_brightness((device_info.panel_brightness == 0 ? 5 : device_info.panel_brightness));
+	TRACE_BEGIN("display_init", 0);
 	struct fbcon_config *fb_conf = lcdc_init();
 	fbcon_setup(fb_conf, device_info.inverted_colors);
+	TRACE_END("display_init", 0);
 }
 
 void lcdc_shutdown(void);
@@ -274,6 +277,10 @@ static bool htcleo_usb_online(void) {
 	return htcleo_get_vbus_state();// !gpio_get(HTCLEO_GPIO_BATTERY_OVER_CHG);
 }
 
+bool htcleo_usb_cable_present(void) {
+	return htcleo_usb_online();
+}
+
 static bool htcleo_ac_online(void) {
 	return !!((readl(USB_PORTSC) & PORTSC_LS) == PORTSC_LS);
 }
@@ -640,7 +647,9 @@ static struct udc_device htcleo_udc_device[] = {
 
 void htcleo_udc_init(void)
 {
+	TRACE_BEGIN("usb_init", device_info.udc);
 	udc_init(&htcleo_udc_device[device_info.udc]);
+	TRACE_END("usb_init", 0);
 }
 
 /*******************************************************************************
@@ -990,6 +999,9 @@ void htcleo_devinfo_init(void)
 
 	flash_set_devinfo( &flash_devinfo );
 
+	// Bad block table stored behind the devinfo page
+	flash_bbt_load( ptable_find( &flash_devinfo, PTN_DEV_INF ) );
+
 	init_device();
 }
 
@@ -1122,12 +1134,16 @@ static void htcleo_init(void) {
 	htcleo_reboot_mode = target_check_reboot_mode();
 	
 	htcleo_keypad_init();
+	TRACE_POINT("flash_init");
 	htcleo_flash_info_init();
+	TRACE_POINT("devinfo_init");
 	htcleo_devinfo_init();
 	htcleo_chg_voltage_threshold = default_chg_voltage_threshold[device_info.chg_threshold];
 	htcleo_pause_for_battery_charge = (device_info.use_inbuilt_charging ? (int)((htcleo_boot_mark != MARK_BUTTON) && (htcleo_boot_mark != MARK_RESET)) : 0);
 	htcleo_acpu_clock_init();
+	TRACE_POINT("ptable_init");
 	htcleo_ptable_init();
+	TRACE_POINT("target_init_done");
 }
 
 static void htcleo_exit(void) {
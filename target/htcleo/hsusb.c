@@ -36,6 +36,9 @@
 #include <platform/interrupts.h>
 #include <platform/timer.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <arch/ops.h>
+#include <arch/defines.h>
 #include <reg.h>
 #include <pcom.h>
 #include <dev/udc.h>
@@ -108,21 +111,102 @@ unsigned udc_string_desc_alloc(const char *str)
 
 /* end of common code */
 
+/*
+ * A dTD moves up to five 4K pages. Giving each one 16K keeps that true
+ * whatever the alignment of the buffer, longer requests are a chain of
+ * them with a single completion at the end.
+ */
+#define ITEM_BYTES		(4 * 4096)
+#define MAX_ITEMS		(UDC_MAX_REQUEST / ITEM_BYTES)
+
 struct usb_request {
 	struct udc_request req;
-	struct ept_queue_item *item;
+	struct ept_queue_item *item;	/* chain of dTDs, grown as needed */
+	unsigned items;
+	unsigned used;			/* dTDs queued for this transfer */
+	struct usb_request *next;	/* queued behind this one */
 };
 
 struct udc_endpoint {
 	struct udc_endpoint *next;
 	unsigned bit;
 	struct ept_queue_head *head;
-	struct usb_request *req;
+	struct usb_request *req;	/* pending requests, oldest first */
+	timer_t retry;			/* a completion the interrupt could not see */
 	unsigned char num;
 	unsigned char in;
 	unsigned short maxpkt;
 };
 
+/*
+ * Cache maintenance around the dma: only what the direction needs, and
+ * nothing for memory that is mapped uncached (all of it, as things are).
+ */
+static void dma_sync(void *p, unsigned len)
+{
+	if (arch_range_cached((addr_t) p, len))
+		arch_clean_invalidate_cache_range((addr_t) p, len);
+}
+
+/* the controller is about to read (in) or write (out) the buffer */
+static void dma_map(void *p, unsigned len, int in)
+{
+	if (!arch_range_cached((addr_t) p, len))
+		return;
+	if (in)
+		arch_clean_cache_range((addr_t) p, len);
+	else
+		arch_invalidate_cache_range((addr_t) p, len);
+}
+
+/* the controller is done with it */
+static void dma_unmap(void *p, unsigned len, int in)
+{
+	if (!in && arch_range_cached((addr_t) p, len))
+		arch_invalidate_cache_range((addr_t) p, len);
+}
+
+/*
+ * Buffers for small transfers, cache line aligned so maintenance on
+ * one never touches its neighbours. Thread context only.
+ */
+#define UDC_BUFFERS		4
+
+static void *udc_buffers[UDC_BUFFERS];
+static unsigned udc_buffers_used;
+
+void *udc_buffer_alloc(void)
+{
+	for (unsigned n = 0; n < UDC_BUFFERS; n++) {
+		if (udc_buffers_used & (1 << n))
+			continue;
+		if (!udc_buffers[n])
+			udc_buffers[n] = memalign(CACHE_LINE, UDC_BUFFER_SIZE);
+		if (!udc_buffers[n])
+			return NULL;
+		udc_buffers_used |= (1 << n);
+		return udc_buffers[n];
+	}
+	return NULL;
+}
+
+void udc_buffer_free(void *buf)
+{
+	for (unsigned n = 0; n < UDC_BUFFERS; n++) {
+		if (udc_buffers[n] == buf)
+			udc_buffers_used &= ~(1 << n);
+	}
+}
+
+static struct udc_stats udc_stats;
+
+void udc_get_stats(struct udc_stats *stats)
+{
+	enter_critical_section();
+	*stats = udc_stats;
+	exit_critical_section();
+}
+
 struct udc_endpoint *ept_list = 0;
 struct ept_queue_head *epts = 0;
 
@@ -221,6 +305,7 @@ struct udc_endpoint *_udc_endpoint_alloc(unsigned num, unsigned in, unsigned max
 	ept->num = num;
 	ept->in = ! !in;
 	ept->req = 0;
+	timer_initialize(&ept->retry);
 
 	cfg = CONFIG_MAX_PKT(max_pkt) | CONFIG_ZLT;
 
@@ -238,7 +323,7 @@ struct udc_endpoint *_udc_endpoint_alloc(unsigned num, unsigned in, unsigned max
 	ept->next = ept_list;
 	ept_list = ept;
 
-	arch_clean_invalidate_cache_range((addr_t)ept->head, 64);
+	dma_sync(ept->head, 64);
 
 	return ept;
 }
@@ -306,81 +391,262 @@ struct udc_request *udc_request_alloc(void)
 	req->req.buf = 0;
 	req->req.length = 0;
 	req->item = memalign(32, 32);
+	req->items = 1;
+	req->used = 0;
+	req->next = 0;
 	return &req->req;
 }
 
 void udc_request_free(struct udc_request *req)
 {
+	free(((struct usb_request *)req)->item);
 	free(req);
 }
 
-int udc_request_queue(struct udc_endpoint *ept, struct udc_request *_req)
+/* fill in the dTD chain of 'req', NULL if it can not take the length */
+static struct ept_queue_item *request_build(struct usb_request *req, int in)
 {
-	struct usb_request *req = (struct usb_request *)_req;
-	struct ept_queue_item *item = req->item;
+	struct ept_queue_item *item;
 	unsigned phys = (unsigned)req->req.buf;
+	unsigned left = req->req.length;
+	unsigned count, len, n;
+
+	/* a zero length packet still takes one dTD */
+	count = (left + ITEM_BYTES - 1) / ITEM_BYTES;
+	if (count == 0)
+		count = 1;
+	if (count > MAX_ITEMS)
+		return NULL;
+
+	if (count > req->items) {
+		item = memalign(32, count * sizeof(struct ept_queue_item));
+		if (!item)
+			return NULL;
+		free(req->item);
+		req->item = item;
+		req->items = count;
+	}
 
-	item->next = TERMINATE;
-	item->info = INFO_BYTES(req->req.length) | INFO_IOC | INFO_ACTIVE;
-	item->page0 = phys;
-	item->page1 = (phys & 0xfffff000) + 0x1000;
-	item->page2 = (phys & 0xfffff000) + 0x2000;
-	item->page3 = (phys & 0xfffff000) + 0x3000;
-	item->page4 = (phys & 0xfffff000) + 0x4000;
+	for (n = 0; n < count; n++) {
+		len = (left > ITEM_BYTES) ? ITEM_BYTES : left;
+		item = &req->item[n];
+		item->next = (n + 1 < count) ? (unsigned)(item + 1) : TERMINATE;
+		item->info = INFO_BYTES(len) | INFO_ACTIVE;
+		item->page0 = phys;
+		item->page1 = (phys & 0xfffff000) + 0x1000;
+		item->page2 = (phys & 0xfffff000) + 0x2000;
+		item->page3 = (phys & 0xfffff000) + 0x3000;
+		item->page4 = (phys & 0xfffff000) + 0x4000;
+		phys += len;
+		left -= len;
+	}
+	/* only the last one interrupts */
+	item->info |= INFO_IOC;
+	req->used = count;
+	req->next = 0;
+
+	dma_map(req->req.buf, req->req.length, in);
+	dma_sync(req->item, count * sizeof(struct ept_queue_item));
+	return item;
+}
 
-	enter_critical_section();
+static void ept_prime(struct udc_endpoint *ept, struct ept_queue_item *item)
+{
 	ept->head->next = (unsigned)item;
 	ept->head->info = 0;
-	ept->req = req;
+	dma_sync(ept->head, sizeof(struct ept_queue_head));
+	writel(ept->bit, USB_ENDPTPRIME);
+}
 
-	arch_clean_invalidate_cache_range((addr_t) ept, sizeof(struct udc_endpoint));
-	arch_clean_invalidate_cache_range((addr_t) ept->head, sizeof(struct ept_queue_head));
-	arch_clean_invalidate_cache_range((addr_t) ept->req, sizeof(struct usb_request));
-	arch_clean_invalidate_cache_range((addr_t) req->req.buf, req->req.length);
-	arch_clean_invalidate_cache_range((addr_t) ept->req->item, sizeof(struct ept_queue_item));
+/* is the controller still walking the dTDs of 'ept' */
+static int ept_running(struct udc_endpoint *ept)
+{
+	unsigned stat;
 
-	writel(ept->bit, USB_ENDPTPRIME);
+	if (readl(USB_ENDPTPRIME) & ept->bit)
+		return 1;
+	do {
+		writel(readl(USB_USBCMD) | USBCMD_ATDTW, USB_USBCMD);
+		stat = readl(USB_ENDPTSTAT);
+	} while (!(readl(USB_USBCMD) & USBCMD_ATDTW));
+	writel(readl(USB_USBCMD) & ~USBCMD_ATDTW, USB_USBCMD);
+	return !!(stat & ept->bit);
+}
+
+int udc_request_queue(struct udc_endpoint *ept, struct udc_request *_req)
+{
+	struct usb_request *req = (struct usb_request *)_req;
+	struct usb_request *last;
+
+	if (!request_build(req, ept->in))
+		return -1;
+
+	enter_critical_section();
+	udc_stats.requests++;
+	udc_stats.dtds += req->used;
+	if (ept->req == 0) {
+		ept->req = req;
+		ept_prime(ept, req->item);
+	} else {
+		/* link it behind the pending ones, they may just have ended */
+		for (last = ept->req; last->next; last = last->next);
+		last->next = req;
+		last->item[last->used - 1].next = (unsigned)req->item;
+		dma_sync(&last->item[last->used - 1], sizeof(struct ept_queue_item));
+		if (!ept_running(ept)) {
+			udc_stats.reprimes++;
+			ept_prime(ept, req->item);
+		}
+	}
 	exit_critical_section();
 	return 0;
 }
 
-static void handle_ept_complete(struct udc_endpoint *ept)
+int udc_request_cancel(struct udc_endpoint *ept, struct udc_request *_req)
 {
-	struct ept_queue_item *item;
-	unsigned actual;
-	int status;
-	struct usb_request *req;
+	struct usb_request *req = (struct usb_request *)_req;
+	struct usb_request **p, *last;
+	unsigned n;
+
+	enter_critical_section();
+	for (p = &ept->req; *p && *p != req; p = &(*p)->next);
+	if (*p == 0) {
+		exit_critical_section();
+		return -1;
+	}
+	*p = 0;
+
+	do {
+		writel(ept->bit, USB_ENDPTFLUSH);
+		while (readl(USB_ENDPTFLUSH) & ept->bit);
+	} while (readl(USB_ENDPTSTAT) & ept->bit);
+
+	/* carry on with what is left ahead of it */
+	if (ept->req) {
+		for (last = ept->req; last->next; last = last->next);
+		last->item[last->used - 1].next = TERMINATE;
+		for (last = ept->req; last; last = last->next) {
+			for (n = 0; n < last->used; n++) {
+				if (last->item[n].info & INFO_ACTIVE) {
+					ept_prime(ept, &last->item[n]);
+					exit_critical_section();
+					return 0;
+				}
+			}
+		}
+	}
+	exit_critical_section();
+	return 0;
+}
+
+/* the controller finished the last dTD of 'req', or went on to a later request */
+static int request_passed(struct udc_endpoint *ept, struct usb_request *req)
+{
+	struct ept_queue_item *item = &req->item[req->used - 1];
+	unsigned current;
+	struct usb_request *r;
+
+	dma_sync(ept->head, sizeof(struct ept_queue_head));
+	current = readl(&ept->head->current);
+	for (r = req->next; r; r = r->next) {
+		if (current >= (unsigned)r->item && current < (unsigned)(r->item + r->used))
+			return 1;
+	}
+	return current == (unsigned)item && !(readl(&ept->head->info) & INFO_ACTIVE);
+}
 
-	arch_clean_invalidate_cache_range((addr_t) ept, sizeof(struct udc_endpoint));
-	arch_clean_invalidate_cache_range((addr_t) ept->req, sizeof(struct usb_request));
+/*
+ * 1 if the last dTD of 'req' retired, 0 if the controller has not got
+ * there yet, -1 if it has but the dTD still reads active
+ */
+static int request_done(struct udc_endpoint *ept, struct usb_request *req)
+{
+	struct ept_queue_item *item = &req->item[req->used - 1];
+	unsigned spin = 100000;
 
-	req = ept->req;
-	if (req) {
-		ept->req = 0;
+	dma_sync(item, sizeof(struct ept_queue_item));
+	if (!(readl(&(item->info)) & INFO_ACTIVE))
+		return 1;
 
-		item = req->item;
+	/* For some reason we are getting the notification for
+	 * transfer completion before the active bit has cleared.
+	 * HACK: wait for the ACTIVE bit to clear, but only once the
+	 * queue head shows the controller is past this dTD; an
+	 * interrupt for a request an earlier pass completed must not
+	 * spin on the next one. Not forever, the timer does not tick
+	 * in here.
+	 */
+	if (!request_passed(ept, req))
+		return 0;
+	do
+	{
+		dma_sync(item, sizeof(struct ept_queue_item));
+		if (!(readl(&(item->info)) & INFO_ACTIVE))
+			return 1;
+	} while (--spin);
+	return -1;
+}
 
-		/* For some reason we are getting the notification for
-		 * transfer completion before the active bit has cleared.
-		 * HACK: wait for the ACTIVE bit to clear:
-		 */
-		do
-		{
-			arch_clean_invalidate_cache_range((addr_t) item, sizeof(struct ept_queue_item));
-		} while (readl(&(item->info)) & INFO_ACTIVE);
+static void handle_ept_complete(struct udc_endpoint *ept);
+
+static enum handler_return ept_retry(struct timer *timer, time_t now, void *arg)
+{
+	handle_ept_complete(arg);
+	return INT_RESCHEDULE;
+}
 
-		arch_clean_invalidate_cache_range((addr_t) req->req.buf, req->req.length);
+static void handle_ept_complete(struct udc_endpoint *ept)
+{
+	struct ept_queue_item *item;
+	unsigned actual, left, len, n;
+	int status, done = 0;
+	struct usb_request *req;
 
-		if (item->info & 0xff) {
-			actual = 0;
-			status = -1;
+	/* the interrupt is for the first one, others may be done as well */
+	while ((req = ept->req) && (done = request_done(ept, req)) > 0) {
+		ept->req = req->next;
+
+		dma_unmap(req->req.buf, req->req.length, ept->in);
+
+		actual = 0;
+		status = 0;
+		left = req->req.length;
+		dma_sync(req->item, req->used * sizeof(struct ept_queue_item));
+		for (n = 0; n < req->used; n++) {
+			item = &req->item[n];
+			len = (left > ITEM_BYTES) ? ITEM_BYTES : left;
+			if (item->info & 0xff) {
+				actual = 0;
+				status = -1;
+				break;
+			}
+			actual += len - ((item->info >> 16) & 0x7fff);
+			/* a short packet ends the transfer */
+			if ((item->info >> 16) & 0x7fff)
+				break;
+			left -= len;
+		}
+		if (status) {
+			udc_stats.errors++;
+		} else if (ept->in) {
+			udc_stats.bytes_in += actual;
 		} else {
-			actual = req->req.length - ((item->info >> 16) & 0x7fff);
-			status = 0;
+			udc_stats.bytes_out += actual;
+			/* the host had data and nowhere to put it since the last one */
+			if (readl(USB_ENDPTNAK) & ept->bit) {
+				udc_stats.naks++;
+				writel(ept->bit, USB_ENDPTNAK);
+			}
 		}
 		if (req->req.complete)
 			req->req.complete(&req->req, actual, status);
 	}
+
+	/* no interrupt is coming for it any more, look again on the next tick */
+	if (req && done < 0) {
+		udc_stats.retries++;
+		timer_set_oneshot(&ept->retry, 1, ept_retry, ept);
+	}
 }
 
 static const char *reqname(unsigned r)
@@ -435,10 +701,16 @@ static void handle_setup(struct udc_endpoint *ept)
 {
 	struct setup_packet s;
 
-	arch_clean_invalidate_cache_range((addr_t) ept->head->setup_data, sizeof(struct ept_queue_head));
+	dma_sync(ept->head, sizeof(struct ept_queue_head));
 	memcpy(&s, ept->head->setup_data, sizeof(s));
 	writel(ept->bit, USB_ENDPTSETUPSTAT);
 
+	/* a new setup ends whatever the last one left queued */
+	if (ep0in->req)
+		udc_request_cancel(ep0in, &ep0in->req->req);
+	if (ep0out->req)
+		udc_request_cancel(ep0out, &ep0out->req->req);
+
 	switch (SETUP(s.type, s.request)) {
 		case SETUP(DEVICE_READ, GET_STATUS):
 		{
@@ -761,7 +1033,7 @@ int udc_init(struct udc_device *dev) {
 	ep0out = _udc_endpoint_alloc(0, 0, 64);
 	ep0in = _udc_endpoint_alloc(0, 1, 64);
 	ep0req = udc_request_alloc();
-	ep0req->buf = malloc(4096);
+	ep0req->buf = udc_buffer_alloc();
 
 	{
 		/* create and register a language table descriptor */
@@ -789,6 +1061,7 @@ enum handler_return udc_interrupt(void *arg)
 		return ret;
 
 	if (n & STS_URI) {
+		udc_stats.resets++;
 		writel(readl(USB_ENDPTCOMPLETE), USB_ENDPTCOMPLETE);
 		writel(readl(USB_ENDPTSETUPSTAT), USB_ENDPTSETUPSTAT);
 		writel(0xffffffff, USB_ENDPTFLUSH);
@@ -802,8 +1075,11 @@ enum handler_return udc_interrupt(void *arg)
 			/* ensure that ept_complete considers
 			 * this to be an error state
 			 */
+			for (struct usb_request *r = ept->req; r; r = r->next) {
+				for (unsigned i = 0; i < r->used; i++)
+					r->item[i].info = INFO_HALTED;
+			}
 			if (ept->req) {
-				ept->req->item->info = INFO_HALTED;
 				handle_ept_complete(ept);
 			}
 		}
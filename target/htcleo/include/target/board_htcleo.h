@@ -98,6 +98,7 @@ void htcleo_display_init(void);
 void htcleo_display_shutdown(void);
 void htcleo_usb_init(void);
 void htcleo_udc_init(void);
+bool htcleo_usb_cable_present(void);
 void htcleo_keypad_init(void);
 void htcleo_flash_info_init(void);
 void htcleo_devinfo_init(void);
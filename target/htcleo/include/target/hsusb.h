@@ -42,6 +42,7 @@
 
 #define USBCMD_RESET   2
 #define USBCMD_ATTACH  1
+#define USBCMD_ATDTW   (1 << 14)	/* add dTD tripwire */
 
 #define USBMODE_DEVICE 2
 #define USBMODE_HOST   3
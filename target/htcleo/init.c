@@ -91,6 +91,23 @@ unsigned target_check_reboot_mode(void)
 	return android_reboot_reason;
 }
 
+void target_save_boot_time(unsigned ms, unsigned path)
+{
+	writel(ms, LK_BOOTTIME_ADDR);
+	writel(path, LK_BOOTTIME_ADDR + 4);
+	writel(ms ^ path ^ MARK_TIME_TAG, LK_BOOTTIME_ADDR + 8);
+}
+
+int target_last_boot_time(unsigned *ms, unsigned *path)
+{
+	*ms = readl(LK_BOOTTIME_ADDR);
+	*path = readl(LK_BOOTTIME_ADDR + 4);
+	if (readl(LK_BOOTTIME_ADDR + 8) != (*ms ^ *path ^ MARK_TIME_TAG))
+		return -1;
+	writel(0, LK_BOOTTIME_ADDR + 8);
+	return 0;
+}
+
 unsigned target_pause_for_battery_charge(void)
 {
     if (get_boot_reason() == 2) 
@@ -28,6 +28,7 @@
  */
 
 #include <debug.h>
+#include <boottrace.h>
 #include <reg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +37,12 @@
 #include <target/nand.h>
 #include <dmov.h>
 #include <platform/timer.h>
+#include <platform/interrupts.h>
+#include <platform/irqs.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <crc32.h>
 
 #define VERBOSE 0
 #define VERIFY_WRITE 0
@@ -45,24 +52,6 @@
 static void *flash_spare;
 static void *flash_data;
 
-typedef struct dmov_ch dmov_ch;
-
-struct dmov_ch
-{
-	volatile unsigned cmd;
-	volatile unsigned result;
-	volatile unsigned status;
-	volatile unsigned config;
-};
-
-static void dmov_prep_ch(dmov_ch *ch, unsigned id)
-{
-	ch->cmd = DMOV_CMD_PTR(id);
-	ch->result = DMOV_RSLT(id);
-	ch->status = DMOV_STATUS(id);
-	ch->config = DMOV_CONFIG(id);
-}
-
 #define SRC_CRCI_NAND_CMD  CMD_SRC_CRCI(DMOV_NAND_CRCI_CMD)
 #define DST_CRCI_NAND_CMD  CMD_DST_CRCI(DMOV_NAND_CRCI_CMD)
 #define SRC_CRCI_NAND_DATA CMD_SRC_CRCI(DMOV_NAND_CRCI_DATA)
@@ -79,35 +68,145 @@ extern void dmb(void);
 
 #define paddr(n) ((unsigned) (n))
 
-static int dmov_exec_cmdptr(unsigned id, unsigned *ptr)
+/* Data mover requests are asynchronous: the command pointer is handed
+ * to the channel with IRQ_EN set and the ADM interrupt completes the
+ * request and wakes the submitter, so the CPU is free for the fbcon,
+ * USB and key threads while the NAND controller works. Before the
+ * interrupt is hooked up, or when called with interrupts held off,
+ * the request falls back to polling the channel status.
+ */
+#define DMOV_MAX_CHAN 16
+
+struct dmov_req {
+	unsigned id;
+	int irq;
+	volatile int busy;
+	int result;
+	unsigned rslt;
+	event_t done;
+};
+
+static struct dmov_req *dmov_active[DMOV_MAX_CHAN];
+static int dmov_irq_enabled = 0;
+
+/* drain the result fifo, returns -1 if any command did not complete */
+static int dmov_collect(unsigned id, unsigned *rslt)
 {
-	dmov_ch ch;
 	unsigned n;
+	int err = 0;
 
-	dmov_prep_ch(&ch, id);
+	n = readl(DMOV_STATUS(id));
+	while(DMOV_STATUS_RSLT_COUNT(n)) {
+		n = readl(DMOV_RSLT(id));
+		if((n != 0x80000002) && !err) {
+			*rslt = n;
+			err = -1;
+		}
+		n = readl(DMOV_STATUS(id));
+	}
+	return err;
+}
 
-	/* Set IRQ_EN low, not using IRQ mode */
-	writel(DMOV_CONFIG_FOREC_FLUSH_RSLT | 0x0, ch.config);
+static enum handler_return dmov_irq(void *arg)
+{
+	enum handler_return ret = INT_NO_RESCHEDULE;
+	unsigned isr = readl(DMOV_ISR);
+	unsigned id;
 
-	writel(DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(paddr(ptr)), ch.cmd);
+	for(id = 0; id < DMOV_MAX_CHAN; id++) {
+		struct dmov_req *req = dmov_active[id];
 
-	while(!(readl(ch.status) & DMOV_STATUS_RSLT_VALID)) ;
+		if(!(isr & (1 << id)) || !req)
+			continue;
+		if(!(readl(DMOV_STATUS(id)) & DMOV_STATUS_RSLT_VALID))
+			continue;
 
-	n = readl(ch.status);
-	while(DMOV_STATUS_RSLT_COUNT(n)) {
-		n = readl(ch.result);
-		if(n != 0x80000002) {
-			dprintf(CRITICAL, "   ERROR: result: %x\n", n);
-			dprintf(CRITICAL, "   ERROR:  flush: %x %x %x %x\n",
-				readl(DMOV_FLUSH0(DMOV_NAND_CHAN)),
-				readl(DMOV_FLUSH1(DMOV_NAND_CHAN)),
-				readl(DMOV_FLUSH2(DMOV_NAND_CHAN)),
-				readl(DMOV_FLUSH3(DMOV_NAND_CHAN)));
-			return -1;
-		}
-		n = readl(ch.status);
+		req->result = dmov_collect(id, &req->rslt);
+		/* leave the channel with IRQ_EN low, the kernel expects that */
+		writel(DMOV_CONFIG_FOREC_FLUSH_RSLT | 0x0, DMOV_CONFIG(id));
+		dmov_active[id] = NULL;
+		req->busy = 0;
+		event_signal(&req->done, false);
+		ret = INT_RESCHEDULE;
 	}
-	return 0;
+	return ret;
+}
+
+static void dmov_init(void)
+{
+	enter_critical_section();
+	register_int_handler(INT_ADM_AARM, dmov_irq, NULL);
+	unmask_interrupt(INT_ADM_AARM);
+	dmov_irq_enabled = 1;
+	exit_critical_section();
+}
+
+/* counters since boot, see flash_get_stats() */
+static struct flash_stats flash_stats;
+
+/* bumped whenever partition contents may change */
+static unsigned flash_gen;
+
+/* bumped whenever the set of known bad blocks changes */
+static unsigned flash_bbt_gen = 0;
+
+static void dmov_submit(struct dmov_req *req, unsigned id, unsigned *ptr)
+{
+	ASSERT(id < DMOV_MAX_CHAN);
+
+	req->id = id;
+	req->result = 0;
+	req->rslt = 0;
+	req->busy = 1;
+	req->irq = dmov_irq_enabled && !in_critical_section();
+	flash_stats.dmov_submits++;
+
+	/* make sure the command lists hit memory before the kick */
+	dsb();
+
+	if(req->irq) {
+		event_init(&req->done, false, EVENT_FLAG_AUTOUNSIGNAL);
+		enter_critical_section();
+		ASSERT(dmov_active[id] == NULL);
+		dmov_active[id] = req;
+		writel(DMOV_CONFIG_FOREC_FLUSH_RSLT | DMOV_CONFIG_IRQ_EN, DMOV_CONFIG(id));
+		writel(DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(paddr(ptr)), DMOV_CMD_PTR(id));
+		exit_critical_section();
+	} else {
+		/* Set IRQ_EN low, not using IRQ mode */
+		writel(DMOV_CONFIG_FOREC_FLUSH_RSLT | 0x0, DMOV_CONFIG(id));
+		writel(DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(paddr(ptr)), DMOV_CMD_PTR(id));
+	}
+}
+
+static int dmov_wait(struct dmov_req *req)
+{
+	if(req->irq) {
+		event_wait(&req->done);
+		event_destroy(&req->done);
+	} else {
+		while(!(readl(DMOV_STATUS(req->id)) & DMOV_STATUS_RSLT_VALID)) ;
+		req->result = dmov_collect(req->id, &req->rslt);
+		req->busy = 0;
+	}
+
+	if(req->result) {
+		dprintf(CRITICAL, "   ERROR: result: %x\n", req->rslt);
+		dprintf(CRITICAL, "   ERROR:  flush: %x %x %x %x\n",
+			readl(DMOV_FLUSH0(req->id)),
+			readl(DMOV_FLUSH1(req->id)),
+			readl(DMOV_FLUSH2(req->id)),
+			readl(DMOV_FLUSH3(req->id)));
+	}
+	return req->result;
+}
+
+static int dmov_exec_cmdptr(unsigned id, unsigned *ptr)
+{
+	struct dmov_req req;
+
+	dmov_submit(&req, id, ptr);
+	return dmov_wait(&req);
 }
 
 static struct flash_info flash_info;
@@ -329,14 +428,9 @@ static int flash_nand_block_isbad(	dmov_s *cmdlist,
 	return 0;
 }
 
-static int flash_nand_erase_block(dmov_s *cmdlist,
-								  unsigned *ptrlist,
-								  unsigned page)
+/* can the block holding 'page' be erased, says why not if it can't */
+static int flash_nand_erase_check(dmov_s *cmdlist, unsigned *ptrlist, unsigned page)
 {
-	dmov_s *cmd = cmdlist;
-	unsigned *ptr = ptrlist;
-	unsigned *data = ptrlist + 4;
-	
 	if (page < (NUM_PROTECTED_BLOCKS<<6))
 	{
 		printf("\n   Skipping block @%d [%dMB], (PROTECTED block)", (page >> 6), (page >> 9));
@@ -365,6 +459,15 @@ static int flash_nand_erase_block(dmov_s *cmdlist,
 			return -1;
 		}
 	}
+	return 0;
+}
+
+#define FLASH_ERASE_CMDS	6
+#define FLASH_ERASE_DATA	10
+
+/* build the command list erasing one block, data needs FLASH_ERASE_DATA words */
+static void flash_nand_build_erase(dmov_s *cmd, unsigned *data, unsigned page)
+{
 	/* Erase block */
 	data[0] = NAND_CMD_BLOCK_ERASE;
 	data[1] = page;
@@ -406,12 +509,10 @@ static int flash_nand_erase_block(dmov_s *cmdlist,
 	cmd[5].src = paddr(&data[9]);
 	cmd[5].dst = NAND_READ_STATUS;
 	cmd[5].len = 4;
+}
 
-	ptr[0] = (paddr(cmd) >> 3) | CMD_PTR_LP;
-
-	dmov_exec_cmdptr(DMOV_NAND_CHAN, ptr);
-	//dmb();
-	
+static int flash_nand_erase_status(unsigned *data, unsigned page)
+{
 #if VERBOSE
 	dprintf(INFO, "   Status: %x\n", data[5]);
 #endif
@@ -433,10 +534,39 @@ static int flash_nand_erase_block(dmov_s *cmdlist,
 		printf("\n   Skipping block @%d [%dMB], (SUCCESS BIT NOT SET)", (page >> 6), (page >> 9));
 		err=-1;
 	}
+	if (!err)
+		flash_stats.blocks_erased++;
 
 	return err;
 }
 
+static int flash_nand_erase_block(dmov_s *cmdlist,
+								  unsigned *ptrlist,
+								  unsigned page)
+{
+	dmov_s *cmd = cmdlist;
+	unsigned *ptr = ptrlist;
+	unsigned *data = ptrlist + 4;
+	
+	if (flash_nand_erase_check(cmdlist, ptrlist, page))
+		return -1;
+
+	flash_nand_build_erase(cmd, data, page);
+
+	ptr[0] = (paddr(cmd) >> 3) | CMD_PTR_LP;
+
+	dmov_exec_cmdptr(DMOV_NAND_CHAN, ptr);
+	//dmb();
+	
+	return flash_nand_erase_status(data, page);
+}
+
+/* controller status of one codeword */
+struct flash_cw_result {
+	unsigned flash_status;
+	unsigned buffer_status;
+};
+
 struct data_flash_io {
 	unsigned cmd;
 	unsigned addr0;
@@ -449,12 +579,62 @@ struct data_flash_io {
 	unsigned ecc_cfg_save;
 	unsigned clrfstatus;
 	unsigned clrrstatus;
-	struct {
-		unsigned flash_status;
-		unsigned buffer_status;
-	} result[8];
+	struct flash_cw_result result[8];
 };
 
+/* without a table, each block is probed once rather than for every page */
+static unsigned flash_probed_block = ~0U;
+static unsigned flash_probed_gen;
+static int flash_probed_bad;
+
+static int flash_nand_page_in_bad_block(dmov_s *cmdlist, unsigned *ptrlist, unsigned page)
+{
+	if(flash_bad_blocks == -1) {
+		//block_tbl is not created
+		if (flash_probed_block != (page >> 6) || flash_probed_gen != flash_bbt_gen) {
+			flash_probed_bad = flash_nand_block_isbad(cmdlist, ptrlist, page);
+			flash_probed_block = page >> 6;
+			flash_probed_gen = flash_bbt_gen;
+		}
+		return flash_probed_bad;
+	}
+	//block_tbl is created
+	return ((int)block_tbl.block_status[(page >> 6)] > 0);
+}
+
+/* An erased page has no valid ECC, the controller reports an operation
+ * error reading it. Like msm_nand, call the page erased when all of it,
+ * spare included, reads 0xff (erased codewords read 0x54 at byte 3) and
+ * hand it out as 0xff, pages left blank by a write read back like the
+ * 0xff pages they stand for.
+ */
+static int flash_nand_page_erased(const struct flash_cw_result *result,
+				  unsigned char *data, const unsigned char *spare)
+{
+	unsigned cwperpage = (flash_pagesize >> 9);
+	unsigned cwdatasize = flash_pagesize / cwperpage;
+	unsigned n, i;
+
+	for(n = 0; n < cwperpage; n++) {
+		/* a protection violation is a real error */
+		if (result[n].flash_status & 0x100)
+			return 0;
+		for(i = 0; i < cwdatasize; i++) {
+			unsigned char c = data[n * cwdatasize + i];
+			if (c != 0xff && !(i == 3 && c == 0x54))
+				return 0;
+		}
+	}
+	for(i = 0; i < 16; i++)
+		if (spare[i] != 0xff)
+			return 0;
+
+	for(n = 0; n < cwperpage; n++)
+		data[n * cwdatasize + 3] = 0xff;
+	flash_stats.pages_erased++;
+	return 1;
+}
+
 static int _flash_nand_read_page(dmov_s *cmdlist,
 				 unsigned *ptrlist,
 				 unsigned page,
@@ -475,16 +655,8 @@ static int _flash_nand_read_page(dmov_s *cmdlist,
 	cwoobsize = /*oobavail*/ 16 / cwperpage; //spare size - ecc size (64 - 4*10)
 	int err=0;
 
-	if(flash_bad_blocks == -1) {
-		//block_tbl is not created
-		if (flash_nand_block_isbad(cmdlist, ptrlist, page))
-			return -2;
-	} else {
-		//block_tbl is created
-		if((int)block_tbl.block_status[(page >> 6)] > 0) {
-			return -2;
-		}
-	}
+	if (flash_nand_page_in_bad_block(cmdlist, ptrlist, page))
+		return -2;
 	
 	data->cmd = NAND_CMD_PAGE_READ_ALL;
 	data->addr0 = page << 16;
@@ -593,25 +765,217 @@ static int _flash_nand_read_page(dmov_s *cmdlist,
 			break;
 		}
 	}
+	if (err && flash_nand_page_erased(data->result,
+					  (unsigned char*) addr, (unsigned char*) spareaddr))
+		err = 0;
+	if (!err)
+		flash_stats.pages_read++;
 
 	return err;
 }
 
-static int _flash_nand_write_page(dmov_s *cmdlist,
-				  unsigned *ptrlist,
-				  unsigned page,
-				  const void *_addr,
-				  const void *_spareaddr,
-				  unsigned raw_mode)
+/* batched page read: a whole run of pages inside one good block is
+ * described by a single command list and handed to the data mover
+ * in one go, so we only pay one DMOV round trip per run.
+ */
+struct data_flash_batch_page {
+	unsigned cmd;
+	unsigned addr0;
+	unsigned addr1;
+	unsigned chipsel;
+	struct flash_cw_result result[8];
+};
+
+struct data_flash_batch {
+	unsigned cfg0;
+	unsigned cfg1;
+	unsigned exec;
+	unsigned ecc_cfg;
+	unsigned ecc_cfg_save;
+	unsigned reserved[3];
+	struct data_flash_batch_page page[0];
+};
+
+static dmov_s *flash_batch_cmdlist;
+static unsigned *flash_batch_ptrlist;
+static struct data_flash_batch *flash_batch_data;
+static unsigned char *flash_batch_spare;
+static unsigned flash_batch_pages = 0;
+
+static unsigned flash_batch_cmdlist_size(unsigned pages)
 {
-	if( page < (NUM_PROTECTED_BLOCKS<<6) ){
-		dprintf(INFO, "\n   Write disabled block %x is protected", (page>>6));
+	unsigned cwperpage = (flash_pagesize >> 9);
+
+	/* save/set/restore ecc cfg + per page: cmd burst, cfg and
+	 * exec/status/data/spare for every codeword (plus cmd for cw>0)
+	 */
+	return (3 + pages * (1 + 5 * cwperpage)) * sizeof(dmov_s);
+}
+
+static struct dmov_req flash_batch_req;
+
+/* queue a batched read, nothing else may touch the flash until
+ * flash_nand_read_pages_finish() collected it
+ */
+static void flash_nand_read_pages_start(unsigned page, unsigned count,
+					unsigned char *image, unsigned extra_per_page)
+{
+	dmov_s *cmd = flash_batch_cmdlist;
+	unsigned *ptr = flash_batch_ptrlist;
+	struct data_flash_batch *data = flash_batch_data;
+	unsigned wsize = flash_pagesize + extra_per_page;
+	unsigned spare_stride = flash_info.spare_size;
+	unsigned n, i;
+	unsigned cwperpage;
+	unsigned cwdatasize;
+	unsigned cwoobsize;
+	cwperpage = (flash_pagesize >> 9);
+	cwdatasize = flash_pagesize/cwperpage;
+	cwoobsize = /*oobavail*/ 16 / cwperpage; //spare size - ecc size (64 - 4*10)
+
+	ASSERT(count <= flash_batch_pages);
+
+	data->cfg0 = (CFG0 & ~(7U << 6)) | ((cwperpage-1) << 6);
+	data->cfg1 = CFG1;
+	data->exec = 1;
+	data->ecc_cfg = 0x1FF;
+
+	/* save existing ecc config */
+	cmd->cmd = CMD_OCB;
+	cmd->src = NAND_EBI2_ECC_BUF_CFG;
+	cmd->dst = paddr(&data->ecc_cfg_save);
+	cmd->len = 4;
+	cmd++;
+
+	/* set our ecc config */
+	cmd->cmd = 0;
+	cmd->src = paddr(&data->ecc_cfg);
+	cmd->dst = NAND_EBI2_ECC_BUF_CFG;
+	cmd->len = 4;
+	cmd++;
+
+	for(i = 0; i < count; i++) {
+		struct data_flash_batch_page *pg = &data->page[i];
+		unsigned addr = (unsigned) (image + i * wsize);
+		unsigned spareaddr = (unsigned) (flash_batch_spare + i * spare_stride);
+
+		pg->cmd = NAND_CMD_PAGE_READ_ALL;
+		pg->addr0 = (page + i) << 16;
+		pg->addr1 = ((page + i) >> 16) & 0xff;
+		pg->chipsel = 0 | 4; /* flash0 + undoc bit */
+
+		for(n = 0; n < cwperpage; n++) {
+			/* write CMD / ADDR0 / ADDR1 / CHIPSEL regs in a burst */
+			cmd->cmd = DST_CRCI_NAND_CMD;
+			cmd->src = paddr(&pg->cmd);
+			cmd->dst = NAND_FLASH_CMD;
+			cmd->len = ((n == 0) ? 16 : 4);
+			cmd++;
+
+			if (n == 0) {
+				/* block on cmd ready, set configuration */
+				cmd->cmd = 0;
+				cmd->src = paddr(&data->cfg0);
+				cmd->dst = NAND_DEV0_CFG0;
+				cmd->len = 8;
+				cmd++;
+			}
+			/* kick the execute register */
+			cmd->cmd = 0;
+			cmd->src = paddr(&data->exec);
+			cmd->dst = NAND_EXEC_CMD;
+			cmd->len = 4;
+			cmd++;
+
+			/* block on data ready, then read the status register */
+			cmd->cmd = SRC_CRCI_NAND_DATA;
+			cmd->src = NAND_FLASH_STATUS;
+			cmd->dst = paddr(&pg->result[n]);
+			cmd->len = 8;
+			cmd++;
+
+			/* read data block */
+			cmd->cmd = 0;
+			cmd->src = NAND_FLASH_BUFFER;
+			cmd->dst = addr + n * cwdatasize;
+			cmd->len = cwdatasize;
+			cmd++;
+
+			/* read extra data */
+			cmd->cmd = 0;
+			cmd->src = NAND_FLASH_BUFFER + cwdatasize + 10; // adter data and 10 bytes of ECC
+			cmd->dst = spareaddr + n*cwoobsize;
+			cmd->len = cwoobsize;
+			cmd++;
+		}
+	}
+
+	/* restore saved ecc config */
+	cmd->cmd = CMD_OCU | CMD_LC;
+	cmd->src = paddr(&data->ecc_cfg_save);
+	cmd->dst = NAND_EBI2_ECC_BUF_CFG;
+	cmd->len = 4;
+
+	ptr[0] = (paddr(flash_batch_cmdlist) >> 3) | CMD_PTR_LP;
+
+	dmov_submit(&flash_batch_req, DMOV_NAND_CHAN, ptr);
+}
+
+/* Returns the number of pages read successfully (in order) before the
+ * first page reporting an error, or -1 if the data mover failed.
+ */
+static int flash_nand_read_pages_finish(unsigned page, unsigned count,
+					unsigned char *image, unsigned extra_per_page)
+{
+	struct data_flash_batch *data = flash_batch_data;
+	unsigned wsize = flash_pagesize + extra_per_page;
+	unsigned spare_stride = flash_info.spare_size;
+	unsigned cwperpage = (flash_pagesize >> 9);
+	unsigned n, i;
+
+	if(dmov_wait(&flash_batch_req) != 0) {
+		dprintf(INFO, "   Read pages failed %x+%d (block %x)\n", page, count, page>>6);
 		return -1;
 	}
-	int err=0;
+
+	/* same rules as the single page read: any codeword reporting an
+	 * operation error (0x10) or a protection violation (0x100) fails
+	 * the page unless it is erased, everything in front of it is good.
+	 */
+	for(i = 0; i < count; i++) {
+		for(n = 0; n < cwperpage; n++) {
+			if (data->page[i].result[n].flash_status & 0x110)
+				break;
+		}
+		if (n < cwperpage
+			&& !flash_nand_page_erased(data->page[i].result,
+						   image + i * wsize, flash_batch_spare + i * spare_stride))
+			return i;
+		flash_stats.pages_read++;
+		if (extra_per_page)
+			memcpy(image + i * wsize + flash_pagesize,
+				   flash_batch_spare + i * spare_stride, extra_per_page);
+	}
+
+	return count;
+}
+
+static int _flash_nand_read_pages(unsigned page, unsigned count,
+				  unsigned char *image, unsigned extra_per_page)
+{
+	flash_nand_read_pages_start(page, count, image, extra_per_page);
+	return flash_nand_read_pages_finish(page, count, image, extra_per_page);
+}
+
+/* build the command list programming one page */
+static void flash_nand_build_write(dmov_s *cmdlist,
+				   struct data_flash_io *data,
+				   unsigned page,
+				   const void *_addr,
+				   const void *_spareaddr,
+				   unsigned raw_mode)
+{
 	dmov_s *cmd = cmdlist;
-	unsigned *ptr = ptrlist;
-	struct data_flash_io *data = (void*) (ptrlist + 4);
 	unsigned addr = (unsigned) _addr;
 	unsigned spareaddr = (unsigned) _spareaddr;
 	unsigned n;
@@ -726,50 +1090,74 @@ static int _flash_nand_write_page(dmov_s *cmdlist,
 	cmd->src = paddr(&data->ecc_cfg_save);
 	cmd->dst = NAND_EBI2_ECC_BUF_CFG;
 	cmd->len = 4;
+}
 
-	ptr[0] = (paddr(cmdlist) >> 3) | CMD_PTR_LP;
-
-	dmov_exec_cmdptr(DMOV_NAND_CHAN, ptr);
-
-#if VERBOSE
-	dprintf(INFO, "\n   Write page %d: status: %x %x %x %x",
-		page, data[5], data[6], data[7], data[8]);
-#endif
+static int flash_nand_write_status(struct data_flash_io *data)
+{
+	unsigned cwperpage = (flash_pagesize >> 9);
+	unsigned n;
 
 	/* if any of the writes failed (0x10), or there was a
 	 * protection violation (0x100), or the program success
 	 * bit (0x80) is unset, we lose
 	 */
 	for(n = 0; n < cwperpage; n++) {
-		if(data->result[n].flash_status & 0x110){
-			err=-1;
-			break;
-		}
-		if(!(data->result[n].flash_status & 0x80)){
-			err=-1;
-			break;
-		}
-	}
-
-#if VERIFY_WRITE
-	if( _flash_read_page(cmdlist, ptrlist, page, flash_data, flash_data + 2048) != 0 ){
-		err=-1;
-	}
-	if( memcmp(flash_data, _addr, 2048) || memcmp(flash_data + 2048, _spareaddr, 16) ){
-		dprintf(CRITICAL, "   Verify error @ page %d\n", page);
-		err=-1;
+		if(data->result[n].flash_status & 0x110)
+			return -1;
+		if(!(data->result[n].flash_status & 0x80))
+			return -1;
 	}
-#endif
-	return err;
+	return 0;
 }
 
-char empty_buf[528];
-
-static int flash_nand_mark_badblock(dmov_s *cmdlist, unsigned *ptrlist, unsigned page)
+static int _flash_nand_write_page(dmov_s *cmdlist,
+				  unsigned *ptrlist,
+				  unsigned page,
+				  const void *_addr,
+				  const void *_spareaddr,
+				  unsigned raw_mode)
 {
-	if( page < (NUM_PROTECTED_BLOCKS<<6) ) {
-		dprintf(INFO, "\n   Protected block %x cannot be marked BAD", (page>>6));
-		return -1;
+	if( page < (NUM_PROTECTED_BLOCKS<<6) ){
+		dprintf(INFO, "\n   Write disabled block %x is protected", (page>>6));
+		return -1;
+	}
+	int err=0;
+	unsigned *ptr = ptrlist;
+	struct data_flash_io *data = (void*) (ptrlist + 4);
+
+	flash_nand_build_write(cmdlist, data, page, _addr, _spareaddr, raw_mode);
+
+	ptr[0] = (paddr(cmdlist) >> 3) | CMD_PTR_LP;
+
+	dmov_exec_cmdptr(DMOV_NAND_CHAN, ptr);
+
+#if VERBOSE
+	dprintf(INFO, "\n   Write page %d: status: %x %x %x %x",
+		page, data->result[0].flash_status, data->result[1].flash_status,
+		data->result[2].flash_status, data->result[3].flash_status);
+#endif
+
+	err = flash_nand_write_status(data);
+
+#if VERIFY_WRITE
+	if( _flash_read_page(cmdlist, ptrlist, page, flash_data, flash_data + 2048) != 0 ){
+		err=-1;
+	}
+	if( memcmp(flash_data, _addr, 2048) || memcmp(flash_data + 2048, _spareaddr, 16) ){
+		dprintf(CRITICAL, "   Verify error @ page %d\n", page);
+		err=-1;
+	}
+#endif
+	return err;
+}
+
+char empty_buf[528];
+
+static int flash_nand_mark_badblock(dmov_s *cmdlist, unsigned *ptrlist, unsigned page)
+{
+	if( page < (NUM_PROTECTED_BLOCKS<<6) ) {
+		dprintf(INFO, "\n   Protected block %x cannot be marked BAD", (page>>6));
+		return -1;
 	}
 	memset(empty_buf,0,528);
 	/* Going to first page of the block */
@@ -928,10 +1316,155 @@ static dmov_s *flash_cmdlist;
 static struct ptable *flash_ptable = NULL;
 static struct ptable *flash_devinfo = NULL;
 
+/* the command buffers above are shared, one user at a time */
+static mutex_t flash_mutex;
+
+static void flash_bbt_name_block(struct block_info *info);
+static int flash_read_ext_locked(struct ptentry *ptn, unsigned extra_per_page,
+			unsigned offset, void *data, unsigned bytes);
+static int flash_write_locked(struct ptentry *ptn, unsigned extra_per_page,
+		const void *data, unsigned bytes);
+
+static int flash_l2p_known_good(struct ptentry *ptn, unsigned page);
+
+/* erase a range of blocks, FLASH_ERASE_BATCH blocks per data mover run */
+#define FLASH_ERASE_BATCH 32
+
+static dmov_s *flash_erase_cmdlist;
+static unsigned *flash_erase_ptrlist;
+static unsigned *flash_erase_data;
+
+static int flash_nand_erase_range(unsigned page, unsigned lastpage)
+{
+	unsigned pages[FLASH_ERASE_BATCH];
+	unsigned n = 0, i;
+	int err = 0;
+
+	while((page < lastpage) || n) {
+		if((page < lastpage) && (n < FLASH_ERASE_BATCH)) {
+			if(flash_erase_cmdlist == NULL) {
+				if(flash_nand_erase_block(flash_cmdlist, flash_ptrlist, page))
+					err = -1;
+			} else if(flash_nand_erase_check(flash_cmdlist, flash_ptrlist, page) == 0) {
+				flash_nand_build_erase(flash_erase_cmdlist + n * FLASH_ERASE_CMDS,
+						       flash_erase_data + n * FLASH_ERASE_DATA, page);
+				flash_erase_ptrlist[n] = paddr(flash_erase_cmdlist + n * FLASH_ERASE_CMDS) >> 3;
+				pages[n++] = page;
+			}
+			page += num_pages_per_blk;
+			continue;
+		}
+
+		flash_erase_ptrlist[n - 1] |= CMD_PTR_LP;
+		if(dmov_exec_cmdptr(DMOV_NAND_CHAN, flash_erase_ptrlist))
+			err = -1;
+		for(i = 0; i < n; i++) {
+			if(flash_nand_erase_status(flash_erase_data + i * FLASH_ERASE_DATA, pages[i]))
+				err = -1;
+		}
+		n = 0;
+	}
+	return err;
+}
+
+/* Write pipeline
+ *
+ * Pages are programmed through two slots: while the data mover programs
+ * the page in one slot, the next page is prepared in the other. The
+ * first page of a block also carries the erase of the following good
+ * block in the same submission, so when we get there it is already
+ * erased and no synchronous erase is needed.
+ */
+#define FLASH_WRITE_SLOTS	2
+#define FLASH_WRITE_CMDS	64
+
+struct flash_write_slot {
+	dmov_s *cmdlist;
+	unsigned *ptrlist;
+	struct data_flash_io *data;
+	unsigned *erase_data;
+	unsigned page;
+	unsigned erase_page;		/* block erased ahead with this page, 0 if none */
+	const unsigned char *image;	/* source and its page in the piece being written */
+	unsigned pos;
+	struct dmov_req req;
+};
+
+static struct flash_write_slot flash_write_slots[FLASH_WRITE_SLOTS];
+
+static void flash_write_slot_init(struct flash_write_slot *slot)
+{
+	slot->cmdlist = memalign(32, (FLASH_WRITE_CMDS + FLASH_ERASE_CMDS) * sizeof(dmov_s));
+	slot->ptrlist = memalign(32, 32);
+	slot->data = memalign(32, sizeof(struct data_flash_io));
+	slot->erase_data = memalign(32, FLASH_ERASE_DATA * sizeof(unsigned));
+}
+
+static void flash_write_slot_prepare(struct flash_write_slot *slot, unsigned page,
+				     const unsigned char *image, const void *spare,
+				     unsigned pos, unsigned erase_page)
+{
+	dmov_s *erase = slot->cmdlist + FLASH_WRITE_CMDS;
+
+	slot->page = page;
+	slot->image = image;
+	slot->pos = pos;
+	slot->erase_page = erase_page;
+
+	flash_nand_build_write(slot->cmdlist, slot->data, page, image, spare, 0);
+	if (erase_page) {
+		flash_nand_build_erase(erase, slot->erase_data, erase_page);
+		slot->ptrlist[0] = paddr(slot->cmdlist) >> 3;
+		slot->ptrlist[1] = (paddr(erase) >> 3) | CMD_PTR_LP;
+	} else {
+		slot->ptrlist[0] = (paddr(slot->cmdlist) >> 3) | CMD_PTR_LP;
+	}
+}
+
+/* wait for a queued page, *erased tells if the erase ahead worked */
+static int flash_write_slot_finish(struct flash_write_slot *slot, int *erased)
+{
+	int err;
+
+	err = dmov_wait(&slot->req);
+	if (!err)
+		err = flash_nand_write_status(slot->data);
+
+	*erased = slot->erase_page && !flash_nand_erase_status(slot->erase_data, slot->erase_page);
+
+#if VERIFY_WRITE
+	if (!err) {
+		if( _flash_read_page(flash_cmdlist, flash_ptrlist, slot->page, flash_data, flash_data + 2048) != 0 ){
+			err=-1;
+		}
+		if( memcmp(flash_data, slot->image, 2048) ){
+			dprintf(CRITICAL, "   Verify error @ page %d\n", slot->page);
+			err=-1;
+		}
+	}
+#endif
+	return err;
+}
+
+/* the good block after the one holding 'page', if we know it without asking the flash */
+static unsigned flash_write_erase_ahead(struct ptentry *ptn, unsigned page, unsigned lastpage)
+{
+	unsigned next = (page & ~num_pages_per_blk_mask) + num_pages_per_blk;
+
+	if (next >= lastpage || next < (NUM_PROTECTED_BLOCKS<<6))
+		return 0;
+	if (!flash_l2p_known_good(ptn, next))
+		return 0;
+	return next;
+}
+
 void flash_init(void)
 {
 	ASSERT(flash_ptable == NULL);
 
+	mutex_init(&flash_mutex);
+	dmov_init();
+
 	flash_ptrlist = memalign(32, 1024);
 	flash_cmdlist = memalign(32, 1024);
 	flash_data = memalign(32, 4096 + 128);
@@ -946,6 +1479,26 @@ void flash_init(void)
 		}
 	}
 	flash_bad_blocks = -1;//block_tbl not present
+
+	/* one command list big enough to read a whole block */
+	if (num_pages_per_blk && flash_pagesize) {
+		flash_batch_cmdlist = memalign(32, flash_batch_cmdlist_size(num_pages_per_blk));
+		flash_batch_ptrlist = memalign(32, 32);
+		flash_batch_data = memalign(32, sizeof(struct data_flash_batch)
+						+ num_pages_per_blk * sizeof(struct data_flash_batch_page));
+		flash_batch_spare = memalign(32, num_pages_per_blk * flash_info.spare_size);
+		if (flash_batch_cmdlist && flash_batch_ptrlist && flash_batch_data && flash_batch_spare)
+			flash_batch_pages = num_pages_per_blk;
+	}
+
+	flash_erase_cmdlist = memalign(32, FLASH_ERASE_BATCH * FLASH_ERASE_CMDS * sizeof(dmov_s));
+	flash_erase_ptrlist = memalign(32, FLASH_ERASE_BATCH * sizeof(unsigned));
+	flash_erase_data = memalign(32, FLASH_ERASE_BATCH * FLASH_ERASE_DATA * sizeof(unsigned));
+	if (!flash_erase_ptrlist || !flash_erase_data)
+		flash_erase_cmdlist = NULL;
+
+	for(unsigned n = 0; n < FLASH_WRITE_SLOTS; n++)
+		flash_write_slot_init(&flash_write_slots[n]);
 }
 
 struct ptable *flash_get_ptable(void)
@@ -962,6 +1515,10 @@ void flash_set_ptable(struct ptable *new_ptable)
 {
 	ASSERT(flash_ptable == NULL && new_ptable != NULL);
 	flash_ptable = new_ptable;
+
+	/* a table loaded from flash is known before the partitions are */
+	for(int j = 0; j < block_tbl.count; j++)
+		flash_bbt_name_block(&block_tbl.blocks[j]);
 }
 
 void flash_set_devinfo(struct ptable * new_ptable)
@@ -974,16 +1531,13 @@ struct flash_info *flash_get_info(void)
 	return &flash_info;
 }
 
-int flash_erase(struct ptentry *ptn)
+static int flash_erase_locked(struct ptentry *ptn)
 {
 	unsigned block = ptn->start;
 	unsigned count = ptn->length;
 
 	set_nand_configuration(ptn->type);
-	while(count-- > 0) {
-		flash_erase_block(flash_cmdlist, flash_ptrlist, block * num_pages_per_blk);
-		block++;
-	}
+	flash_nand_erase_range(block * num_pages_per_blk, (block + count) * num_pages_per_blk);
 	return 0;
 }
 
@@ -998,7 +1552,56 @@ int flash_erase(struct ptentry *ptn)
  * .pos_from_pend is the space between the bad block's location and the partition's end
  * .count is the total number of bad blocks
  */
-int flash_bad_block_table(struct ptentry *ptn)
+static void flash_bbt_alloc(void)
+{
+	if (block_tbl.block_status == NULL)
+		block_tbl.block_status = (unsigned int *) malloc(sizeof(unsigned int) * flash_info.num_blocks);
+	memset(block_tbl.block_status, 0, sizeof(unsigned int) * flash_info.num_blocks);
+	memset(block_tbl.blocks, 0, sizeof(block_tbl.blocks));
+	block_tbl.count = 0;
+}
+
+/* fill in the partition a listed bad block belongs to */
+static void flash_bbt_name_block(struct block_info *info)
+{
+	struct ptable *ptable = flash_ptable;
+	unsigned block = info->pos;
+
+	info->partition[0] = '\0';
+	if (ptable != NULL) {
+		for(int j = 0; j < ptable_size(ptable); j++){
+			if( block >= ptable_get(ptable, j)->start ){
+				if(block < (ptable_get(ptable, j)->start + ptable_get(ptable, j)->length)){
+					strcpy( info->partition, ptable_get(ptable, j)->name );
+					info->pos_from_pstart = block - ptable_get(ptable, j)->start;
+					info->pos_from_pend = ptable_get(ptable, j)->start + ptable_get(ptable, j)->length - block;
+				}
+			}
+		}
+	}
+
+	if(strlen(info->partition)==0){
+		strcpy( info->partition, "ExtROM" );
+	}
+}
+
+static void flash_bbt_record(unsigned block, unsigned status)
+{
+	block_tbl.block_status[block] = status;
+	if (status == 0)
+		return;
+
+	if (block_tbl.count < (int)(sizeof(block_tbl.blocks) / sizeof(block_tbl.blocks[0]))) {
+		block_tbl.blocks[block_tbl.count].pos = block;
+		block_tbl.blocks[block_tbl.count].is_marked = (status == 1 ? 1 : 0);
+		flash_bbt_name_block(&block_tbl.blocks[block_tbl.count]);
+		block_tbl.count++;
+	}
+}
+
+static int flash_bbt_store(void);
+
+static int flash_bad_block_table_locked(struct ptentry *ptn)
 {
 	if (ptn == NULL) 
 	{
@@ -1006,42 +1609,278 @@ int flash_bad_block_table(struct ptentry *ptn)
 	}
 	unsigned block = ptn->start;
 	unsigned i = ptn->length;
-	block_tbl.block_status = (unsigned int *) malloc(sizeof(unsigned int) * flash_info.num_blocks);
-	block_tbl.count=0;
-	struct ptable *ptable;
-	ptable = flash_get_ptable();
 	int _isbad=0;
+
+	flash_bbt_alloc();
 	set_nand_configuration(ptn->type);
 	while(i-- > 0)
 	{
 		_isbad=flash_nand_block_isbad(flash_cmdlist, flash_ptrlist, block * num_pages_per_blk);
 		if(_isbad!=0){
-      		for(int j = 0; j < ptable_size(ptable); j++){
-      			if( block >= ptable_get(ptable, j)->start ){
-					if(block < (ptable_get(ptable, j)->start + ptable_get(ptable, j)->length)){
-      						strcpy( block_tbl.blocks[block_tbl.count].partition, ptable_get(ptable, j)->name );
-							block_tbl.blocks[block_tbl.count].pos_from_pstart = block - ptable_get(ptable, j)->start;
-							block_tbl.blocks[block_tbl.count].pos_from_pend = ptable_get(ptable, j)->start + ptable_get(ptable, j)->length - block;
-      				}
-				}
-      		}
-
-      		if(strlen(block_tbl.blocks[block_tbl.count].partition)==0){
-      			strcpy( block_tbl.blocks[block_tbl.count].partition, "ExtROM" );
-      		}
-			block_tbl.block_status[block] = (_isbad>0 ? 1 : 2);
-			block_tbl.blocks[block_tbl.count].pos = block;
-			block_tbl.blocks[block_tbl.count].is_marked = (_isbad>0 ? 1 : 0);
-			block_tbl.count++;
+			flash_bbt_record(block, (_isbad>0 ? 1 : 2));
 		}else{
 			block_tbl.block_status[block] = 0;
 		}
 		block++;
 	}
+
+	/* keep it on flash so the next boot does not have to scan */
+	flash_bad_blocks = block_tbl.count;
+	flash_bbt_gen++;
+	flash_bbt_store();
+
 	return block_tbl.count;
 }
 
-int flash_mark_badblock(struct ptentry *ptn, unsigned block)
+/* Persistent bad block table
+ *
+ * The table lives in the DEVINFO block behind the devinfo page, as a
+ * log: every update programs a numbered copy and its mirror into the
+ * next two erased pages, the block is not erased for it. A power cut
+ * while programming only spoils the copy being written, the older ones
+ * and the devinfo page stay intact. Loading reads the log up to the
+ * first erased page and takes the newest good copy. Only a full log is
+ * compacted by rewriting the block, like write_device_info() does.
+ *
+ * Each copy is a small header followed by 2 bits per block, protected
+ * by a crc32. Only blocks marked bad are kept: an operation error while
+ * probing a block is not stored, the block is used again until a write
+ * to it fails and marks it bad (or 'fill_bbt' scans it again).
+ */
+#define FLASH_BBT_MAGIC		0x54424248 /* "HBBT" */
+#define FLASH_BBT_VERSION	2
+#define FLASH_BBT_PAGE		1
+#define FLASH_BBT_COPIES	2
+
+struct flash_bbt_hdr {
+	unsigned magic;
+	unsigned version;
+	unsigned crc;
+	unsigned num_blocks;
+	unsigned seq;
+};
+
+static struct ptentry *flash_bbt_ptn = NULL;
+static int flash_bbt_busy = 0;
+static unsigned flash_bbt_seq = 0;
+static unsigned flash_bbt_next = 0;	/* next erased page of the log, 0 if unknown */
+
+static unsigned flash_bbt_map_size(void)
+{
+	return (flash_info.num_blocks + 3) / 4;
+}
+
+static void flash_bbt_encode(unsigned char *page)
+{
+	struct flash_bbt_hdr *hdr = (void*) page;
+	unsigned char *map = page + sizeof(*hdr);
+	unsigned block;
+
+	memset(page, 0xff, flash_pagesize);
+	memset(map, 0, flash_bbt_map_size());
+	for(block = 0; block < flash_info.num_blocks; block++)
+		if (block_tbl.block_status[block] == 1)
+			map[block >> 2] |= 1 << ((block & 3) << 1);
+
+	hdr->magic = FLASH_BBT_MAGIC;
+	hdr->version = FLASH_BBT_VERSION;
+	hdr->num_blocks = flash_info.num_blocks;
+	hdr->seq = flash_bbt_seq;
+	hdr->crc = crc32(0, map, flash_bbt_map_size());
+}
+
+static int flash_bbt_check(const unsigned char *page)
+{
+	const struct flash_bbt_hdr *hdr = (const void*) page;
+
+	if (hdr->magic != FLASH_BBT_MAGIC || hdr->version != FLASH_BBT_VERSION)
+		return -1;
+	if (hdr->num_blocks != flash_info.num_blocks)
+		return -1;
+	if (hdr->crc != crc32(0, page + sizeof(*hdr), flash_bbt_map_size()))
+		return -1;
+	return 0;
+}
+
+static void flash_bbt_decode(const unsigned char *page)
+{
+	const unsigned char *map = page + sizeof(struct flash_bbt_hdr);
+	unsigned block;
+
+	flash_bbt_alloc();
+	for(block = 0; block < flash_info.num_blocks; block++)
+		flash_bbt_record(block, (map[block >> 2] >> ((block & 3) << 1)) & 3);
+	flash_bad_blocks = block_tbl.count;
+	flash_bbt_seq = ((const struct flash_bbt_hdr*) page)->seq;
+	flash_bbt_gen++;
+}
+
+/* Used by write_device_info() which erases the DEVINFO block: returns the
+ * number of bytes (primary + mirror page) to write after the devinfo page,
+ * or 0 if there is no table yet. The log starts over behind them.
+ */
+unsigned flash_bbt_image(void *buf)
+{
+	unsigned char *page = buf;
+	unsigned n;
+
+	if (flash_bad_blocks < 0 || block_tbl.block_status == NULL)
+		return 0;
+	if (sizeof(struct flash_bbt_hdr) + flash_bbt_map_size() > flash_pagesize)
+		return 0;
+
+	flash_bbt_seq++;
+	for(n = 0; n < FLASH_BBT_COPIES; n++)
+		flash_bbt_encode(page + n * flash_pagesize);
+	flash_bbt_next = FLASH_BBT_PAGE + FLASH_BBT_COPIES;
+
+	return FLASH_BBT_COPIES * flash_pagesize;
+}
+
+/* the log is full: rewrite the DEVINFO block, keeping the devinfo page */
+static int flash_bbt_compact(void)
+{
+	unsigned char *buf;
+	unsigned size;
+	int r;
+
+	buf = memalign(32, (1 + FLASH_BBT_COPIES) * flash_pagesize);
+	if (buf == NULL)
+		return -1;
+
+	dprintf(INFO, "   flash_bbt_store: log full, rewriting DEVINFO\n");
+	r = flash_read_ext_locked(flash_bbt_ptn, 0, 0, buf, flash_pagesize);
+	if (r == 0) {
+		size = flash_bbt_image(buf + flash_pagesize);
+		r = (size ? flash_write_locked(flash_bbt_ptn, 0, buf, flash_pagesize + size) : -1);
+	}
+
+	free(buf);
+	return r;
+}
+
+/* append a copy and its mirror to the log */
+static int flash_bbt_store(void)
+{
+	unsigned char *buf;
+	unsigned first;
+	unsigned n = 0;
+	int r = 0;
+
+	if (flash_bbt_ptn == NULL || flash_bad_blocks < 0 || flash_bbt_busy)
+		return -1;
+	if (sizeof(struct flash_bbt_hdr) + flash_bbt_map_size() > flash_pagesize)
+		return -1;
+
+	buf = memalign(32, flash_pagesize);
+	if (buf == NULL)
+		return -1;
+
+	flash_bbt_busy = 1;
+	flash_bbt_seq++;
+	flash_bbt_encode(buf);
+	memset(flash_spare, 0xff, 64);
+	set_nand_configuration(flash_bbt_ptn->type);
+
+	first = flash_bbt_ptn->start * num_pages_per_blk;
+	while (n < FLASH_BBT_COPIES) {
+		if (flash_bbt_next < FLASH_BBT_PAGE || flash_bbt_next >= num_pages_per_blk) {
+			r = flash_bbt_compact();
+			break;
+		}
+		/* a page failing to program is left behind, the next one gets the copy */
+		if (_flash_write_page(flash_cmdlist, flash_ptrlist, first + flash_bbt_next++,
+				      buf, flash_spare) == 0) {
+			flash_stats.pages_written++;
+			n++;
+		}
+	}
+	flash_bbt_busy = 0;
+
+	if (r)
+		dprintf(CRITICAL, "   flash_bbt_store: failed to update bad block table\n");
+
+	free(buf);
+	return r;
+}
+
+/* a block just went bad: update the table in memory and on flash */
+static void flash_bbt_mark_bad(unsigned block)
+{
+	flash_bbt_gen++;
+
+	if (flash_bad_blocks < 0 || block >= flash_info.num_blocks)
+		return;
+	if (block_tbl.block_status[block] == 1)
+		return;
+
+	if (block_tbl.block_status[block] == 0) {
+		flash_bbt_record(block, 1);
+	} else {
+		block_tbl.block_status[block] = 1;
+		for(int j = 0; j < block_tbl.count; j++)
+			if (block_tbl.blocks[j].pos == block)
+				block_tbl.blocks[j].is_marked = 1;
+	}
+	flash_bad_blocks = block_tbl.count;
+	flash_bbt_store();
+}
+
+static int flash_bbt_load_locked(struct ptentry *ptn)
+{
+	unsigned char *buf, *best;
+	unsigned first, n;
+	unsigned copies = 0;
+
+	flash_bbt_ptn = ptn;
+	flash_bbt_next = 0;
+	if (ptn == NULL)
+		return -1;
+
+	buf = memalign(32, 2 * (flash_pagesize + 128));
+	if (buf == NULL)
+		return -1;
+	best = buf + flash_pagesize + 128;
+
+	set_nand_configuration(ptn->type);
+	first = ptn->start * num_pages_per_blk;
+	for(n = FLASH_BBT_PAGE; n < num_pages_per_blk; n++) {
+		const struct flash_bbt_hdr *hdr = (const void*) buf;
+		unsigned seq;
+
+		if (_flash_read_page(flash_cmdlist, flash_ptrlist, first + n,
+				     buf, buf + flash_pagesize))
+			continue;
+		/* the log ends at the first erased page */
+		if (hdr->magic == 0xffffffff)
+			break;
+		if (flash_bbt_check(buf))
+			continue;
+
+		seq = hdr->seq;
+		if (copies && seq == ((struct flash_bbt_hdr*) best)->seq) {
+			copies++;
+		} else if (!copies || (int)(seq - ((struct flash_bbt_hdr*) best)->seq) > 0) {
+			memcpy(best, buf, flash_pagesize);
+			copies = 1;
+		}
+	}
+	flash_bbt_next = n;
+
+	if (copies) {
+		flash_bbt_decode(best);
+		/* the newest copy lost its mirror, write the pair again */
+		if (copies < FLASH_BBT_COPIES) {
+			dprintf(INFO, "   flash_bbt_load: restoring the mirror\n");
+			flash_bbt_store();
+		}
+	}
+
+	free(buf);
+	return (copies ? flash_bad_blocks : -1);
+}
+
+static int flash_mark_badblock_locked(struct ptentry *ptn, unsigned block)
 {
 	unsigned firstpage = ptn->start * num_pages_per_blk;
 	unsigned lastpage = (ptn->start + ptn->length) * num_pages_per_blk;
@@ -1064,10 +1903,155 @@ int flash_mark_badblock(struct ptentry *ptn, unsigned block)
 	
 	printf("\n   flash_mark_badblock: block %i @ '%s'", block, ptn->name);
 	
-	return _flash_mark_badblock(flash_cmdlist, flash_ptrlist, (block << 6));
+	if (_flash_mark_badblock(flash_cmdlist, flash_ptrlist, (block << 6)))
+		return -1;
+
+	flash_bbt_mark_bad(block);
+	return 0;
 }
 
-int flash_read_ext(struct ptentry *ptn, unsigned extra_per_page,
+/* Logical to physical block map
+ *
+ * Partition offsets skip bad blocks, so logical block N of a partition is
+ * the N-th good block counted from ptn->start. The map for a partition is
+ * filled in lazily, only as far as a lookup needs, and thrown away when
+ * the set of bad blocks changes (flash_bbt_gen).
+ */
+#define FLASH_L2P_SLOTS 8
+
+struct flash_l2p {
+	unsigned start;
+	unsigned length;
+	unsigned gen;
+	unsigned mapped;		/* logical blocks resolved so far */
+	unsigned scanned;		/* physical blocks examined so far */
+	unsigned short *map;	/* logical -> physical, relative to start */
+	unsigned char *bad;		/* 1 bit per examined physical block */
+};
+
+static struct flash_l2p flash_l2p_cache[FLASH_L2P_SLOTS];
+static unsigned flash_l2p_next = 0;
+
+static struct flash_l2p *flash_l2p_get(struct ptentry *ptn)
+{
+	struct flash_l2p *l2p = NULL;
+	unsigned n;
+
+	for(n = 0; n < FLASH_L2P_SLOTS; n++) {
+		if (flash_l2p_cache[n].map && flash_l2p_cache[n].start == ptn->start
+			&& flash_l2p_cache[n].length == ptn->length) {
+			l2p = &flash_l2p_cache[n];
+			break;
+		}
+	}
+
+	if (l2p == NULL) {
+		l2p = &flash_l2p_cache[flash_l2p_next++ % FLASH_L2P_SLOTS];
+		free(l2p->map);
+		free(l2p->bad);
+		l2p->start = ptn->start;
+		l2p->length = ptn->length;
+		l2p->map = malloc(ptn->length * sizeof(unsigned short));
+		l2p->bad = malloc((ptn->length + 7) / 8);
+		if (l2p->map == NULL || l2p->bad == NULL) {
+			free(l2p->map);
+			free(l2p->bad);
+			l2p->map = NULL;
+			l2p->bad = NULL;
+			return NULL;
+		}
+		l2p->gen = flash_bbt_gen - 1;
+	}
+
+	if (l2p->gen != flash_bbt_gen) {
+		l2p->gen = flash_bbt_gen;
+		l2p->mapped = 0;
+		l2p->scanned = 0;
+		memset(l2p->bad, 0, (l2p->length + 7) / 8);
+	}
+	return l2p;
+}
+
+/* examine physical blocks until 'block' (relative to start) is known */
+static void flash_l2p_scan(struct flash_l2p *l2p, unsigned block)
+{
+	while (l2p->scanned <= block && l2p->scanned < l2p->length) {
+		unsigned phys = l2p->start + l2p->scanned;
+
+		flash_stats.l2p_probes++;
+		if (flash_nand_page_in_bad_block(flash_cmdlist, flash_ptrlist, phys * num_pages_per_blk))
+			l2p->bad[l2p->scanned >> 3] |= 1 << (l2p->scanned & 7);
+		else
+			l2p->map[l2p->mapped++] = l2p->scanned;
+		l2p->scanned++;
+	}
+}
+
+/* returns the physical block (relative to ptn->start) holding logical
+ * block 'lblock', or -1 if the partition does not have that many good
+ * blocks.
+ */
+static int flash_l2p_translate(struct ptentry *ptn, unsigned lblock)
+{
+	struct flash_l2p *l2p = flash_l2p_get(ptn);
+	unsigned block, bad;
+
+	flash_stats.l2p_lookups++;
+	if (l2p == NULL) {
+		/* out of memory, walk the blocks the slow way */
+		for(block = 0, bad = 0; block < ptn->length; block++) {
+			if (flash_nand_page_in_bad_block(flash_cmdlist, flash_ptrlist,
+							(ptn->start + block) * num_pages_per_blk))
+				bad++;
+			else if (block - bad == lblock)
+				return block;
+		}
+		return -1;
+	}
+
+	while (l2p->mapped <= lblock && l2p->scanned < l2p->length)
+		flash_l2p_scan(l2p, l2p->scanned);
+
+	return (lblock < l2p->mapped ? l2p->map[lblock] : -1);
+}
+
+/* is the physical block containing 'page' known to be bad */
+static int flash_l2p_block_bad(struct ptentry *ptn, unsigned page)
+{
+	struct flash_l2p *l2p;
+	unsigned block = page / num_pages_per_blk - ptn->start;
+
+	if (block >= ptn->length)
+		return 0;
+
+	l2p = flash_l2p_get(ptn);
+	if (l2p == NULL)
+		return flash_nand_page_in_bad_block(flash_cmdlist, flash_ptrlist, page);
+
+	flash_l2p_scan(l2p, block);
+	return (l2p->bad[block >> 3] >> (block & 7)) & 1;
+}
+
+/* same, but never touches the flash: 0 unless the block is known to be good */
+static int flash_l2p_known_good(struct ptentry *ptn, unsigned page)
+{
+	unsigned block = page / num_pages_per_blk - ptn->start;
+	unsigned n;
+
+	if (block >= ptn->length)
+		return 0;
+
+	for(n = 0; n < FLASH_L2P_SLOTS; n++) {
+		struct flash_l2p *l2p = &flash_l2p_cache[n];
+
+		if (l2p->map && l2p->start == ptn->start && l2p->length == ptn->length
+			&& l2p->gen == flash_bbt_gen)
+			return (block < l2p->scanned) && !((l2p->bad[block >> 3] >> (block & 7)) & 1);
+	}
+	return 0;
+}
+
+static int flash_read_ext_locked(struct ptentry *ptn, unsigned extra_per_page,
 			unsigned offset, void *data, unsigned bytes)
 {
 	unsigned page = (ptn->start * num_pages_per_blk) + (offset / flash_pagesize);
@@ -1091,25 +2075,12 @@ int flash_read_ext(struct ptentry *ptn, unsigned extra_per_page,
 	// Adjust page offset based on number of bad blocks from start to current page
 	if (start_block < current_block)
 	{
-		start_block_count = (current_block - start_block);
-		while (start_block_count && (start_block < (ptn->start + ptn->length))) {
-			if(flash_bad_blocks == -1) {
-				//block_tbl is not created
-				if (_flash_block_isbad(flash_cmdlist, flash_ptrlist, start_block*64)) {
-					page += num_pages_per_blk;
-				}else{
-					start_block_count--;
-				}
-			} else {
-				//block_tbl is created
-				if((int)block_tbl.block_status[start_block] > 0) {
-					page += num_pages_per_blk;
-				}else{
-					start_block_count--;
-				}
-			}
-			start_block++;
-		}
+		int block = flash_l2p_translate(ptn, current_block - start_block);
+
+		if (block < 0)
+			start_block_count = 1;
+		else
+			page += (block - (current_block - start_block)) * num_pages_per_blk;
 	}
 
 	while((page < lastpage) && !start_block_count) {
@@ -1118,6 +2089,31 @@ int flash_read_ext(struct ptentry *ptn, unsigned extra_per_page,
 			return 0;
 		}
 
+		// read the rest of the run inside this block in one go
+		if ((count > 1) && flash_batch_pages) {
+			unsigned run = num_pages_per_blk - (page & num_pages_per_blk_mask);
+			if (run > count)
+				run = count;
+			if (run > flash_batch_pages)
+				run = flash_batch_pages;
+
+			if ((run > 1) && !flash_nand_page_in_bad_block(flash_cmdlist, flash_ptrlist, page)) {
+				result = _flash_nand_read_pages(page, run, image, extra_per_page);
+				if (result >= 0) {
+					page += result;
+					image += result * (flash_pagesize + extra_per_page);
+					count -= result;
+					if (result < (int)run) {
+						// bad page, go to next page
+						page++;
+						errors++;
+					}
+					continue;
+				}
+				// data mover error, retry page by page
+			}
+		}
+
 		result = _flash_read_page(flash_cmdlist, flash_ptrlist, page, image, spare);
 
 		if (result == -1) {
@@ -1148,92 +2144,585 @@ int flash_read_ext(struct ptentry *ptn, unsigned extra_per_page,
 	return 0xffffffff;
 }
 
-int flash_write(struct ptentry *ptn, unsigned extra_per_page, const void *data,
-		unsigned bytes)
+/* crc32 of the page data of an image laid out the way flash_write()
+ * takes it, the spare bytes are left out as the controller only keeps
+ * part of them
+ */
+unsigned long flash_image_crc(unsigned long crc, const void *data, unsigned bytes,
+			      unsigned extra_per_page)
 {
-	unsigned page = ptn->start * num_pages_per_blk;
-	unsigned lastpage = (ptn->start + ptn->length) * num_pages_per_blk;
-	unsigned *spare = (unsigned*) flash_spare;
 	const unsigned char *image = data;
 	unsigned wsize = flash_pagesize + extra_per_page;
-	unsigned n;
+
+	if (!extra_per_page)
+		return crc32(crc, data, bytes);
+
+	for (; bytes >= wsize; bytes -= wsize, image += wsize)
+		crc = crc32(crc, image, flash_pagesize);
+	return crc;
+}
+
+/* Read back the first 'bytes' written to ptn and checksum them like
+ * flash_image_crc(). Each block is checksummed while the next one is
+ * read, 'work' holds two blocks.
+ */
+static int flash_read_crc_locked(struct ptentry *ptn, unsigned extra_per_page,
+				 unsigned bytes, void *work, unsigned long *crc)
+{
+	unsigned wsize = flash_pagesize + extra_per_page;
+	unsigned pages = bytes / wsize;
+	unsigned char *buf[2];
+	unsigned lblock = 0, cur = 0, have = 0;
+	unsigned page, count;
 	int r;
 
+	buf[0] = work;
+	buf[1] = buf[0] + num_pages_per_blk * wsize;
+	*crc = 0;
+
+	if (!flash_batch_pages) {
+		/* no batch buffers, read it the slow way */
+		for (; pages; pages -= count, lblock++) {
+			count = MIN(pages, num_pages_per_blk);
+			if (flash_read_ext_locked(ptn, extra_per_page, lblock * num_pages_per_blk * flash_pagesize,
+						  buf[0], count * wsize))
+				return -1;
+			*crc = flash_image_crc(*crc, buf[0], count * wsize, extra_per_page);
+		}
+		return 0;
+	}
+
+	set_nand_configuration(ptn->type);
+
+	while (pages || have) {
+		count = MIN(pages, num_pages_per_blk);
+		page = 0;
+
+		if (count) {
+			int block = flash_l2p_translate(ptn, lblock);
+
+			if (block < 0) {
+				printf("\n   flash_verify: out of good blocks");
+				return -1;
+			}
+			page = (ptn->start + block) * num_pages_per_blk;
+			flash_nand_read_pages_start(page, count, buf[cur], extra_per_page);
+		}
+
+		/* checksum the previous block while this one is read */
+		if (have)
+			*crc = flash_image_crc(*crc, buf[cur ^ 1], have * wsize, extra_per_page);
+		have = 0;
+
+		if (count) {
+			r = flash_nand_read_pages_finish(page, count, buf[cur], extra_per_page);
+			if (r != (int) count) {
+				printf("\n   flash_verify: read error @ page %d", page + ((r < 0) ? 0 : r));
+				return -1;
+			}
+			have = count;
+			pages -= count;
+			lblock++;
+			cur ^= 1;
+		}
+	}
+	return 0;
+}
+
+/* state of a write in progress, a write may be fed in several pieces */
+struct flash_write_state {
+	struct ptentry *ptn;
+	unsigned extra_per_page;
+	unsigned wsize;
+	unsigned page;			/* next page to program */
+	unsigned lastpage;
+	unsigned erased;		/* block start already erased */
+	unsigned slot;
+	int shrink_on_skip;
+	int active;
+};
+
+static struct flash_write_state flash_stream;
+
+static int flash_write_state_init(struct flash_write_state *w, struct ptentry *ptn,
+				  unsigned extra_per_page)
+{
+	unsigned *spare = (unsigned*) flash_spare;
+	unsigned n;
+
 	if (ptn->type == TYPE_MODEM_PARTITION) {
 		dprintf(CRITICAL, "\n   flash_write_image: modem partition not supported");
 		return -1;
 	}
 
+	w->ptn = ptn;
+	w->extra_per_page = extra_per_page;
+	w->wsize = flash_pagesize + extra_per_page;
+	w->page = ptn->start * num_pages_per_blk;
+	w->lastpage = (ptn->start + ptn->length) * num_pages_per_blk;
+	w->erased = 0;
+	w->slot = 0;
+	w->shrink_on_skip = 0;
+
 	set_nand_configuration(ptn->type);
 	for(n = 0; n < 16; n++) spare[n] = 0xffffffff;
 
-	while(bytes > 0) {
-		if(bytes < wsize) {
-			printf("\n   flash_write_image: image undersized (%d < %d)", bytes, wsize);
-			return -1;
-		}
-		if(page >= lastpage) {
-			printf("\n   flash_write_image: out of space");
-			return -1;
+	return 0;
+}
+
+/* an all 0xff page (data and spare) is what the erase left behind */
+#if ARM_WITH_NEON
+/* AND 64 bytes a round into q8, len is a non zero multiple of 64. The
+ * context switch does not save NEON registers, so no thread may run in
+ * between: interrupts stay off for the few microseconds of a page.
+ */
+static int flash_page_is_blank_neon(const unsigned char *p, unsigned len)
+{
+	unsigned lo, hi;
+
+	enter_critical_section();
+	__asm__ volatile(
+		"vmov.i8	q8, #0xff\n"
+		"1:\n"
+		"vld1.32	{d0-d3}, [%2]!\n"
+		"vld1.32	{d4-d7}, [%2]!\n"
+		"vand		q0, q0, q1\n"
+		"vand		q2, q2, q3\n"
+		"vand		q8, q8, q0\n"
+		"vand		q8, q8, q2\n"
+		"subs		%3, %3, #64\n"
+		"bne		1b\n"
+		"vand		d16, d16, d17\n"
+		"vmov		%0, %1, d16\n"
+		: "=r" (lo), "=r" (hi), "+r" (p), "+r" (len)
+		:
+		: "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", "d16", "d17",
+		  "cc", "memory");
+	exit_critical_section();
+
+	return (lo & hi) == 0xffffffff;
+}
+#endif
+
+static int flash_page_is_blank(const unsigned char *p, unsigned len)
+{
+	const unsigned *w = (const unsigned*) p;
+	unsigned n;
+
+	if ((unsigned) p & 3) {
+		for (n = 0; n < len; n++)
+			if (p[n] != 0xff)
+				return 0;
+		return 1;
+	}
+
+	/* a page of data rarely starts with 0xffffffff */
+	if (len >= 4 && *w != 0xffffffff)
+		return 0;
+
+#if ARM_WITH_NEON
+	n = len & ~63;
+	if (n) {
+		if (!flash_page_is_blank_neon(p, n))
+			return 0;
+		w = (const unsigned*) (p + n);
+		len -= n;
+	}
+#endif
+
+	/* eight words a round, the len is a multiple of 32 (2048 + 64) */
+	for (n = len >> 5; n; n--, w += 8) {
+		if ((w[0] & w[1] & w[2] & w[3] & w[4] & w[5] & w[6] & w[7]) != 0xffffffff)
+			return 0;
+	}
+	for (n = (len & 31) >> 2; n; n--)
+		if (*w++ != 0xffffffff)
+			return 0;
+	return 1;
+}
+
+/* where the pages of a piece come from */
+struct flash_write_src {
+	const unsigned char *data;	/* contiguous image, or */
+	const void * const *pages;	/* one source per page, NULL leaves the page erased */
+};
+
+static const unsigned char *flash_write_src_page(const struct flash_write_src *src,
+						 unsigned pos, unsigned wsize)
+{
+	if (src->pages)
+		return src->pages[pos];
+	return src->data + pos * wsize;
+}
+
+/* Program 'bytes' of image, 'more' bytes will follow in later calls.
+ * A write failure restarts the current block, so every call but the
+ * last one has to end on a block boundary.
+ */
+static int flash_write_run(struct flash_write_state *w, const struct flash_write_src *src,
+			   unsigned bytes, unsigned more)
+{
+	struct ptentry *ptn = w->ptn;
+	unsigned page = w->page;
+	unsigned lastpage = w->lastpage;
+	unsigned *spare = (unsigned*) flash_spare;
+	unsigned wsize = w->wsize;
+	unsigned extra_per_page = w->extra_per_page;
+	unsigned pos = 0;
+	unsigned left;
+	struct flash_write_slot *cur, *prev = NULL;
+	int r;
+
+	set_nand_configuration(ptn->type);
+
+	/* learn the bad blocks up front, nothing may touch the flash
+	 * while a page is queued
+	 */
+	flash_l2p_block_bad(ptn, lastpage - num_pages_per_blk);
+
+	for(;;) {
+		left = bytes - pos * wsize;
+
+		/* prepare the next page while the previous one programs */
+		cur = NULL;
+		if ((left >= wsize) && (page < lastpage)
+			&& (((page & num_pages_per_blk_mask) != 0) || (page == w->erased))) {
+			const unsigned char *image = flash_write_src_page(src, pos, wsize);
+			unsigned ahead = 0;
+
+			/* without spare bytes the page gets the blank spare anyway */
+			if (image && flash_page_is_blank(image, extra_per_page ? wsize : flash_pagesize))
+				image = NULL;
+			if (!image) {
+				flash_stats.pages_blank++;
+				/* nothing to program, the page stays erased */
+				if (page == w->erased)
+					w->erased = 0;
+				page++;
+				pos++;
+				continue;
+			}
+
+			if ((page == w->erased) && (left + more > num_pages_per_blk * wsize))
+				ahead = flash_write_erase_ahead(ptn, page, lastpage);
+
+			cur = &flash_write_slots[w->slot];
+			flash_write_slot_prepare(cur, page, image,
+						 extra_per_page ? image + flash_pagesize : (const void*) spare,
+						 pos, ahead);
 		}
 
-		if((page & num_pages_per_blk_mask) == 0) {
-			if(flash_erase_block(flash_cmdlist, flash_ptrlist, page)) {
-				page += num_pages_per_blk;
-				/*
-				 * koko: Testing stuff...
-				 *		If the img has exactly the same size as the partition
-				 * 		(i.e. the boot.img from a NANDROID backup has the size
-				 * 		of the 'boot' partition, not the kernel's real size)
-				 *		and there is a flash_erase_block error(bad block?)
-				 * 		we will fail writing it to the same sized 'boot' partition
-				 * 		with an error 'flash_write_image: out of space'.
-				 * 		So while we skip the bad block(64pages), we can 
-				 * 		decrease the remaining bytes accordingly and hope that the 'real'
-				 *		part of the image (don't care for the last FFs) is written..
-				 */
-				if(!memcmp(ptn->name	, "boot"	, strlen(ptn->name))
-				|| !memcmp(ptn->name	, "recovery", strlen(ptn->name))
-				|| !memcmp(ptn->name+1	, "boot"	, strlen(ptn->name+1))) {
-					bytes -= num_pages_per_blk*wsize;
+		if (prev) {
+			int ok;
+
+			r = flash_write_slot_finish(prev, &ok);
+			if (ok)
+				w->erased = prev->erase_page;
+			if (r) {
+				dprintf(INFO, "   flash_write_image: write failure @ page %d (src %d)\n", prev->page, prev->pos * wsize);
+				page = prev->page;
+				pos = prev->pos - (page & num_pages_per_blk_mask);
+				page &= ~num_pages_per_blk_mask;
+				flash_erase_block(flash_cmdlist, flash_ptrlist, page);
+				if (ptn->type != TYPE_MODEM_PARTITION) {
+					if (!_flash_mark_badblock(flash_cmdlist, flash_ptrlist, page))
+						flash_bbt_mark_bad(page / num_pages_per_blk);
 				}
+				printf("\n   flash_write_image: restart write @ page %d (src %d)", page, pos * wsize);
+				page += num_pages_per_blk;
+				prev = NULL;
+				w->erased = 0;
+				set_nand_configuration(ptn->type);
+				flash_l2p_block_bad(ptn, lastpage - num_pages_per_blk);
 				continue;
 			}
+			prev = NULL;
 		}
 
-		if(extra_per_page) {
-			r = _flash_write_page(flash_cmdlist, flash_ptrlist, page, image, image + flash_pagesize);
-		} else {
-			r = _flash_write_page(flash_cmdlist, flash_ptrlist, page, image, spare);
+		if (cur) {
+			if (page == w->erased)
+				w->erased = 0;
+			dmov_submit(&cur->req, DMOV_NAND_CHAN, cur->ptrlist);
+			flash_stats.pages_written++;
+			prev = cur;
+			w->slot = (w->slot + 1) % FLASH_WRITE_SLOTS;
+			page++;
+			pos++;
+			continue;
 		}
-		if(r) {
-			dprintf(INFO, "   flash_write_image: write failure @ page %d (src %d)\n", page, image - (const unsigned char *)data);
-			image -= (page & num_pages_per_blk_mask) * wsize;
-			bytes += (page & num_pages_per_blk_mask) * wsize;
-			page &= ~num_pages_per_blk_mask;
-			flash_erase_block(flash_cmdlist, flash_ptrlist, page);
-			if (ptn->type != TYPE_MODEM_PARTITION) {
-				_flash_mark_badblock(flash_cmdlist, flash_ptrlist, page);
-			}
-			printf("\n   flash_write_image: restart write @ page %d (src %d)", page, image - (const unsigned char *)data);
+
+		/* nothing queued from here on */
+		w->page = page;
+		if (left == 0)
+			return 0;
+		if(left < wsize) {
+			printf("\n   flash_write_image: image undersized (%d < %d)", left, wsize);
+			return -1;
+		}
+		if(page >= lastpage) {
+			printf("\n   flash_write_image: out of space");
+			return -1;
+		}
+
+		/* block start which was not erased ahead */
+		int bad = flash_l2p_block_bad(ptn, page);
+
+		if (bad)
+			printf("\n   Skipping block @%d [%dMB], (MARKED BAD block)", (page >> 6), (page >> 9));
+		if(bad || flash_erase_block(flash_cmdlist, flash_ptrlist, page)) {
 			page += num_pages_per_blk;
+			/*
+			 * koko: Testing stuff...
+			 *		If the img has exactly the same size as the partition
+			 * 		(i.e. the boot.img from a NANDROID backup has the size
+			 * 		of the 'boot' partition, not the kernel's real size)
+			 *		and there is a flash_erase_block error(bad block?)
+			 * 		we will fail writing it to the same sized 'boot' partition
+			 * 		with an error 'flash_write_image: out of space'.
+			 * 		So while we skip the bad block(64pages), we can 
+			 * 		decrease the remaining bytes accordingly and hope that the 'real'
+			 *		part of the image (don't care for the last FFs) is written..
+			 */
+			if (w->shrink_on_skip) {
+				if (left > num_pages_per_blk*wsize)
+					bytes -= num_pages_per_blk*wsize;
+				else
+					bytes = pos * wsize;
+			}
 			continue;
 		}
-		page++;
-		image += wsize;
-		bytes -= wsize;
+		w->erased = page;
 	}
+}
+
+/* erase any remaining pages in the partition */
+static void flash_write_tail(struct flash_write_state *w)
+{
+	unsigned page = (w->page + num_pages_per_blk_mask) & (~num_pages_per_blk_mask);
+
+	set_nand_configuration(w->ptn->type);
+	flash_nand_erase_range(page, w->lastpage);
+}
+
+static int flash_write_locked(struct ptentry *ptn, unsigned extra_per_page,
+		const void *data, unsigned bytes)
+{
+	struct flash_write_state w;
+	struct flash_write_src src;
 
-	/* erase any remaining pages in the partition */
-	page = (page + num_pages_per_blk_mask) & (~num_pages_per_blk_mask);
-	while(page < lastpage){
-		flash_erase_block(flash_cmdlist, flash_ptrlist, page);
-		page += num_pages_per_blk;
+	if (flash_write_state_init(&w, ptn, extra_per_page))
+		return -1;
+
+	if(!memcmp(ptn->name	, "boot"	, strlen(ptn->name))
+	|| !memcmp(ptn->name	, "recovery", strlen(ptn->name))
+	|| !memcmp(ptn->name+1	, "boot"	, strlen(ptn->name+1))) {
+		w.shrink_on_skip = 1;
 	}
 
+	src.data = data;
+	src.pages = NULL;
+	if (flash_write_run(&w, &src, bytes, 0))
+		return -1;
+
+	flash_write_tail(&w);
 	return 0;
 }
 
+int flash_erase(struct ptentry *ptn)
+{
+	int ret;
+
+	TRACE_BEGIN("nand_erase", ptn->length);
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	ret = flash_erase_locked(ptn);
+	mutex_release(&flash_mutex);
+	TRACE_END("nand_erase", ret);
+	return ret;
+}
+
+int flash_bad_block_table(struct ptentry *ptn)
+{
+	int ret;
+
+	mutex_acquire(&flash_mutex);
+	ret = flash_bad_block_table_locked(ptn);
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+int flash_bbt_load(struct ptentry *ptn)
+{
+	int ret;
+
+	mutex_acquire(&flash_mutex);
+	ret = flash_bbt_load_locked(ptn);
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+int flash_mark_badblock(struct ptentry *ptn, unsigned block)
+{
+	int ret;
+
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	ret = flash_mark_badblock_locked(ptn, block);
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+int flash_read_ext(struct ptentry *ptn, unsigned extra_per_page,
+			unsigned offset, void *data, unsigned bytes)
+{
+	int ret;
+
+	TRACE_BEGIN("nand_read", bytes);
+	mutex_acquire(&flash_mutex);
+	ret = flash_read_ext_locked(ptn, extra_per_page, offset, data, bytes);
+	mutex_release(&flash_mutex);
+	TRACE_END("nand_read", ret);
+	return ret;
+}
+
+int flash_write(struct ptentry *ptn, unsigned extra_per_page, const void *data,
+		unsigned bytes)
+{
+	int ret;
+
+	TRACE_BEGIN("nand_write", bytes);
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	ret = flash_write_locked(ptn, extra_per_page, data, bytes);
+	mutex_release(&flash_mutex);
+	TRACE_END("nand_write", ret);
+	return ret;
+}
+
+int flash_read_crc(struct ptentry *ptn, unsigned extra_per_page, unsigned bytes,
+		   void *work, unsigned long *crc)
+{
+	int ret;
+
+	mutex_acquire(&flash_mutex);
+	ret = flash_read_crc_locked(ptn, extra_per_page, bytes, work, crc);
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+unsigned flash_generation(void)
+{
+	return flash_gen;
+}
+
+void flash_get_stats(struct flash_stats *stats)
+{
+	enter_critical_section();
+	*stats = flash_stats;
+	exit_critical_section();
+}
+
+unsigned flash_bench_translate(struct ptentry *ptn, unsigned loops)
+{
+	unsigned good, n;
+	bigtime_t start;
+
+	mutex_acquire(&flash_mutex);
+	set_nand_configuration(ptn->type);
+
+	/* the first lookup of the last block scans the partition */
+	for (good = ptn->length; good > 0; good--)
+		if (flash_l2p_translate(ptn, good - 1) >= 0)
+			break;
+
+	start = current_time_hires();
+	for (n = 0; n < loops && good; n++)
+		flash_l2p_translate(ptn, n % good);
+	start = current_time_hires() - start;
+
+	mutex_release(&flash_mutex);
+	return n ? (unsigned) (start * 1000 / n) : 0;
+}
+
+unsigned flash_write_chunk_size(unsigned extra_per_page)
+{
+	return num_pages_per_blk * (flash_pagesize + extra_per_page);
+}
+
+int flash_write_begin(struct ptentry *ptn, unsigned extra_per_page)
+{
+	int ret = -1;
+
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	if (!flash_stream.active) {
+		ret = flash_write_state_init(&flash_stream, ptn, extra_per_page);
+		flash_stream.active = (ret == 0);
+	}
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+static int flash_write_piece(const struct flash_write_src *src, unsigned bytes, unsigned more)
+{
+	int ret = -1;
+
+	mutex_acquire(&flash_mutex);
+	if (flash_stream.active) {
+		ret = flash_write_run(&flash_stream, src, bytes, more);
+		if (ret)
+			flash_stream.active = 0;
+	}
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+int flash_write_pages(const void *data, unsigned bytes, unsigned more)
+{
+	struct flash_write_src src;
+
+	src.data = data;
+	src.pages = NULL;
+	return flash_write_piece(&src, bytes, more);
+}
+
+int flash_write_page_list(const void * const *pages, unsigned count, unsigned more)
+{
+	struct flash_write_src src;
+	unsigned wsize = flash_stream.wsize;
+
+	src.data = NULL;
+	src.pages = pages;
+	return flash_write_piece(&src, count * wsize, more * wsize);
+}
+
+int flash_write_end(void)
+{
+	int ret = -1;
+
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	if (flash_stream.active) {
+		flash_write_tail(&flash_stream);
+		flash_stream.active = 0;
+		ret = 0;
+	}
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
+int flash_write_abort(void)
+{
+	int ret;
+
+	mutex_acquire(&flash_mutex);
+	flash_gen++;
+	ret = flash_stream.active ? 0 : -1;
+	flash_stream.active = 0;
+	mutex_release(&flash_mutex);
+	return ret;
+}
+
 #if 0
 static int flash_read_page(unsigned page, void *data, void *extra)
 {
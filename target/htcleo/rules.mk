@@ -20,6 +20,7 @@ TAGS_ADDR        		:= "(BASE_ADDR+0x00000100)"
 KERNEL_ADDR      		:= "(BASE_ADDR+0x00008000)"
 RAMDISK_ADDR     		:= "(BASE_ADDR+0x01000000)"
 SCRATCH_ADDR     		:= "(BASE_ADDR+0x02000000)"
+QUIET_BOOT_WINDOW		?= 2000
 
 CFLAGS += -mlittle-endian -mfpu=neon
 LDFLAGS += -EL
@@ -47,7 +48,8 @@ DEFINES += \
 	KERNEL_ADDR=$(KERNEL_ADDR) \
 	RAMDISK_ADDR=$(RAMDISK_ADDR) \
 	SCRATCH_ADDR=$(SCRATCH_ADDR) \
-	DISPLAY_TYPE_LCDC=$(DISPLAY_TYPE_LCDC)
+	DISPLAY_TYPE_LCDC=$(DISPLAY_TYPE_LCDC) \
+	QUIET_BOOT_WINDOW=$(QUIET_BOOT_WINDOW)
 
 OBJS += \
 	$(LOCAL_DIR)/acpuclock.o \